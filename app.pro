@@ -74,14 +74,20 @@ HEADERS += \
     src/FoilPicsHints.h \
     src/FoilPicsImageProvider.h \
     src/FoilPicsImageRequest.h \
+    src/FoilPicsKeyIndex.h \
     src/FoilPicsModel.h \
+    src/FoilPicsModelData.h \
     src/FoilPicsModelWatch.h \
     src/FoilPicsRole.h \
+    src/FoilPicsRowIndex.h \
+    src/FoilPicsSegmentStore.h \
     src/FoilPicsSelection.h \
     src/FoilPicsSelectionState.h \
     src/FoilPicsTask.h \
+    src/FoilPicsThumbnail.h \
     src/FoilPicsThumbnailerPlugin.h \
-    src/FoilPicsThumbnailProvider.h
+    src/FoilPicsThumbnailProvider.h \
+    src/FoilPicsVaultLayout.h
 
 SOURCES += \
     src/FoilPicsBusyState.cpp \
@@ -91,14 +97,20 @@ SOURCES += \
     src/FoilPicsHints.cpp \
     src/FoilPicsImageProvider.cpp \
     src/FoilPicsImageRequest.cpp \
+    src/FoilPicsKeyIndex.cpp \
     src/FoilPicsModel.cpp \
+    src/FoilPicsModelData.cpp \
     src/FoilPicsModelWatch.cpp \
     src/FoilPicsRole.cpp \
+    src/FoilPicsRowIndex.cpp \
+    src/FoilPicsSegmentStore.cpp \
     src/FoilPicsSelection.cpp \
     src/FoilPicsSelectionState.cpp \
     src/FoilPicsTask.cpp \
+    src/FoilPicsThumbnail.cpp \
     src/FoilPicsThumbnailerPlugin.cpp \
     src/FoilPicsThumbnailProvider.cpp \
+    src/FoilPicsVaultLayout.cpp \
     src/main.cpp
 
 SOURCES += \
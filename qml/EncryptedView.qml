@@ -41,6 +41,12 @@ Item {
             notification.previewBody = qsTrId("foilpics-notification-password_changed")
             notification.publish()
         }
+        onDuplicatesSkipped: {
+            //: Pop-up notification
+            //% "%0 picture(s) already encrypted, left in place"
+            notification.previewBody = qsTrId("foilpics-notification-duplicates_skipped", aCount).arg(aCount)
+            notification.publish()
+        }
     }
 
     Connections {
@@ -12,6 +12,7 @@ ApplicationWindow {
     FoilPicsModel {
         id: appFoilModel
         thumbnailSize: Qt.size(Theme.itemSizeHuge,Theme.itemSizeHuge)
+        coverSize: Qt.size(Theme.coverSizeLarge.width,Theme.coverSizeLarge.height)
     }
 
     FoilPicsHints {
@@ -38,19 +38,25 @@
 // FoilPicsBusyState::Private
 // ==========================================================================
 
-class FoilPicsBusyState::Private : public QObject {
+class FoilPicsBusyState::Private :
+    public QObject,
+    public FoilPicsSelection::Listener
+{
     Q_OBJECT
 
 public:
     Private(FoilPicsBusyState* aParent);
+    ~Private();
 
     FoilPicsBusyState* parentObject() const;
     void setModel(FoilPicsSelection* aModel);
     void setKey(QString aKey);
     void updateBusy(bool aWasBusy);
 
+    // FoilPicsSelection::Listener
+    void keyStateChanged() Q_DECL_OVERRIDE;
+
 public Q_SLOTS:
-    void onBusyChanged();
     void onModelDestroyed();
 
 public:
@@ -66,6 +72,13 @@ FoilPicsBusyState::Private::Private(FoilPicsBusyState* aParent) :
 {
 }
 
+FoilPicsBusyState::Private::~Private()
+{
+    if (iModel) {
+        iModel->removeBusyListener(iKey, this);
+    }
+}
+
 FoilPicsBusyState* FoilPicsBusyState::Private::parentObject() const
 {
     return qobject_cast<FoilPicsBusyState*>(parent());
@@ -77,11 +90,12 @@ void FoilPicsBusyState::Private::setModel(FoilPicsSelection* aModel)
         const bool wasBusy = iBusy;
         if (iModel) {
             iModel->disconnect(this);
+            iModel->removeBusyListener(iKey, this);
         }
         iModel = aModel;
         if (iModel) {
             connect(iModel, SIGNAL(destroyed(QObject*)), SLOT(onModelDestroyed()));
-            connect(iModel, SIGNAL(busyChanged(QString)), SLOT(onBusyChanged()));
+            iModel->addBusyListener(iKey, this);
         }
         updateBusy(wasBusy);
     }
@@ -91,6 +105,10 @@ void FoilPicsBusyState::Private::setKey(QString aKey)
 {
     if (iKey != aKey) {
         const bool wasBusy = iBusy;
+        if (iModel) {
+            iModel->removeBusyListener(iKey, this);
+            iModel->addBusyListener(aKey, this);
+        }
         iKey = aKey;
         Q_EMIT parentObject()->keyChanged();
         updateBusy(wasBusy);
@@ -105,7 +123,7 @@ void FoilPicsBusyState::Private::updateBusy(bool aWasBusy)
     }
 }
 
-void FoilPicsBusyState::Private::onBusyChanged()
+void FoilPicsBusyState::Private::keyStateChanged()
 {
     updateBusy(iBusy);
 }
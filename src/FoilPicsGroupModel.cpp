@@ -158,18 +158,38 @@ QByteArray FoilPicsGroupModel::Group::encodeList(QList<Group> aList)
 }
 
 // ==========================================================================
-// FoilPicsGroupModel::ProxyModel
+// FoilPicsGroupModel::RangeModel
+//
+// Pictures in FoilPicsModel are sorted by group, so each group is a
+// contiguous range of rows. This model exposes one such range and
+// follows the changes in the source model by offset arithmetic.
+// When rows move, the new range is compared with where the previous
+// contents went and the difference is signaled as removals and
+// insertions. While that's being done, the rows are mapped through
+// a temporary list.
 // ==========================================================================
 
-class FoilPicsGroupModel::ProxyModel : public QSortFilterProxyModel {
+class FoilPicsGroupModel::RangeModel : public QAbstractListModel {
     Q_OBJECT
     Q_PROPERTY(int count READ rowCount NOTIFY countChanged)
 
 public:
-    ProxyModel(FoilPicsModel* aPicsModel, QString aId, QObject* aParent);
-    bool filterAcceptsRow(int aRow, const QModelIndex& aParent) const;
+    RangeModel(FoilPicsModel* aPicsModel, const FoilPicsGroupModel* aGroups,
+        QByteArray aId, QObject* aParent);
+
+    int groupIndex() const;
+    int groupIndexAt(int aSourceRow) const;
+    void updateRange();
+    void findRange(int* aFirst, int* aCount) const;
+    void reconcile(QVector<int> aRows);
+    void picsAboutToBeRearranged();
+    void picsRearranged(const QVector<int>& aRows);
+
+    // QAbstractListModel
+    virtual QHash<int,QByteArray> roleNames() const;
+    virtual int rowCount(const QModelIndex& aParent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex& aIndex, int aRole) const;
 
-    FoilPicsModel* sourcePicsModel() const;
     Q_INVOKABLE int mapToSource(int aIndex) const;
     Q_INVOKABLE void setTitleAt(int aIndex, QString aTitle);
     Q_INVOKABLE void setGroupIdAt(int aIndex, QString aId);
@@ -180,68 +200,254 @@ Q_SIGNALS:
 
 public Q_SLOTS:
     void checkCount();
+    void onSourceRowsAboutToBeRemoved(const QModelIndex& aParent,
+        int aFirst, int aLast);
+    void onSourceRowsRemoved(const QModelIndex& aParent,
+        int aFirst, int aLast);
+    void onSourceRowsInserted(const QModelIndex& aParent,
+        int aFirst, int aLast);
+    void onSourceRowsMoved(const QModelIndex& aParent, int aStart,
+        int aEnd, const QModelIndex& aDest, int aRow);
+    void onSourceDataChanged(const QModelIndex& aTopLeft,
+        const QModelIndex& aBottomRight, const QVector<int>& aRoles);
+    void onSourceModelReset();
 
 public:
+    FoilPicsModel* iPicsModel;
+    const FoilPicsGroupModel* iGroups;
+    QByteArray iId;
+    int iFirst;
+    int iCount;
     int iLastKnownCount;
+    bool iRemoving;
+    bool iRearranging;
+    bool iReconciling;
+    QVector<int> iRows;     // Source rows while reconciling
 };
 
-FoilPicsGroupModel::ProxyModel::ProxyModel(FoilPicsModel* aPicsModel,
-    QString aId, QObject* aParent) : QSortFilterProxyModel(aParent)
-{
-    setSourceModel(aPicsModel);
-    setFilterRole(FoilPicsModel::groupIdRole());
-    setFilterFixedString(aId);
-    setDynamicSortFilter(true);
-    iLastKnownCount = rowCount();
+FoilPicsGroupModel::RangeModel::RangeModel(FoilPicsModel* aPicsModel,
+    const FoilPicsGroupModel* aGroups, QByteArray aId, QObject* aParent) :
+    QAbstractListModel(aParent),
+    iPicsModel(aPicsModel),
+    iGroups(aGroups),
+    iId(aId),
+    iFirst(0),
+    iCount(0),
+    iRemoving(false),
+    iRearranging(false),
+    iReconciling(false)
+{
+    updateRange();
+    iLastKnownCount = iCount;
+    connect(aPicsModel,
+        SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)),
+        SLOT(onSourceRowsAboutToBeRemoved(QModelIndex,int,int)));
+    connect(aPicsModel,
+        SIGNAL(rowsRemoved(QModelIndex,int,int)),
+        SLOT(onSourceRowsRemoved(QModelIndex,int,int)));
+    connect(aPicsModel,
+        SIGNAL(rowsInserted(QModelIndex,int,int)),
+        SLOT(onSourceRowsInserted(QModelIndex,int,int)));
+    connect(aPicsModel,
+        SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
+        SLOT(onSourceRowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    connect(aPicsModel,
+        SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)),
+        SLOT(onSourceDataChanged(QModelIndex,QModelIndex,QVector<int>)));
+    connect(aPicsModel,
+        SIGNAL(modelReset()),
+        SLOT(onSourceModelReset()));
     connect(this, SIGNAL(rowsInserted(QModelIndex,int,int)), SLOT(checkCount()));
     connect(this, SIGNAL(rowsRemoved(QModelIndex,int,int)), SLOT(checkCount()));
     connect(this, SIGNAL(modelReset()), SLOT(checkCount()));
 }
 
-bool FoilPicsGroupModel::ProxyModel::filterAcceptsRow(int aSourceRow,
-    const QModelIndex& aParent) const
+inline int FoilPicsGroupModel::RangeModel::groupIndex() const
+{
+    return iGroups->indexOfGroup(iId);
+}
+
+inline int FoilPicsGroupModel::RangeModel::groupIndexAt(int aSourceRow) const
 {
-    QRegExp re(filterRegExp());
-    if (re.isEmpty()) {
-        // QSortFilterProxyModel cannot select empty strings.
-        // If the filter is an empty string, it just accepts
-        // everything - and that's not what we want.
-        QAbstractItemModel* model = sourceModel();
-        QModelIndex index = model->index(aSourceRow, 0, aParent);
-        QString value = model->data(index, filterRole()).toString();
-        return value.isEmpty();
+    return iPicsModel->groupIndexAt(aSourceRow);
+}
+
+void FoilPicsGroupModel::RangeModel::updateRange()
+{
+    const int group = groupIndex();
+    const int first = iPicsModel->groupFirstRow(group);
+    if (first >= 0) {
+        iFirst = first;
+        iCount = iPicsModel->groupRowCount(group);
     } else {
-        return QSortFilterProxyModel::filterAcceptsRow(aSourceRow, aParent);
+        // The group is gone
+        iFirst = iCount = 0;
+    }
+}
+
+void FoilPicsGroupModel::RangeModel::findRange(int* aFirst,
+    int* aCount) const
+{
+    // The source model is sorted by group
+    const int group = groupIndex();
+    const int n = iPicsModel->rowCount();
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        const int mid = (lo + hi)/2;
+        if (groupIndexAt(mid) < group) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const int first = lo;
+    hi = n;
+    while (lo < hi) {
+        const int mid = (lo + hi)/2;
+        if (groupIndexAt(mid) <= group) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    *aFirst = (group >= 0) ? first : 0;
+    *aCount = (group >= 0) ? (lo - first) : 0;
+}
+
+void FoilPicsGroupModel::RangeModel::reconcile(QVector<int> aRows)
+{
+    // aRows are the current source rows of what used to be in this
+    // range, in the same order
+    const QModelIndex parent;
+    int first, count;
+    findRange(&first, &count);
+    const int end = first + count;
+    iRows = aRows;
+    iReconciling = true;
+
+    // Remove what has left the range
+    int i = iRows.count() - 1;
+    while (i >= 0) {
+        if (iRows.at(i) >= first && iRows.at(i) < end) {
+            i--;
+        } else {
+            int k = i;
+            while (k > 0 && (iRows.at(k - 1) < first ||
+                iRows.at(k - 1) >= end)) {
+                k--;
+            }
+            beginRemoveRows(parent, k, i);
+            iRows.remove(k, i - k + 1);
+            iCount = iRows.count();
+            endRemoveRows();
+            i = k - 1;
+        }
+    }
+
+    // Pictures only move between groups, those which stay in the group
+    // keep their order
+    for (i = 1; i < iRows.count(); i++) {
+        if (iRows.at(i) < iRows.at(i - 1)) {
+            HWARN("Group" << iId.constData() << "got reordered");
+            beginResetModel();
+            iReconciling = false;
+            iRows.clear();
+            iFirst = first;
+            iCount = count;
+            endResetModel();
+            return;
+        }
+    }
+
+    // Insert what has joined it
+    int row = first;
+    i = 0;
+    while (row < end) {
+        if (i < iRows.count() && iRows.at(i) == row) {
+            i++;
+            row++;
+        } else {
+            int last = row;
+            while ((last + 1) < end && !(i < iRows.count() &&
+                iRows.at(i) == (last + 1))) {
+                last++;
+            }
+            const int n = last - row + 1;
+            beginInsertRows(parent, i, i + n - 1);
+            iRows.insert(i, n, 0);
+            for (int k = 0; k < n; k++) {
+                iRows[i++] = row++;
+            }
+            iCount = iRows.count();
+            endInsertRows();
+        }
+    }
+
+    iReconciling = false;
+    iRows.clear();
+    iFirst = first;
+    iCount = count;
+    HDEBUG(iId.constData() << iFirst << iCount);
 }
 
-inline FoilPicsModel* FoilPicsGroupModel::ProxyModel::sourcePicsModel() const
+void FoilPicsGroupModel::RangeModel::picsAboutToBeRearranged()
 {
-    return qobject_cast<FoilPicsModel*>(sourceModel());
+    iRearranging = true;
 }
 
-int FoilPicsGroupModel::ProxyModel::mapToSource(int aIndex) const
+void FoilPicsGroupModel::RangeModel::picsRearranged(const QVector<int>& aRows)
 {
-    QModelIndex source(QSortFilterProxyModel::mapToSource(index(aIndex, 0)));
-    return source.isValid() ? source.row() : -1;
+    // aRows maps the previous source rows to the current ones and
+    // is empty if nothing has moved
+    QVector<int> rows(iCount);
+    for (int i = 0; i < iCount; i++) {
+        const int row = iFirst + i;
+        rows[i] = (row < aRows.count()) ? aRows.at(row) : row;
+    }
+    iRearranging = false;
+    reconcile(rows);
+}
+
+QHash<int,QByteArray> FoilPicsGroupModel::RangeModel::roleNames() const
+{
+    return iPicsModel->roleNames();
+}
+
+int FoilPicsGroupModel::RangeModel::rowCount(const QModelIndex& aParent) const
+{
+    return iCount;
 }
 
-void FoilPicsGroupModel::ProxyModel::setTitleAt(int aIndex, QString aTitle)
+QVariant FoilPicsGroupModel::RangeModel::data(const QModelIndex& aIndex,
+    int aRole) const
 {
-    sourcePicsModel()->setTitleAt(mapToSource(aIndex), aTitle);
+    const int row = mapToSource(aIndex.row());
+    return (row >= 0) ? iPicsModel->data(iPicsModel->index(row), aRole) :
+        QVariant();
 }
 
-void FoilPicsGroupModel::ProxyModel::setGroupIdAt(int aIndex, QString aId)
+int FoilPicsGroupModel::RangeModel::mapToSource(int aIndex) const
 {
-    sourcePicsModel()->setGroupIdAt(mapToSource(aIndex), aId);
+    return (aIndex >= 0 && aIndex < iCount) ? (iReconciling ?
+        iRows.at(aIndex) : (iFirst + aIndex)) : -1;
 }
 
-QVariantMap FoilPicsGroupModel::ProxyModel::get(int aIndex) const
+void FoilPicsGroupModel::RangeModel::setTitleAt(int aIndex, QString aTitle)
 {
-    return sourcePicsModel()->get(mapToSource(aIndex));
+    iPicsModel->setTitleAt(mapToSource(aIndex), aTitle);
 }
 
-void FoilPicsGroupModel::ProxyModel::checkCount()
+void FoilPicsGroupModel::RangeModel::setGroupIdAt(int aIndex, QString aId)
+{
+    iPicsModel->setGroupIdAt(mapToSource(aIndex), aId);
+}
+
+QVariantMap FoilPicsGroupModel::RangeModel::get(int aIndex) const
+{
+    return iPicsModel->get(mapToSource(aIndex));
+}
+
+void FoilPicsGroupModel::RangeModel::checkCount()
 {
     const int count = rowCount();
     if (iLastKnownCount != count) {
@@ -250,6 +456,140 @@ void FoilPicsGroupModel::ProxyModel::checkCount()
     }
 }
 
+void FoilPicsGroupModel::RangeModel::onSourceRowsAboutToBeRemoved(
+    const QModelIndex& aParent, int aFirst, int aLast)
+{
+    const int first = qMax(aFirst, iFirst);
+    const int last = qMin(aLast, iFirst + iCount - 1);
+    if (first <= last) {
+        iRemoving = true;
+        beginRemoveRows(QModelIndex(), first - iFirst, last - iFirst);
+    }
+}
+
+void FoilPicsGroupModel::RangeModel::onSourceRowsRemoved(
+    const QModelIndex& aParent, int aFirst, int aLast)
+{
+    const int first = qMax(aFirst, iFirst);
+    const int last = qMin(aLast, iFirst + iCount - 1);
+    const int before = qMin(aLast, iFirst - 1) - aFirst + 1;
+    if (first <= last) {
+        iCount -= last - first + 1;
+    }
+    if (before > 0) {
+        iFirst -= before;
+    }
+    if (iRemoving) {
+        iRemoving = false;
+        endRemoveRows();
+    }
+}
+
+void FoilPicsGroupModel::RangeModel::onSourceRowsInserted(
+    const QModelIndex& aParent, int aFirst, int aLast)
+{
+    const int group = groupIndex();
+    for (int row = aFirst; row <= aLast; row++) {
+        const int rowGroup = groupIndexAt(row);
+        if (rowGroup == group) {
+            if (!iCount) iFirst = row;
+            const int off = row - iFirst;
+            beginInsertRows(QModelIndex(), off, off);
+            iCount++;
+            endInsertRows();
+        } else if (rowGroup < group) {
+            // Inserted in front of this group
+            iFirst++;
+        }
+    }
+}
+
+void FoilPicsGroupModel::RangeModel::onSourceRowsMoved(
+    const QModelIndex& aParent, int aStart, int aEnd,
+    const QModelIndex& aDest, int aRow)
+{
+    if (iRearranging) {
+        // picsRearranged() will take care of it
+        return;
+    }
+
+    // Pictures (one or more) have moved to another group, see where
+    // the contents of this range went
+    const int k = aEnd - aStart + 1;
+    const int to = (aRow > aStart) ? (aRow - k) : aRow;
+    QVector<int> rows(iCount);
+    for (int i = 0; i < iCount; i++) {
+        const int row = iFirst + i;
+        if (row >= aStart && row <= aEnd) {
+            rows[i] = to + (row - aStart);
+        } else if (aRow > aEnd && row > aEnd && row < aRow) {
+            rows[i] = row - k;
+        } else if (aRow < aStart && row >= aRow && row < aStart) {
+            rows[i] = row + k;
+        } else {
+            rows[i] = row;
+        }
+    }
+    reconcile(rows);
+}
+
+void FoilPicsGroupModel::RangeModel::onSourceDataChanged(
+    const QModelIndex& aTopLeft, const QModelIndex& aBottomRight,
+    const QVector<int>& aRoles)
+{
+    const int top = aTopLeft.row();
+    const int bottom = aBottomRight.row();
+    if (aRoles.isEmpty() || aRoles.contains(FoilPicsModel::groupIdRole())) {
+        // A picture that changed its group without moving can only
+        // leave or join the group at either end of the range.
+        const QModelIndex parent;
+        const int group = groupIndex();
+        const int n = iPicsModel->rowCount();
+        while (iCount > 0 && iFirst >= top && iFirst <= bottom &&
+            groupIndexAt(iFirst) < group) {
+            beginRemoveRows(parent, 0, 0);
+            iFirst++;
+            iCount--;
+            endRemoveRows();
+        }
+        while (iCount > 0 && (iFirst + iCount - 1) >= top &&
+            (iFirst + iCount - 1) <= bottom &&
+            groupIndexAt(iFirst + iCount - 1) > group) {
+            beginRemoveRows(parent, iCount - 1, iCount - 1);
+            iCount--;
+            endRemoveRows();
+        }
+        while (iFirst > 0 && (iFirst - 1) >= top && (iFirst - 1) <= bottom &&
+            groupIndexAt(iFirst - 1) == group) {
+            beginInsertRows(parent, 0, 0);
+            iFirst--;
+            iCount++;
+            endInsertRows();
+        }
+        while ((iFirst + iCount) < n && (iFirst + iCount) >= top &&
+            (iFirst + iCount) <= bottom &&
+            groupIndexAt(iFirst + iCount) == group) {
+            beginInsertRows(parent, iCount, iCount);
+            iCount++;
+            endInsertRows();
+        }
+    }
+
+    const int first = qMax(top, iFirst);
+    const int last = qMin(bottom, iFirst + iCount - 1);
+    if (first <= last) {
+        Q_EMIT dataChanged(index(first - iFirst), index(last - iFirst),
+            aRoles);
+    }
+}
+
+void FoilPicsGroupModel::RangeModel::onSourceModelReset()
+{
+    beginResetModel();
+    updateRange();
+    endResetModel();
+}
+
 // ==========================================================================
 // FoilPicsGroupModel::ModelData
 // ==========================================================================
@@ -273,23 +613,22 @@ public:
     void init();
 
     QVariant get(Role aRole) const;
-    ProxyModel* createProxyModel() const;
-    QAbstractProxyModel* proxyModel() const;
+    FoilPicsGroupModel* groupModel() const;
+    RangeModel* createRangeModel() const;
+    RangeModel* rangeModel() const;
     bool isFirstGroup() const;
-    bool firstGroupMayHaveChanged() const;
 
 Q_SIGNALS:
-    void proxyModelDestroyed();
-    void proxyModelCountChanged();
+    void rangeModelDestroyed();
+    void rangeModelCountChanged();
 
 public Q_SLOTS:
-    void onProxyModelDestroyed(QObject* aModel);
+    void onRangeModelDestroyed(QObject* aModel);
 
 public:
     Group iGroup;
     FoilPicsModel* iPicsModel;
-    mutable ProxyModel* iProxyModel;
-    mutable bool iLastKnownFirstGroup;
+    mutable RangeModel* iRangeModel;
 };
 
 FoilPicsGroupModel::ModelData::ModelData(FoilPicsModel* aPicsModel) :
@@ -314,37 +653,38 @@ FoilPicsGroupModel::ModelData::ModelData(FoilPicsModel* aPicsModel,
 
 void FoilPicsGroupModel::ModelData::init()
 {
-    iProxyModel = NULL;
-    iLastKnownFirstGroup = false;
+    iRangeModel = NULL;
 }
 
-QAbstractProxyModel* FoilPicsGroupModel::ModelData::proxyModel() const
+FoilPicsGroupModel::RangeModel* FoilPicsGroupModel::ModelData::rangeModel() const
 {
-    if (!iProxyModel) {
-        iProxyModel = createProxyModel();
+    if (!iRangeModel) {
+        iRangeModel = createRangeModel();
     }
-    return iProxyModel;
+    return iRangeModel;
 }
 
-FoilPicsGroupModel::ProxyModel* FoilPicsGroupModel::ModelData::createProxyModel() const
+FoilPicsGroupModel::RangeModel* FoilPicsGroupModel::ModelData::createRangeModel() const
 {
     // Using parent() here to avoid cast, because this is const
-    ProxyModel* model = new ProxyModel(iPicsModel, iGroup.iId, parent());
-    connect(model, SIGNAL(destroyed(QObject*)), SLOT(onProxyModelDestroyed(QObject*)));
-    connect(model, SIGNAL(countChanged()), SIGNAL(proxyModelCountChanged()));
+    RangeModel* model = new RangeModel(iPicsModel, groupModel(),
+        iGroup.iId, parent());
+    connect(model, SIGNAL(destroyed(QObject*)), SLOT(onRangeModelDestroyed(QObject*)));
+    connect(model, SIGNAL(countChanged()), SIGNAL(rangeModelCountChanged()));
     HDEBUG(model->rowCount() << iGroup.iId.data());
     return model;
 }
 
-bool FoilPicsGroupModel::ModelData::isFirstGroup() const
+inline FoilPicsGroupModel* FoilPicsGroupModel::ModelData::groupModel() const
 {
-    QAbstractProxyModel* model = proxyModel();
-    return model->rowCount() && !model->mapToSource(model->index(0, 0)).row();
+    return qobject_cast<FoilPicsGroupModel*>(iPicsModel->groupModel());
 }
 
-bool FoilPicsGroupModel::ModelData::firstGroupMayHaveChanged() const
+bool FoilPicsGroupModel::ModelData::isFirstGroup() const
 {
-    return iLastKnownFirstGroup != isFirstGroup();
+    const int group = groupModel()->indexOfGroup(iGroup.iId);
+    return iPicsModel->groupRowCount(group) > 0 &&
+        !iPicsModel->groupFirstRow(group);
 }
 
 QVariant FoilPicsGroupModel::ModelData::get(Role aRole) const
@@ -352,9 +692,9 @@ QVariant FoilPicsGroupModel::ModelData::get(Role aRole) const
     switch (aRole) {
     case GroupIdRole: return QString::fromLatin1(iGroup.iId);
     case GroupNameRole: return iGroup.iName;
-    case GroupPicsModelRole: return QVariant::fromValue(proxyModel());
-    case GroupPicsCountRole: return proxyModel()->rowCount();
-    case FirstGroupRole: return (iLastKnownFirstGroup = isFirstGroup());
+    case GroupPicsModelRole: return QVariant::fromValue((QObject*)rangeModel());
+    case GroupPicsCountRole: return rangeModel()->rowCount();
+    case FirstGroupRole: return isFirstGroup();
     case DefaultGroupRole: return iGroup.isDefault();
     // No default to make sure that we get "warning: enumeration value
     // not handled in switch" if we forget to handle a role.
@@ -362,10 +702,10 @@ QVariant FoilPicsGroupModel::ModelData::get(Role aRole) const
     return QVariant();
 }
 
-void FoilPicsGroupModel::ModelData::onProxyModelDestroyed(QObject* aModel)
+void FoilPicsGroupModel::ModelData::onRangeModelDestroyed(QObject* aModel)
 {
-    iProxyModel = NULL;
-    Q_EMIT proxyModelDestroyed();
+    iRangeModel = NULL;
+    Q_EMIT rangeModelDestroyed();
 }
 
 // ==========================================================================
@@ -398,8 +738,8 @@ public:
     void dataChanged(int aRow, ModelData::Role aRole);
 
 public Q_SLOTS:
-    void onProxyModelDestroyed();
-    void onProxyModelCountChanged();
+    void onRangeModelDestroyed();
+    void onRangeModelCountChanged();
     void onParentModelReset();
     void updateFirstGroup();
 
@@ -408,11 +748,14 @@ public:
     QList<ModelData*> iData;
     QHash<QByteArray,int> iMap;
     int iLastKnownCount;
+    bool iHaveFirstGroup;
+    QByteArray iFirstGroupId;
 };
 
 FoilPicsGroupModel::Private::Private(FoilPicsGroupModel* aParent,
     FoilPicsModel* aPicsModel) : QObject(aParent), iPicsModel(aPicsModel),
-    iLastKnownCount(0)
+    iLastKnownCount(0),
+    iHaveFirstGroup(false)
 {
     appendDefaultGroup();
     connect(aParent,
@@ -475,11 +818,11 @@ inline FoilPicsGroupModel::ModelData*
 FoilPicsGroupModel::Private::connectData(ModelData* aData) const
 {
     connect(aData,
-        SIGNAL(proxyModelDestroyed()),
-        SLOT(onProxyModelDestroyed()));
+        SIGNAL(rangeModelDestroyed()),
+        SLOT(onRangeModelDestroyed()));
     connect(aData,
-        SIGNAL(proxyModelCountChanged()),
-        SLOT(onProxyModelCountChanged()));
+        SIGNAL(rangeModelCountChanged()),
+        SLOT(onRangeModelCountChanged()));
     return aData;
 }
 
@@ -613,7 +956,7 @@ void FoilPicsGroupModel::Private::dataChanged(int aRow, QVector<int> aRoles)
     Q_EMIT model->dataChanged(modelIndex, modelIndex, aRoles);
 }
 
-void FoilPicsGroupModel::Private::onProxyModelDestroyed()
+void FoilPicsGroupModel::Private::onRangeModelDestroyed()
 {
     ModelData* data = qobject_cast<ModelData*>(sender());
     const int row = iData.indexOf(data);
@@ -626,16 +969,13 @@ void FoilPicsGroupModel::Private::onProxyModelDestroyed()
     }
 }
 
-void FoilPicsGroupModel::Private::onProxyModelCountChanged()
+void FoilPicsGroupModel::Private::onRangeModelCountChanged()
 {
     ModelData* data = qobject_cast<ModelData*>(sender());
     const int row = iData.indexOf(data);
-    HDEBUG(row << data->proxyModel()->rowCount());
+    HDEBUG(row << data->rangeModel()->rowCount());
     if (row >= 0) {
         dataChanged(row, ModelData::GroupPicsCountRole);
-        if (data->firstGroupMayHaveChanged()) {
-            dataChanged(row, ModelData::FirstGroupRole);
-        }
     }
 }
 
@@ -651,11 +991,21 @@ void FoilPicsGroupModel::Private::onParentModelReset()
 
 void FoilPicsGroupModel::Private::updateFirstGroup()
 {
-    for (int i = 0; i < iData.count(); i++) {
-        ModelData* data = iData.at(i);
-        if (data->firstGroupMayHaveChanged()) {
-            HDEBUG(i << data->isFirstGroup());
-            dataChanged(i, ModelData::FirstGroupRole);
+    // The first group is the one containing the first picture
+    const bool haveFirstGroup = iPicsModel->rowCount() > 0;
+    ModelData* first = haveFirstGroup ?
+        dataAt(iPicsModel->groupIndexAt(0)) : NULL;
+    const QByteArray firstGroupId(first ? first->iGroup.iId : QByteArray());
+    if (iHaveFirstGroup != haveFirstGroup || iFirstGroupId != firstGroupId) {
+        const int prev = iHaveFirstGroup ? findId(iFirstGroupId) : -1;
+        iHaveFirstGroup = haveFirstGroup;
+        iFirstGroupId = firstGroupId;
+        if (prev >= 0) {
+            dataChanged(prev, ModelData::FirstGroupRole);
+        }
+        if (first) {
+            HDEBUG(firstGroupId.constData());
+            dataChanged(iData.indexOf(first), ModelData::FirstGroupRole);
         }
     }
 }
@@ -673,6 +1023,11 @@ FoilPicsGroupModel::FoilPicsGroupModel(FoilPicsModel* aParent) :
     connect(this, SIGNAL(rowsRemoved(QModelIndex,int,int)), SIGNAL(countChanged()));
 }
 
+int FoilPicsGroupModel::groupNameRole()
+{
+    return ModelData::GroupNameRole;
+}
+
 QHash<int,QByteArray> FoilPicsGroupModel::roleNames() const
 {
     QHash<int,QByteArray> roles;
@@ -721,6 +1076,24 @@ int FoilPicsGroupModel::indexOfGroup(QByteArray aId) const
     return iPrivate->findId(aId);
 }
 
+void FoilPicsGroupModel::picsAboutToBeRearranged()
+{
+    const int n = iPrivate->iData.count();
+    for (int i = 0; i < n; i++) {
+        RangeModel* model = iPrivate->iData.at(i)->iRangeModel;
+        if (model) model->picsAboutToBeRearranged();
+    }
+}
+
+void FoilPicsGroupModel::picsRearranged(const QVector<int>& aRows)
+{
+    const int n = iPrivate->iData.count();
+    for (int i = 0; i < n; i++) {
+        RangeModel* model = iPrivate->iData.at(i)->iRangeModel;
+        if (model) model->picsRearranged(aRows);
+    }
+}
+
 void FoilPicsGroupModel::clear()
 {
     // There's always at least one group (the default one)
@@ -756,8 +1129,7 @@ bool FoilPicsGroupModel::defaultGroupAt(int aIndex) const
 
 int FoilPicsGroupModel::groupPicsCountAt(int aIndex) const
 {
-    ModelData* data = iPrivate->dataAt(aIndex);
-    return data ? data->proxyModel()->rowCount() : 0;
+    return iPrivate->iPicsModel->groupRowCount(aIndex);
 }
 
 void FoilPicsGroupModel::clearGroupAt(int aIndex)
@@ -770,16 +1142,11 @@ void FoilPicsGroupModel::clearGroupAt(int aIndex)
 
 int FoilPicsGroupModel::offsetWithinGroup(int aIndex, int aSource) const
 {
-    ModelData* data = iPrivate->dataAt(aIndex);
-    if (data) {
-        QAbstractProxyModel* model = data->proxyModel();
-        const int n = model->rowCount();
-        const int first = model->mapToSource(model->index(0, 0)).row();
-        if (first >= 0 && aSource >= first && aSource < (first + n)) {
-            const int off = aSource - first;
-            HASSERT(model->mapToSource(model->index(off, 0)).row() == aSource);
-            return off;
-        }
+    const FoilPicsModel* model = iPrivate->iPicsModel;
+    const int first = model->groupFirstRow(aIndex);
+    if (first >= 0 && aSource >= first &&
+        aSource < (first + model->groupRowCount(aIndex))) {
+        return aSource - first;
     }
     return -1;
 }
@@ -66,10 +66,14 @@ public:
 
     FoilPicsGroupModel(FoilPicsModel* aParent);
 
+    static int groupNameRole();
+
     GroupList groups() const;
     void setGroups(GroupList aGroups);
     bool isKnownGroup(QByteArray aId) const;
     int indexOfGroup(QByteArray aId) const;
+    void picsAboutToBeRearranged();
+    void picsRearranged(const QVector<int>& aRows = QVector<int>());
     void clear();
 
     // QAbstractListModel
@@ -94,7 +98,7 @@ Q_SIGNALS:
     void countChanged();
 
 private:
-    class ProxyModel;
+    class RangeModel;
     class ModelData;
     class Private;
     Private* iPrivate;
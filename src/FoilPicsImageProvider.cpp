@@ -83,11 +83,15 @@ void FoilPicsImageProvider::release()
     }
 }
 
-QString FoilPicsImageProvider::addImage(QString aId, QString aPath)
+QString FoilPicsImageProvider::prefix() const
+{
+    return iPrefix;
+}
+
+void FoilPicsImageProvider::addImage(QString aId, QString aPath)
 {
     QMutexLocker locker(&iMutex);
     iPathMap.insert(aId, aPath);
-    return iPrefix + aId;
 }
 
 void FoilPicsImageProvider::releaseImage(QString aId)
@@ -100,7 +104,7 @@ QImage FoilPicsImageProvider::requestImage(const QString& aId, QSize* aSize,
     const QSize& aRequested)
 {
     QImage image;
-    FoilPicsImageRequest req;
+    FoilPicsImageRequest req(aRequested);
 
     iMutex.lock();
     QString path = iPathMap.value(aId);
@@ -51,7 +51,8 @@ public:
     static FoilPicsImageProvider* createForObject(QObject* aObject);
     void release();
 
-    QString addImage(QString aId, QString aPath);
+    QString prefix() const;
+    void addImage(QString aId, QString aPath);
     void releaseImage(QString aId);
 
     virtual QImage requestImage(const QString& aId, QSize* aSize,
@@ -42,10 +42,11 @@
 
 class FoilPicsImageRequest::Private {
 public:
-    Private() : iRef(1), iSignaled(false) {}
+    Private(QSize aSize) : iRef(1), iRequestedSize(aSize), iSignaled(false) {}
     ~Private() {}
 
     QAtomicInt iRef;
+    QSize iRequestedSize;
     QImage iImage;
     QMutex iMutex;
     QWaitCondition iWaitCondition;
@@ -56,7 +57,12 @@ public:
 // FoilPicsImageRequest
 // ==========================================================================
 
-FoilPicsImageRequest::FoilPicsImageRequest() : iPrivate(new Private())
+FoilPicsImageRequest::FoilPicsImageRequest() : iPrivate(new Private(QSize()))
+{
+}
+
+FoilPicsImageRequest::FoilPicsImageRequest(QSize aRequestedSize) :
+    iPrivate(new Private(aRequestedSize))
 {
 }
 
@@ -85,6 +91,11 @@ FoilPicsImageRequest& FoilPicsImageRequest::operator = (const FoilPicsImageReque
     return *this;
 }
 
+QSize FoilPicsImageRequest::requestedSize() const
+{
+    return iPrivate->iRequestedSize;
+}
+
 QImage FoilPicsImageRequest::wait()
 {
     QMutexLocker locker(&iPrivate->iMutex);
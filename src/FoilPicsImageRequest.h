@@ -40,6 +40,7 @@
 class FoilPicsImageRequest {
 public:
     FoilPicsImageRequest();
+    FoilPicsImageRequest(QSize aRequestedSize);
     FoilPicsImageRequest(const FoilPicsImageRequest& aFrame);
     FoilPicsImageRequest& operator = (const FoilPicsImageRequest& aFrame);
     ~FoilPicsImageRequest();
@@ -47,6 +48,7 @@ public:
     void reply(QImage aImage);
     void reply();
     QImage wait();
+    QSize requestedSize() const;
 
 private:
     class Private;
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsKeyIndex.h"
+#include "FoilPicsRole.h"
+#include "FoilPicsRowIndex.h"
+
+#include "HarbourDebug.h"
+
+#include <QPair>
+
+// ==========================================================================
+// FoilPicsKeyIndex::Private
+// ==========================================================================
+
+class FoilPicsKeyIndex::Private : public QObject {
+    Q_OBJECT
+
+public:
+    typedef QPair<QAbstractItemModel*,QString> Id;
+    typedef QHash<Id,QWeakPointer<FoilPicsKeyIndex> > Registry;
+
+    static Registry gRegistry;
+
+    Private(FoilPicsKeyIndex* aParent, QAbstractItemModel* aModel,
+        QString aRole);
+
+    FoilPicsKeyIndex* parentObject() const;
+    QString keyAt(int aRow) const;
+    void unregister();
+    void refresh();
+
+public Q_SLOTS:
+    void onModelDestroyed();
+    void onModelReset();
+    void onModelRowsInserted(const QModelIndex& aParent, int aStart, int aEnd);
+    void onModelRowsRemoved(const QModelIndex& aParent, int aStart, int aEnd);
+    void onModelRowsMoved(const QModelIndex& aSourceParent, int aSourceStart,
+        int aSourceEnd, const QModelIndex& aDestParent, int aDest);
+    void onModelDataChanged(const QModelIndex& aTopLeft,
+        const QModelIndex& aBottomRight, const QVector<int>& aRoles);
+
+public:
+    QAbstractItemModel* iModel;
+    Id iId;
+    QString iRoleName;
+    int iRole;
+    int iColumn;
+    FoilPicsRowIndex iIndex;
+};
+
+FoilPicsKeyIndex::Private::Registry FoilPicsKeyIndex::Private::gRegistry;
+
+FoilPicsKeyIndex::Private::Private(FoilPicsKeyIndex* aParent,
+    QAbstractItemModel* aModel, QString aRole) :
+    QObject(aParent),
+    iModel(aModel),
+    iId(aModel, aRole),
+    iRoleName(aRole),
+    iRole(-1),
+    iColumn(0)
+{
+    connect(iModel,
+        SIGNAL(destroyed(QObject*)),
+        SLOT(onModelDestroyed()));
+    connect(iModel,
+        SIGNAL(modelReset()),
+        SLOT(onModelReset()));
+    connect(iModel,
+        SIGNAL(rowsInserted(QModelIndex,int,int)),
+        SLOT(onModelRowsInserted(QModelIndex,int,int)));
+    connect(iModel,
+        SIGNAL(rowsRemoved(QModelIndex,int,int)),
+        SLOT(onModelRowsRemoved(QModelIndex,int,int)));
+    connect(iModel,
+        SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
+        SLOT(onModelRowsMoved(QModelIndex,int,int,QModelIndex,int)));
+    connect(iModel,
+        SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)),
+        SLOT(onModelDataChanged(QModelIndex,QModelIndex,QVector<int>)));
+    refresh();
+}
+
+inline FoilPicsKeyIndex* FoilPicsKeyIndex::Private::parentObject() const
+{
+    return qobject_cast<FoilPicsKeyIndex*>(parent());
+}
+
+QString FoilPicsKeyIndex::Private::keyAt(int aRow) const
+{
+    QVariant var(iModel->data(iModel->index(aRow, iColumn), iRole));
+    return var.isValid() ? var.toString() : QString();
+}
+
+void FoilPicsKeyIndex::Private::unregister()
+{
+    // Only if the registry entry is ours (or has already been dropped)
+    if (gRegistry.value(iId).isNull()) {
+        gRegistry.remove(iId);
+    }
+}
+
+void FoilPicsKeyIndex::Private::refresh()
+{
+    iIndex.clear();
+    iRole = FoilPicsRole::find(iModel, iRoleName);
+    if (iRole >= 0) {
+        const int n = iModel->rowCount();
+        for (int i = 0; i < n; i++) {
+            iIndex.insert(i, keyAt(i));
+        }
+    }
+    HDEBUG(iRoleName << iIndex.count() << "rows");
+}
+
+void FoilPicsKeyIndex::Private::onModelDestroyed()
+{
+    HDEBUG(iRoleName);
+    // Another model may show up at the same address
+    iModel = NULL;
+    iIndex.clear();
+    iRole = -1;
+    gRegistry.remove(iId);
+    Q_EMIT parentObject()->keysChanged();
+}
+
+void FoilPicsKeyIndex::Private::onModelReset()
+{
+    refresh();
+    Q_EMIT parentObject()->keysChanged();
+}
+
+void FoilPicsKeyIndex::Private::onModelRowsInserted(const QModelIndex& aParent,
+    int aStart, int aEnd)
+{
+    if (iRole < 0) {
+        // Not all roles of DocumentGalleryModel show up right away
+        refresh();
+    } else {
+        for (int i = aStart; i <= aEnd; i++) {
+            iIndex.insert(i, keyAt(i));
+        }
+    }
+    Q_EMIT parentObject()->keysChanged();
+}
+
+void FoilPicsKeyIndex::Private::onModelRowsRemoved(const QModelIndex& aParent,
+    int aStart, int aEnd)
+{
+    iIndex.remove(aStart, aEnd);
+    Q_EMIT parentObject()->keysChanged();
+}
+
+void FoilPicsKeyIndex::Private::onModelRowsMoved(const QModelIndex& aSourceParent,
+    int aSourceStart, int aSourceEnd, const QModelIndex& aDestParent, int aDest)
+{
+    iIndex.move(aSourceStart, aSourceEnd, aDest);
+    Q_EMIT parentObject()->keysChanged();
+}
+
+void FoilPicsKeyIndex::Private::onModelDataChanged(const QModelIndex& aTopLeft,
+    const QModelIndex& aBottomRight, const QVector<int>& aRoles)
+{
+    if (iRole < 0) {
+        refresh();
+        if (iRole >= 0) {
+            Q_EMIT parentObject()->keysChanged();
+        }
+    } else if (aRoles.isEmpty() || aRoles.contains(iRole)) {
+        QList<int> rows;
+        QStringList keys;
+        const int last = qMin(aBottomRight.row(), iIndex.count() - 1);
+        for (int i = qMax(aTopLeft.row(), 0); i <= last; i++) {
+            const QString key(keyAt(i));
+            if (iIndex.keyAt(i) != key) {
+                rows.append(i);
+                keys.append(key);
+            }
+        }
+        if (!rows.isEmpty()) {
+            iIndex.replace(rows, keys);
+            Q_EMIT parentObject()->keysChanged();
+        }
+    }
+}
+
+// ==========================================================================
+// FoilPicsKeyIndex
+// ==========================================================================
+
+FoilPicsKeyIndex::FoilPicsKeyIndex(QAbstractItemModel* aModel, QString aRole) :
+    iPrivate(new Private(this, aModel, aRole))
+{
+}
+
+FoilPicsKeyIndex::~FoilPicsKeyIndex()
+{
+    iPrivate->unregister();
+}
+
+FoilPicsKeyIndex::Ptr FoilPicsKeyIndex::get(QAbstractItemModel* aModel,
+    QString aRole)
+{
+    Ptr index;
+    if (aModel && !aRole.isEmpty()) {
+        const Private::Id id(aModel, aRole);
+        index = Private::gRegistry.value(id).toStrongRef();
+        if (!index) {
+            index = Ptr(new FoilPicsKeyIndex(aModel, aRole));
+            Private::gRegistry.insert(id, index);
+        }
+    }
+    return index;
+}
+
+QAbstractItemModel* FoilPicsKeyIndex::model() const
+{
+    return iPrivate->iModel;
+}
+
+QString FoilPicsKeyIndex::role() const
+{
+    return iPrivate->iRoleName;
+}
+
+bool FoilPicsKeyIndex::isValid() const
+{
+    return iPrivate->iRole >= 0;
+}
+
+int FoilPicsKeyIndex::rowOf(QString aKey) const
+{
+    return aKey.isEmpty() ? -1 : iPrivate->iIndex.rowOf(aKey);
+}
+
+#include "FoilPicsKeyIndex.moc"
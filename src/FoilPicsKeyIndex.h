@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_KEY_INDEX_H
+#define FOILPICS_KEY_INDEX_H
+
+#include <QAbstractItemModel>
+#include <QSharedPointer>
+
+// Key -> row index for the particular role of the particular model.
+// It's shared by everyone looking up rows by key in the same model,
+// and follows the row shifts so that lookups don't need to scan the
+// model. The keysChanged signal is emitted after the index has been
+// updated.
+class FoilPicsKeyIndex : public QObject {
+    Q_OBJECT
+
+public:
+    typedef QSharedPointer<FoilPicsKeyIndex> Ptr;
+
+    static Ptr get(QAbstractItemModel* aModel, QString aRole);
+    ~FoilPicsKeyIndex();
+
+    QAbstractItemModel* model() const;
+    QString role() const;
+    bool isValid() const;
+    int rowOf(QString aKey) const;
+
+Q_SIGNALS:
+    void keysChanged();
+
+private:
+    FoilPicsKeyIndex(QAbstractItemModel* aModel, QString aRole);
+
+    class Private;
+    Private* iPrivate;
+};
+
+#endif // FOILPICS_KEY_INDEX_H
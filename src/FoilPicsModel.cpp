@@ -32,12 +32,17 @@
  */
 
 #include "FoilPicsModel.h"
+#include "FoilPicsDefs.h"
 #include "FoilPicsFileUtil.h"
 #include "FoilPicsImageProvider.h"
 #include "FoilPicsGroupModel.h"
+#include "FoilPicsModelData.h"
 #include "FoilPicsRole.h"
+#include "FoilPicsSegmentStore.h"
 #include "FoilPicsTask.h"
+#include "FoilPicsThumbnail.h"
 #include "FoilPicsThumbnailProvider.h"
+#include "FoilPicsVaultLayout.h"
 
 #include "foil_private_key.h"
 #include "foil_digest.h"
@@ -48,39 +53,102 @@
 
 #include "HarbourDebug.h"
 
+#include <QBitArray>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QThread>
+
+#include <MGConfItem>
+
+#include <algorithm>
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
 #define ENCRYPT_KEY_TYPE FOILMSG_KEY_AES_256
-#define DIGEST_TYPE FOIL_DIGEST_MD5
-
-#define HEADER_ORIGINAL_PATH        "Original-Path"
-#define HEADER_ORIGINAL_SIZE        "Original-Size"
-#define HEADER_MODIFICATION_TIME    "Modification-Time"
-#define HEADER_ACCESS_TIME          "Access-Time"
-#define HEADER_ORIENTATION          "Orientation"
-#define HEADER_CAMERA_MANUFACTURER  "Camera-Manufacturer"
-#define HEADER_CAMERA_MODEL         "Camera-Model"
-#define HEADER_IMAGE_DATE           "Image-Date"
-#define HEADER_LATITUDE             "Latitude"
-#define HEADER_LONGITUDE            "Longitude"
-#define HEADER_ALTITUDE             "Altitude"
-#define HEADER_TITLE                "Title"
-#define HEADER_GROUP                "Group"
+#define DIGEST_CHUNK_SIZE (1024*1024)
 
 /* Thumbnail specific headers */
 #define HEADER_THUMB_FULL_WIDTH     "Full-Width"
 #define HEADER_THUMB_FULL_HEIGHT    "Full-Height"
+#define HEADER_THUMB_LEVELS         "Thumb-Levels"
+#define HEADER_THUMB_FORMAT         "Thumb-Format"
+
+// Uncompressed thumbnail formats (the value of Thumb-Format header).
+// Rows are tightly packed, i.e. stride is width * bytes per pixel.
+#define THUMB_FORMAT_ARGB32P        "ARGB32-Premultiplied"
+#define THUMB_FORMAT_RGB565         "RGB565"
+#define THUMB_DEFAULT_JPEG_QUALITY  (85)
+
+// Thumbnail encoding configuration
+#define DCONF_KEY(x)                FOILPICS_DCONF_ROOT x
+#define KEY_THUMB_FORMAT            DCONF_KEY("thumbnailFormat")
+#define KEY_THUMB_QUALITY           DCONF_KEY("thumbnailQuality")
+#define KEY_THUMB_STORE             DCONF_KEY("thumbnailStore")
+
+// Value of KEY_THUMB_STORE which packs thumbnails into segment files
+// rather than writing each of them into a separate file
+#define THUMB_STORE_SEGMENTS        "segments"
+
+// Value of KEY_VAULT_LAYOUT which spreads the encrypted files over
+// two levels of subdirectories, see FoilPicsVaultLayout
+#define KEY_VAULT_LAYOUT            DCONF_KEY("vaultLayout")
+#define VAULT_LAYOUT_SHARDED        "sharded"
+
+// Number of files moved by one MigrateVaultTask
+#define VAULT_MIGRATE_BATCH (256)
+
+// If KEY_SEPARATE_HEADERS is true, encrypted files start with the header
+// block: magic, 4-byte big-endian length and a separately encrypted and
+// signed message carrying only the headers. The complete message follows
+// as usual. That allows reading the metadata without decrypting the
+// whole picture. Files without the magic are plain messages.
+#define KEY_SEPARATE_HEADERS        DCONF_KEY("separateHeaders")
+#define HEADER_BLOCK_MAGIC          "FoilHdr1"
+#define HEADER_BLOCK_MAGIC_SIZE     (8)
+#define HEADER_BLOCK_PREFIX_SIZE    (HEADER_BLOCK_MAGIC_SIZE + 4)
+#define HEADER_BLOCK_MAX_SIZE       (0x100000)
+#define HEADER_BLOCK_CONTENTS       "FoilPicsHeaders"
+// The block and the message carry the same random id, so that the block
+// can't be paired with the message from another file
+#define HEADER_BLOCK_ID             "Header-Block-Id"
+#define HEADER_BLOCK_ID_SIZE        (8)
+
+// Thumbnail is stored together with its smaller versions, each half
+// the size of the previous one, down to this size:
+#define THUMB_MIN_LEVEL_SIZE (64)
 
 #define INFO_FILE ".info"
-#define INFO_CONTENTS "FoilPics"
 #define INFO_ORDER_HEADER "Order"
 #define INFO_ORDER_DELIMITER   ','
 #define INFO_ORDER_DELIMITER_S ","
 #define INFO_ORDER_THUMB_DELIMITER ':'
 #define INFO_GROUPS_HEADER "Groups"
+#define INFO_DIGESTS_HEADER "Digests"
+#define INFO_TITLES_HEADER "Titles"
+#define INFO_GROUP_IDS_HEADER "Group-Ids"
+#define INFO_GENERATION_HEADER "Generation"
+
+// Since version 1, the catalog is stored in binary form in the body of
+// the .info message, rather than in the text headers. The value of the
+// header is the format version.
+#define INFO_CATALOG_HEADER "Catalog"
+#define INFO_CATALOG_VERSION (1)
+#define INFO_CATALOG_ID_SIZE (8)
+
+// Changes made since the last snapshot of the catalog are appended to
+// the journal, one encrypted record per save. The body of the record is
+// the sequence of operations in the order they were made. Records only
+// apply to the snapshot of the same generation.
+#define JOURNAL_FILE ".journal"
+#define JOURNAL_RECORD_HEADER_SIZE (4)
+#define JOURNAL_MAX_RECORDS (64)
+#define JOURNAL_MIN_OPS (64)
 
 // Keys for metadata passed to encryptFile:
 const QString FoilPicsModel::MetaUrl("url");                 // QUrl
@@ -92,403 +160,190 @@ const QString FoilPicsModel::MetaLatitude("latitude");       // double
 const QString FoilPicsModel::MetaLongitude("longitude");     // double
 const QString FoilPicsModel::MetaAltitude("altitude");       // double
 
-// Role names
-#define FOILPICS_ROLES(role) \
-    role(Url, url) \
-    role(ImageId, imageId) \
-    role(OriginalFileSize, originalFileSize) \
-    role(EncryptedFileSize, encryptedFileSize) \
-    role(Thumbnail, thumbnail) \
-    role(Orientation, orientation) \
-    role(CameraManufacturer, cameraManufacturer) \
-    role(CameraModel, cameraModel) \
-    role(Latitude, latitude) \
-    role(Longitude, longitude) \
-    role(Altitude, altitude) \
-    role(ImageDate, imageDate) \
-    role(MimeType, mimeType) \
-    role(FileName, fileName) \
-    role(Title, title) \
-    role(DefaultTitle, defaultTitle) \
-    role(ImageWidth, imageWidth) \
-    role(ImageHeight, imageHeight) \
-    role(GroupId, groupId)
-
 // ==========================================================================
-// FoilPicsModel::ModelData
+// FoilPicsModel::ModelInfo
 // ==========================================================================
 
-class FoilPicsModel::ModelData {
+class FoilPicsModel::ModelInfo {
 public:
-    enum Role {
-        FirstRole = Qt::UserRole,
-#define ROLE(X,x) X##Role,
-        FOILPICS_ROLES(ROLE)
-#undef ROLE
-        LastRole
-    };
+    ModelInfo() : iGeneration(0) {}
+    ModelInfo(const FoilMsg* msg);
+    ModelInfo(const ModelInfo& aInfo);
+    ModelInfo(const ModelData::List aData, FoilPicsGroupModel::GroupList aGroups);
 
-#define ROLE(X,x) static const QString RoleName##X;
-    FOILPICS_ROLES(ROLE)
-#undef ROLE
+    class Ops;
+    class OrderList;
 
-    typedef QList<ModelData*> List;
-    typedef List::ConstIterator ConstIterator;
-    struct FormatMap {
-        const char* contentType;
-        const char* imageFormat;
-    };
+    static ModelInfo load(QString aDir, FoilPrivateKey* aPrivate,
+        FoilKey* aPublic, CatalogState* aState);
+    static QHash<QString,QString> decodeMap(const char* aString);
 
-    ModelData(QString aOriginalPath, int aOriginalSize, QSize aFullDimensions,
-        GBytes* aDigest, QString aPath, QString aThumbFile, QImage aThumbImage,
-        QString aTitle, const char* aContentType, QDateTime aSortTime,
-        int aOrientation, QString aCameraManufacturer, QString aCameraModel,
-        const char* aLatitude, const char* aLongitude, const char* aAltitude,
-        QDateTime aImageDate, const char* aGroupId);
-    ~ModelData();
-
-    QVariant get(Role aRole) const;
-    void updateVariant(Role aRole);
-
-    static QString defaultTitle(QString aPath);
-    static QString defaultTitle(QFileInfo aFileInfo);
-    static QImage thumbnail(const QImage aImage, QSize aSize, int aRotate);
-    static const char* format(const char* aContentType);
-    static int compareFormatMap(const void* aElem1, const void* aElem2);
-
-    static double* toDouble(const char* aString);
-    static QString headerString(const FoilMsg* aMsg, const char* aKey);
-    static QDateTime headerTime(const FoilMsg* aMsg, const char* aKey);
-    static QDateTime headerSortTime(const FoilMsg* aMsg);
-    static int headerInt(const FoilMsg* aMsg, const char* aKey, int aDef = 0);
-
-    static ModelData* fromFoilMsg(FoilMsg* aFoilMsg, QString aOriginalPath,
-        QSize aFullDimensions, QString aPath, QString aThumbFile,
-        QImage aThumbImage, const char* aContentType, int aOrientation);
+    void apply(ModelData* aData) const;
 
-public:
-    QString iPath;
-    QString iFileName;
-    QString iThumbFile; // Without path
-    QString iDefaultTitle;
-    QString iTitle;
-    QByteArray iGroupId;
-    QSize iFullDimensions;
-    QImage iThumbnail;
-    QString iThumbSource;
-    QString iImageId;
-    QString iImageSource;
-    QString iContentType;
-    QDateTime iSortTime;
-    int iEncryptedSize;
-    int iOriginalSize;
-    int iOrientation;
-    QString iCameraManufacturer;
-    QString iCameraModel;
-    QDateTime iImageDate;
-    QByteArray iBytes;
-    double* iLatitude;
-    double* iLongitude;
-    double* iAltitude;
-    FoilPicsTask* iDecryptTask;
-    FoilPicsTask* iSetTitleTask;
-    FoilPicsTask* iSetGroupTask;
-    QVariantMap iVariant;
-};
-
-#define ROLE(X,x) const QString FoilPicsModel::ModelData::RoleName##X(#x);
-FOILPICS_ROLES(ROLE)
-#undef ROLE
+    bool save(QString aDir, FoilPrivateKey* aPrivate, FoilKey* aPublic);
+    QByteArray encodeCatalog() const;
+    ModelInfo& operator = (const ModelInfo& aInfo);
 
-FoilPicsModel::ModelData::ModelData(QString aOriginalPath, int aOriginalSize,
-    QSize aFullDimensions, GBytes* aDigest, QString aPath, QString aThumbFile,
-    QImage aThumbImage, QString aTitle, const char* aContentType,
-    QDateTime aSortTime, int aOrientation, QString aCameraManufacturer,
-    QString aCameraModel, const char* aLatitude, const char* aLongitude,
-    const char* aAltitude, QDateTime aImageDate, const char* aGroupId) :
-    iPath(aPath), iThumbFile(aThumbFile), iTitle(aTitle),
-    iFullDimensions(aFullDimensions), iThumbnail(aThumbImage),
-    iSortTime(aSortTime), iOriginalSize(aOriginalSize),
-    iOrientation(aOrientation), iCameraManufacturer(aCameraManufacturer),
-    iCameraModel(aCameraModel), iImageDate(aImageDate),
-    iLatitude(toDouble(aLatitude)), iLongitude(toDouble(aLongitude)),
-    iAltitude(toDouble(aAltitude)), iDecryptTask(NULL), iSetTitleTask(NULL),
-    iSetGroupTask(NULL)
-{
-    QFileInfo fileInfo(aOriginalPath);
-    iFileName = fileInfo.fileName();
-    iEncryptedSize = QFileInfo(aPath).size();
-    iDefaultTitle = defaultTitle(fileInfo);
-    if (iTitle.isEmpty()) iTitle = iDefaultTitle;
-    if (aContentType) iContentType = QLatin1String(aContentType);
-    if (aGroupId && aGroupId[0]) iGroupId = QByteArray(aGroupId);
-
-    // General image id from the digest
-    gsize digestSize;
-    const uchar* digest = (uchar*)g_bytes_get_data(aDigest, &digestSize);
-    GString* buf = g_string_sized_new(digestSize*2);
-    for (guint i = 0; i < digestSize; i++) {
-        g_string_append_printf(buf, "%02X", digest[i]);
-    }
-    iImageId = QLatin1String(buf->str);
-    HDEBUG(iFileName << buf->str << iOrientation);
-    g_string_free(buf, TRUE);
-
-    // Fill the variant map
-#define ROLE(X,x) iVariant.insert(RoleName##X, get(X##Role));
-    FOILPICS_ROLES(ROLE)
-#undef ROLE
-}
+private:
+    // Per-entry flags of the binary catalog
+    enum EntryFlags {
+        EntryNameId = 0x01,     // 8-byte file id instead of the name
+        EntryThumb = 0x02,
+        EntryThumbId = 0x04,    // 8-byte thumbnail id
+        EntryDigest = 0x08,
+        EntryTitle = 0x10,
+        EntryGroupId = 0x20     // Index in the string table
+    };
 
-FoilPicsModel::ModelData::~ModelData()
-{
-    if (iDecryptTask) iDecryptTask->release();
-    if (iSetTitleTask) iSetTitleTask->release();
-    if (iSetGroupTask) iSetGroupTask->release();
-    delete iLatitude;
-    delete iLongitude;
-    delete iAltitude;
-}
-
-FoilPicsModel::ModelData* FoilPicsModel::ModelData::fromFoilMsg(FoilMsg* aMsg,
-    QString aOriginalPath, QSize aFullDimensions, QString aPath,
-    QString aThumbFile, QImage aThumbImage, const char* aContentType,
-    int aOrientation)
-{
-    GBytes* digest = foil_digest_bytes(DIGEST_TYPE, aMsg->data);
-    ModelData* data = new ModelData(aOriginalPath,
-        headerInt(aMsg, HEADER_ORIGINAL_SIZE), aFullDimensions,
-        digest, aPath, aThumbFile, aThumbImage,
-        headerString(aMsg, HEADER_TITLE), aContentType,
-        headerSortTime(aMsg), aOrientation,
-        headerString(aMsg, HEADER_CAMERA_MANUFACTURER),
-        headerString(aMsg, HEADER_CAMERA_MODEL),
-        foilmsg_get_value(aMsg, HEADER_LATITUDE),
-        foilmsg_get_value(aMsg, HEADER_LONGITUDE),
-        foilmsg_get_value(aMsg, HEADER_ALTITUDE),
-        headerTime(aMsg, HEADER_IMAGE_DATE),
-        foilmsg_get_value(aMsg, HEADER_GROUP));
-    g_bytes_unref(digest);
-    return data;
-}
+    static bool sync(const char* aPath, int aFlags);
+    static bool encodeId(QString aName, uchar* aId);
+    static QString decodeId(const uchar* aId);
+    static void writeVarint(QByteArray* aBuf, quint32 aValue);
+    static void writeString(QByteArray* aBuf, const QByteArray aString);
+    static bool readVarint(const uchar** aPtr, const uchar* aEnd,
+        quint32* aValue);
+    static bool readString(const uchar** aPtr, const uchar* aEnd,
+        QString* aString);
+    bool decodeCatalog(GBytes* aBytes);
+    void decodeHeaders(const FoilMsg* aMsg);
+    void loadJournal(QString aDir, FoilPrivateKey* aPrivate,
+        FoilKey* aPublic, CatalogState* aState);
+    bool applyJournal(const FoilMsg* aMsg, OrderList* aOrder);
+    void applyChange(int aOp, QString aName, QString aValue,
+        OrderList* aOrder);
 
-void FoilPicsModel::ModelData::updateVariant(Role aRole)
-{
-    switch (aRole) {
-#define ROLE(X,x) case X##Role: \
-    iVariant.insert(RoleName##X, get(X##Role)); break;
-    FOILPICS_ROLES(ROLE)
-#undef ROLE
-    case ModelData::FirstRole:
-    case ModelData::LastRole:
-        break;
-    }
-}
+public:
+    quint32 iGeneration;
+    QStringList iOrder;
+    QHash<QString,QString> iThumbMap;
+    QHash<QString,QString> iDigestMap;
+    QHash<QString,QString> iTitleMap;   // Empty for default title
+    QHash<QString,QString> iGroupIdMap; // Empty for default group
+    FoilPicsGroupModel::GroupList iGroups;
+};
 
-QVariant FoilPicsModel::ModelData::get(Role aRole) const
-{
-    switch (aRole) {
-    case UrlRole: return iImageSource;
-    case ImageIdRole: return iImageId;
-    case OriginalFileSizeRole: return iOriginalSize ?
-            QVariant::fromValue(iOriginalSize) : QVariant();
-    case EncryptedFileSizeRole: return iEncryptedSize ?
-            QVariant::fromValue(iEncryptedSize) : QVariant();
-    case ThumbnailRole: return iThumbSource;
-    case OrientationRole: return iOrientation;
-    case CameraManufacturerRole: return iCameraManufacturer;
-    case CameraModelRole: return iCameraModel;
-    case LatitudeRole: return iLatitude ?
-            QVariant::fromValue(*iLatitude) : QVariant();
-    case LongitudeRole: return iLongitude ?
-            QVariant::fromValue(*iLongitude) : QVariant();
-    case AltitudeRole: return iAltitude ?
-            QVariant::fromValue(*iAltitude) : QVariant();
-    case ImageDateRole: return iImageDate.isValid() ?
-            QVariant::fromValue(iImageDate) : QVariant();
-    case MimeTypeRole: return iContentType;
-    case TitleRole: return iTitle;
-    case DefaultTitleRole: return iDefaultTitle;
-    case FileNameRole: return iFileName;
-    case ImageWidthRole: return iFullDimensions.width();
-    case ImageHeightRole: return iFullDimensions.height();
-    case GroupIdRole: return iGroupId.isEmpty() ?
-        QString() : QString::fromLatin1(iGroupId);
-    // No default to make sure that we get "warning: enumeration value
-    // not handled in switch" if we forget to handle a real role.
-    case FirstRole:
-    case LastRole:
-        break;
-    }
-    return QVariant();
-}
+// ==========================================================================
+// FoilPicsModel::ModelInfo::Ops
+//
+// Changes made to the model since the last save, in the order they
+// were made. That's also how they are stored in the journal record:
+//
+//   byte    Op                                  }
+//   string  file name, empty for OpGroups       } x number of changes
+//   string  value                               }
+//
+// The value of OpPlace is the name of the previous entry (empty for
+// the first one). Empty thumbnail or digest removes it, empty title
+// and group id mean the defaults. OpGroups carries the encoded list
+// of groups.
+// ==========================================================================
 
-double* FoilPicsModel::ModelData::toDouble(const char* aString)
-{
-    if (aString && aString[0]) {
-        double q = g_ascii_strtod(aString, NULL);
-        if (!errno) {
-            return new double(q);
-        }
-    }
-    return NULL;
-}
+class FoilPicsModel::ModelInfo::Ops {
+public:
+    enum Op {
+        OpRemove = 1,
+        OpPlace,
+        OpThumb,
+        OpDigest,
+        OpTitle,
+        OpGroupId,
+        OpGroups
+    };
 
-QString FoilPicsModel::ModelData::defaultTitle(QString aPath)
-{
-    return defaultTitle(QFileInfo(aPath));
-}
+    Ops() : iCount(0) {}
 
-QString FoilPicsModel::ModelData::defaultTitle(QFileInfo aFileInfo)
-{
-    return aFileInfo.baseName();
-}
+    int count() const { return iCount; }
+    void clear();
+    void remove(QString aName);
+    void place(QString aName, QString aPrev);
+    void set(Op aOp, QString aName, QString aValue);
+    void setGroups(FoilPicsGroupModel::GroupList aGroups);
+    bool append(QString aDir, FoilPrivateKey* aPrivate, FoilKey* aPublic,
+        CatalogState* aState) const;
 
-QImage FoilPicsModel::ModelData::thumbnail(const QImage aImage, QSize aSize,
-    int aRotate)
-{
-    QImage cropped;
-    const QSize imageSize(aImage.size());
-    const Qt::TransformationMode txMode(Qt::SmoothTransformation);
-    if (imageSize.width()*aSize.height() > aSize.width()*imageSize.height()) {
-        QImage scaled(aImage.scaledToHeight(aSize.height(), txMode));
-        const int x = (scaled.width() - aSize.width())/2;
-        cropped = scaled.copy(x, 0, aSize.width(), aSize.height());
-    } else {
-        QImage scaled(aImage.scaledToWidth(aSize.width(), txMode));
-        const int y = (scaled.height() - aSize.height())/2;
-        cropped = scaled.copy(0, y, aSize.width(), aSize.height());
-    }
-    if (aRotate) {
-        const qreal x = ((qreal)aSize.width())/2;
-        const qreal y = ((qreal)aSize.height())/2;
-        return cropped.transformed(QTransform::fromTranslate(x, y).
-            rotate(-aRotate).translate(-x, -y));
-    } else {
-        return cropped;
-    }
-}
-
-const char* FoilPicsModel::ModelData::format(const char* aContentType)
-{
-    static const struct FormatMap {
-        const char* contentType;
-        const char* imageFormat;
-    } formatMap[] = { /* Sorted */
-        { "image/bmp", "BMP" },
-        { "image/gif", "GIF" },
-        { "image/jpeg", "JPEG" },
-        { "image/jpg", "JPEG" },
-        { "image/png", "PNG" },
-        { "image/svg+xml", "SVG" },
-        { "image/tif", "TIFF" },
-        { "image/tiff", "TIFF" },
-        { "image/x-bmp", "BMP" },
-        { "image/x-portable-bitmap", "PBM" },
-        { "image/x-portable-graymap", "PGM" },
-        { "image/x-portable-pixmap", "PPM" }
-    };
+private:
+    void add(Op aOp, QString aName, const QByteArray aValue);
 
-    if (aContentType && aContentType[0]) {
-        FormatMap key;
-        key.contentType = aContentType;
-        key.imageFormat = NULL;
-        const FormatMap* res = (const FormatMap*)bsearch(&key, formatMap,
-            G_N_ELEMENTS(formatMap), sizeof(formatMap[0]), compareFormatMap);
-        if (res) {
-            return res->imageFormat;
-        }
-        HDEBUG("Unknown content type" << aContentType);
-    }
-    return NULL;
-}
+public:
+    QByteArray iData;
+    int iCount;
+    QHash<QString,QString> iThumbMap; // The latest ones, empty if removed
+};
 
-int FoilPicsModel::ModelData::compareFormatMap(const void* aElem1,
-    const void* aElem2)
-{
-    return strcmp(((const FormatMap*)aElem1)->contentType,
-        ((const FormatMap*)aElem2)->contentType);
-}
+// ==========================================================================
+// FoilPicsModel::ModelInfo::OrderList
+//
+// The order of the catalog entries while the journal is being replayed.
+// Each change takes constant time, the list gets flattened at the end.
+// ==========================================================================
 
-int FoilPicsModel::ModelData::headerInt(const FoilMsg* aMsg,
-    const char* aKey, int aDefaultValue)
-{
-    int result = aDefaultValue;
-    const char* str = foilmsg_get_value(aMsg, aKey);
-    if (str && str[0]) {
-        gboolean ok;
-        char *str2 = g_strstrip(g_strdup(str));
-        char *end = str2;
-        long l;
-        errno = 0;
-        l = strtol(str2, &end, 0);
-        ok = !*end && errno != ERANGE && l >= INT_MIN && l <= INT_MAX;
-        if (ok) {
-            result = (int)l;
-        }
-        g_free(str2);
-    }
-    return result;
-}
+class FoilPicsModel::ModelInfo::OrderList {
+public:
+    OrderList(const QStringList aOrder);
 
-QString FoilPicsModel::ModelData::headerString(const FoilMsg* aMsg,
-    const char* aKey)
-{
-    const char* value = foilmsg_get_value(aMsg, aKey);
-    return (value && value[0]) ? QString(value) : QString();
-}
+    void remove(QString aName);
+    void insertAfter(QString aName, QString aPrev);
+    QStringList toList() const;
 
-QDateTime FoilPicsModel::ModelData::headerTime(const FoilMsg* aMsg,
-    const char* aKey)
-{
-    const char* value = foilmsg_get_value(aMsg, aKey);
-    return value ? QDateTime::fromString(value, Qt::ISODate) : QDateTime();
-}
+private:
+    struct Link {
+        QString iPrev;  // Empty for the first entry
+        QString iNext;  // Empty for the last entry
+    };
 
-QDateTime FoilPicsModel::ModelData::headerSortTime(const FoilMsg* aMsg)
-{
-    QDateTime time = headerTime(aMsg, HEADER_IMAGE_DATE);
-    return time.isValid() ? time : headerTime(aMsg, HEADER_MODIFICATION_TIME);
-}
+    QHash<QString,Link> iLinks;
+    QString iFirst;
+    QString iLast;
+};
 
 // ==========================================================================
-// FoilPicsModel::ModelInfo
+// FoilPicsModel::CatalogState
+//
+// What's currently on disk: the generation of the snapshot, thumbnails
+// the catalog is referring to and the valid part of the journal. Only
+// touched by the tasks running on the (single-threaded) model thread
+// pool.
 // ==========================================================================
 
-class FoilPicsModel::ModelInfo {
+class FoilPicsModel::CatalogState {
 public:
-    ModelInfo() {}
-    ModelInfo(const FoilMsg* msg);
-    ModelInfo(const ModelInfo& aInfo);
-    ModelInfo(const ModelData::List aData, FoilPicsGroupModel::GroupList aGroups);
-
-    static ModelInfo load(QString aDir, FoilPrivateKey* aPrivate,
-        FoilKey* aPublic);
+    typedef QSharedPointer<CatalogState> Ptr;
 
-    void save(QString aDir, FoilPrivateKey* aPrivate, FoilKey* aPublic);
-    ModelInfo& operator = (const ModelInfo& aInfo);
+    CatalogState() : iGeneration(0), iLoaded(false), iReadOnly(false),
+        iStale(false), iJournalRecords(0), iJournalSize(0) {}
 
 public:
-    QStringList iOrder;
+    quint32 iGeneration;
     QHash<QString,QString> iThumbMap;
-    FoilPicsGroupModel::GroupList iGroups;
+    bool iLoaded;
+    bool iReadOnly;     // Written by a newer version, don't touch it
+    bool iStale;        // Some changes didn't make it to the journal
+    int iJournalRecords;
+    qint64 iJournalSize;
 };
 
 FoilPicsModel::ModelInfo::ModelInfo(const ModelInfo& aInfo) :
-    iOrder(aInfo.iOrder), iThumbMap(aInfo.iThumbMap), iGroups(aInfo.iGroups)
+    iGeneration(aInfo.iGeneration), iOrder(aInfo.iOrder), iThumbMap(aInfo.iThumbMap),
+    iDigestMap(aInfo.iDigestMap), iTitleMap(aInfo.iTitleMap),
+    iGroupIdMap(aInfo.iGroupIdMap), iGroups(aInfo.iGroups)
 {
 }
 
 FoilPicsModel::ModelInfo& FoilPicsModel::ModelInfo::operator=(const ModelInfo& aInfo)
 {
+    iGeneration = aInfo.iGeneration;
     iOrder = aInfo.iOrder;
     iThumbMap = aInfo.iThumbMap;
+    iDigestMap = aInfo.iDigestMap;
+    iTitleMap = aInfo.iTitleMap;
+    iGroupIdMap = aInfo.iGroupIdMap;
     iGroups = aInfo.iGroups;
     return *this;
 }
 
 FoilPicsModel::ModelInfo::ModelInfo(const ModelData::List aData,
     FoilPicsGroupModel::GroupList aGroups) :
+    iGeneration(0),
     iGroups(aGroups)
 {
     const int n = aData.count();
@@ -499,10 +354,69 @@ FoilPicsModel::ModelInfo::ModelInfo(const ModelData::List aData,
         if (!data->iThumbFile.isEmpty()) {
             iThumbMap.insert(name, data->iThumbFile);
         }
+        if (!data->iImageId.isEmpty()) {
+            iDigestMap.insert(name, data->digestKey());
+        }
+        // Mutable metadata lives here rather than in the encrypted
+        // files, so that changing it doesn't require re-encryption
+        iTitleMap.insert(name, data->iTitle);
+        iGroupIdMap.insert(name, QString::fromLatin1(data->iGroupId));
+    }
+}
+
+QHash<QString,QString> FoilPicsModel::ModelInfo::decodeMap(const char* aString)
+{
+    QHash<QString,QString> map;
+    if (aString) {
+        char** strv = g_strsplit(aString, INFO_ORDER_DELIMITER_S, -1);
+        for (char** ptr = strv; *ptr; ptr++) {
+            char* entry = g_strstrip(*ptr);
+            const char* d = strchr(entry, INFO_ORDER_THUMB_DELIMITER);
+            if (d && d > entry) {
+                map.insert(QString::fromUtf8(entry, d - entry),
+                    QString::fromUtf8(QByteArray::fromPercentEncoding
+                        (QByteArray(d + 1))));
+            }
+        }
+        g_strfreev(strv);
     }
+    return map;
 }
 
-FoilPicsModel::ModelInfo::ModelInfo(const FoilMsg* msg)
+void FoilPicsModel::ModelInfo::apply(ModelData* aData) const
+{
+    // The catalog overrides the headers of the encrypted file
+    const QString name(QFileInfo(aData->iPath).fileName());
+    if (iTitleMap.contains(name)) {
+        const QString title(iTitleMap.value(name));
+        aData->iTitle = (title == aData->defaultTitle()) ? QString() : title;
+    }
+    if (iGroupIdMap.contains(name)) {
+        aData->iGroupId = iGroupIdMap.value(name).toLatin1();
+    }
+}
+
+FoilPicsModel::ModelInfo::ModelInfo(const FoilMsg* msg) :
+    iGeneration(0)
+{
+    const char* generation = foilmsg_get_value(msg, INFO_GENERATION_HEADER);
+    if (generation) {
+        iGeneration = (quint32)strtoul(generation, NULL, 10);
+    }
+    // N.B. load() doesn't get here if the catalog version is unknown
+    const char* catalog = foilmsg_get_value(msg, INFO_CATALOG_HEADER);
+    if (!catalog) {
+        // Written by an older version
+        decodeHeaders(msg);
+    } else if (!decodeCatalog(msg->data)) {
+        HWARN("Failed to decode the catalog");
+        const quint32 gen = iGeneration;
+        *this = ModelInfo();
+        iGeneration = gen;
+    }
+}
+
+void FoilPicsModel::ModelInfo::decodeHeaders(const FoilMsg* msg)
 {
     const char* order = foilmsg_get_value(msg, INFO_ORDER_HEADER);
     if (order) {
@@ -529,65 +443,489 @@ FoilPicsModel::ModelInfo::ModelInfo(const FoilMsg* msg)
         HDEBUG(groups);
         iGroups = FoilPicsGroupModel::Group::decodeList(groups);
     }
+    const char* digests = foilmsg_get_value(msg, INFO_DIGESTS_HEADER);
+    if (digests) {
+        char** strv = g_strsplit(digests, INFO_ORDER_DELIMITER_S, -1);
+        for (char** ptr = strv; *ptr; ptr++) {
+            char* entry = g_strstrip(*ptr);
+            const char* d = strchr(entry, INFO_ORDER_THUMB_DELIMITER);
+            if (d && d[1]) {
+                iDigestMap.insert(QLatin1String(entry, d - entry),
+                    QLatin1String(d + 1));
+            }
+        }
+        g_strfreev(strv);
+        HDEBUG(iDigestMap.count() << "digest(s)");
+    }
+    iTitleMap = decodeMap(foilmsg_get_value(msg, INFO_TITLES_HEADER));
+    iGroupIdMap = decodeMap(foilmsg_get_value(msg, INFO_GROUP_IDS_HEADER));
+}
+
+// File names generated by createFoilFile are 16 upper case hex digits,
+// those are stored as 8 raw bytes.
+bool FoilPicsModel::ModelInfo::encodeId(QString aName, uchar* aId)
+{
+    if (aName.length() == 2 * INFO_CATALOG_ID_SIZE) {
+        const ushort* c = aName.utf16();
+        for (int i = 0; i < INFO_CATALOG_ID_SIZE; i++) {
+            uchar b = 0;
+            for (int k = 0; k < 2; k++) {
+                const ushort x = *c++;
+                b <<= 4;
+                if (x >= '0' && x <= '9') {
+                    b |= x - '0';
+                } else if (x >= 'A' && x <= 'F') {
+                    b |= x - 'A' + 10;
+                } else {
+                    return false;
+                }
+            }
+            aId[i] = b;
+        }
+        return true;
+    }
+    return false;
+}
+
+QString FoilPicsModel::ModelInfo::decodeId(const uchar* aId)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char buf[2 * INFO_CATALOG_ID_SIZE];
+    for (int i = 0; i < INFO_CATALOG_ID_SIZE; i++) {
+        buf[2 * i] = hex[aId[i] >> 4];
+        buf[2 * i + 1] = hex[aId[i] & 0x0f];
+    }
+    return QString::fromLatin1(buf, sizeof(buf));
+}
+
+void FoilPicsModel::ModelInfo::writeVarint(QByteArray* aBuf, quint32 aValue)
+{
+    // 7 bits per byte, least significant first
+    while (aValue >= 0x80) {
+        aBuf->append((char)((aValue & 0x7f) | 0x80));
+        aValue >>= 7;
+    }
+    aBuf->append((char)aValue);
+}
+
+void FoilPicsModel::ModelInfo::writeString(QByteArray* aBuf,
+    const QByteArray aString)
+{
+    writeVarint(aBuf, aString.size());
+    aBuf->append(aString);
+}
+
+bool FoilPicsModel::ModelInfo::readVarint(const uchar** aPtr,
+    const uchar* aEnd, quint32* aValue)
+{
+    quint32 value = 0;
+    for (int shift = 0; *aPtr < aEnd && shift < 32; shift += 7) {
+        const uchar b = *(*aPtr)++;
+        value |= (quint32)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *aValue = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FoilPicsModel::ModelInfo::readString(const uchar** aPtr,
+    const uchar* aEnd, QString* aString)
+{
+    quint32 len;
+    if (readVarint(aPtr, aEnd, &len) && len <= (quint32)(aEnd - *aPtr)) {
+        *aString = QString::fromUtf8((const char*)*aPtr, len);
+        *aPtr += len;
+        return true;
+    }
+    return false;
+}
+
+// The binary catalog:
+//
+//   varint  number of strings in the string table (group ids)
+//   string  (varint length followed by UTF-8) x number of strings
+//   varint  number of groups
+//   varint  string table index of the group id  } x number of groups
+//   string  group name                          }
+//   varint  number of entries
+//   byte    EntryFlags                          }
+//   id|str  file name                           }
+//   id|str  thumbnail, if EntryThumb            } x number of entries
+//   string  digest, if EntryDigest              }
+//   string  title, if EntryTitle                }
+//   varint  group id index, if EntryGroupId     }
+QByteArray FoilPicsModel::ModelInfo::encodeCatalog() const
+{
+    QByteArray strings, groups, entries;
+    QHash<QString,quint32> table;
+    quint32 index = 0;
+    const int n = iOrder.count();
+    int i;
+
+    for (i = 0; i < iGroups.count(); i++) {
+        const QString id(QString::fromLatin1(iGroups.at(i).iId));
+        if (!table.contains(id)) table.insert(id, index++);
+    }
+    for (i = 0; i < n; i++) {
+        const QString name(iOrder.at(i));
+        if (iGroupIdMap.contains(name)) {
+            const QString id(iGroupIdMap.value(name));
+            if (!table.contains(id)) table.insert(id, index++);
+        }
+    }
+    QVector<QString> ids(index);
+    QHashIterator<QString,quint32> it(table);
+    while (it.hasNext()) {
+        it.next();
+        ids[it.value()] = it.key();
+    }
+    writeVarint(&strings, index);
+    for (i = 0; i < (int)index; i++) {
+        writeString(&strings, ids.at(i).toUtf8());
+    }
+
+    writeVarint(&groups, iGroups.count());
+    for (i = 0; i < iGroups.count(); i++) {
+        const FoilPicsGroupModel::Group& group = iGroups.at(i);
+        writeVarint(&groups, table.value(QString::fromLatin1(group.iId)));
+        writeString(&groups, group.iName.toUtf8());
+    }
+
+    uchar name[INFO_CATALOG_ID_SIZE], thumb[INFO_CATALOG_ID_SIZE];
+    entries.reserve(n * (2 * INFO_CATALOG_ID_SIZE + 4));
+    writeVarint(&entries, n);
+    for (i = 0; i < n; i++) {
+        const QString img(iOrder.at(i));
+        const QString thumbFile(iThumbMap.value(img));
+        uchar flags = 0;
+        if (encodeId(img, name)) flags |= EntryNameId;
+        if (!thumbFile.isEmpty()) {
+            flags |= EntryThumb;
+            if (encodeId(thumbFile, thumb)) flags |= EntryThumbId;
+        }
+        if (iDigestMap.contains(img)) flags |= EntryDigest;
+        if (iTitleMap.contains(img)) flags |= EntryTitle;
+        if (iGroupIdMap.contains(img)) flags |= EntryGroupId;
+
+        entries.append((char)flags);
+        if (flags & EntryNameId) {
+            entries.append((const char*)name, sizeof(name));
+        } else {
+            writeString(&entries, img.toUtf8());
+        }
+        if (flags & EntryThumbId) {
+            entries.append((const char*)thumb, sizeof(thumb));
+        } else if (flags & EntryThumb) {
+            writeString(&entries, thumbFile.toUtf8());
+        }
+        if (flags & EntryDigest) {
+            writeString(&entries, iDigestMap.value(img).toUtf8());
+        }
+        if (flags & EntryTitle) {
+            writeString(&entries, iTitleMap.value(img).toUtf8());
+        }
+        if (flags & EntryGroupId) {
+            writeVarint(&entries, table.value(iGroupIdMap.value(img)));
+        }
+    }
+    return strings + groups + entries;
+}
+
+bool FoilPicsModel::ModelInfo::decodeCatalog(GBytes* aBytes)
+{
+    gsize size = 0;
+    const uchar* ptr = aBytes ? (const uchar*)
+        g_bytes_get_data(aBytes, &size) : NULL;
+    const uchar* end = ptr + size;
+    quint32 i, count;
+
+    if (!ptr || !readVarint(&ptr, end, &count) || count > size) {
+        return false;
+    }
+    QVector<QString> ids(count);
+    for (i = 0; i < count; i++) {
+        if (!readString(&ptr, end, ids.data() + i)) {
+            return false;
+        }
+    }
+
+    if (!readVarint(&ptr, end, &count) || count > size) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        quint32 id;
+        QString name;
+        if (!readVarint(&ptr, end, &id) || id >= (quint32)ids.count() ||
+            !readString(&ptr, end, &name)) {
+            return false;
+        }
+        iGroups.append(FoilPicsGroupModel::Group(ids.at(id).toLatin1(), name));
+    }
+
+    if (!readVarint(&ptr, end, &count) || count > size) {
+        return false;
+    }
+    iOrder.reserve(count);
+    iThumbMap.reserve(count);
+    iDigestMap.reserve(count);
+    iTitleMap.reserve(count);
+    iGroupIdMap.reserve(count);
+    for (i = 0; i < count; i++) {
+        QString name, value;
+        quint32 id;
+        if (ptr >= end) {
+            return false;
+        }
+        const uchar flags = *ptr++;
+        if (flags & EntryNameId) {
+            if (end - ptr < INFO_CATALOG_ID_SIZE) return false;
+            name = decodeId(ptr);
+            ptr += INFO_CATALOG_ID_SIZE;
+        } else if (!readString(&ptr, end, &name)) {
+            return false;
+        }
+        iOrder.append(name);
+        if (flags & EntryThumbId) {
+            if (end - ptr < INFO_CATALOG_ID_SIZE) return false;
+            iThumbMap.insert(name, decodeId(ptr));
+            ptr += INFO_CATALOG_ID_SIZE;
+        } else if (flags & EntryThumb) {
+            if (!readString(&ptr, end, &value)) return false;
+            iThumbMap.insert(name, value);
+        }
+        if (flags & EntryDigest) {
+            if (!readString(&ptr, end, &value)) return false;
+            iDigestMap.insert(name, value);
+        }
+        if (flags & EntryTitle) {
+            if (!readString(&ptr, end, &value)) return false;
+            iTitleMap.insert(name, value);
+        }
+        if (flags & EntryGroupId) {
+            if (!readVarint(&ptr, end, &id) || id >= (quint32)ids.count()) {
+                return false;
+            }
+            iGroupIdMap.insert(name, ids.at(id));
+        }
+    }
+    HDEBUG(count << "entries," << iGroups.count() << "groups");
+    return true;
 }
 
 FoilPicsModel::ModelInfo FoilPicsModel::ModelInfo::load(QString aDir,
-    FoilPrivateKey* aPrivate, FoilKey* aPublic)
+    FoilPrivateKey* aPrivate, FoilKey* aPublic, CatalogState* aState)
 {
     ModelInfo info;
     QString fullPath(aDir + "/" INFO_FILE);
     const QByteArray path(fullPath.toUtf8());
     const char* fname = path.constData();
+    bool loaded = false;
+    bool readOnly = false;
     HDEBUG("Loading" << fname);
     FoilMsg* msg = foilmsg_decrypt_file(aPrivate, fname, NULL);
     if (msg) {
-        if (foilmsg_verify(msg, aPublic)) {
-            info = ModelInfo(msg);
-        } else {
+        const char* catalog = foilmsg_get_value(msg, INFO_CATALOG_HEADER);
+        if (!foilmsg_verify(msg, aPublic)) {
             HWARN("Could not verify" << fname);
+        } else if (catalog && atoi(catalog) != INFO_CATALOG_VERSION) {
+            // Saving anything would destroy the newer catalog
+            HWARN("Unsupported catalog version" << catalog);
+            readOnly = true;
+        } else {
+            info = ModelInfo(msg);
+            loaded = true;
         }
         foilmsg_free(msg);
     }
+    if (loaded) {
+        info.loadJournal(aDir, aPrivate, aPublic, aState);
+    }
+    aState->iGeneration = info.iGeneration;
+    aState->iThumbMap = info.iThumbMap;
+    aState->iLoaded = loaded;
+    aState->iReadOnly = readOnly;
     return info;
 }
 
-void FoilPicsModel::ModelInfo::save(QString aDir, FoilPrivateKey* aPrivate,
+void FoilPicsModel::ModelInfo::loadJournal(QString aDir,
+    FoilPrivateKey* aPrivate, FoilKey* aPublic, CatalogState* aState)
+{
+    QFile file(aDir + "/" JOURNAL_FILE);
+    OrderList* order = NULL;
+    int records = 0;
+    qint64 pos = 0;
+    if (file.open(QIODevice::ReadOnly)) {
+        const QByteArray journal(file.readAll());
+        const uchar* data = (const uchar*)journal.constData();
+        const qint64 size = journal.size();
+        while (pos + JOURNAL_RECORD_HEADER_SIZE <= size) {
+            const uchar* h = data + pos;
+            const qint64 len = ((qint64)h[0] << 24) | ((qint64)h[1] << 16) |
+                ((qint64)h[2] << 8) | h[3];
+            if (pos + JOURNAL_RECORD_HEADER_SIZE + len > size) {
+                // Torn write, the rest gets overwritten by the next record
+                HWARN("Journal is truncated at" << pos);
+                break;
+            }
+            GBytes* bytes = g_bytes_new_static(h + JOURNAL_RECORD_HEADER_SIZE,
+                len);
+            FoilMsg* msg = foilmsg_decrypt(aPrivate, bytes, NULL);
+            bool ok = false;
+            g_bytes_unref(bytes);
+            if (msg) {
+                if (foilmsg_verify(msg, aPublic)) {
+                    const char* gen = foilmsg_get_value(msg,
+                        INFO_GENERATION_HEADER);
+                    if (gen && (quint32)strtoul(gen, NULL, 10) == iGeneration) {
+                        if (!order) order = new OrderList(iOrder);
+                        ok = applyJournal(msg, order);
+                    } else {
+                        // Left over from before the last snapshot
+                        HDEBUG("Skipping stale journal record");
+                        ok = true;
+                    }
+                }
+                foilmsg_free(msg);
+            }
+            if (!ok) {
+                HWARN("Bad journal record at" << pos);
+                break;
+            }
+            pos += JOURNAL_RECORD_HEADER_SIZE + len;
+            records++;
+        }
+    }
+    if (order) {
+        iOrder = order->toList();
+        delete order;
+    }
+    HDEBUG(records << "journal record(s)," << pos << "bytes");
+    aState->iJournalRecords = records;
+    aState->iJournalSize = pos;
+}
+
+// Nothing gets applied unless the whole record makes sense
+bool FoilPicsModel::ModelInfo::applyJournal(const FoilMsg* aMsg,
+    OrderList* aOrder)
+{
+    gsize size = 0;
+    const uchar* start = aMsg->data ? (const uchar*)
+        g_bytes_get_data(aMsg->data, &size) : NULL;
+    const uchar* end = start + size;
+    int n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const uchar* ptr = start;
+        while (ptr < end) {
+            QString name, value;
+            const int op = *ptr++;
+            if (op < Ops::OpRemove || op > Ops::OpGroups ||
+                !readString(&ptr, end, &name) ||
+                !readString(&ptr, end, &value)) {
+                return false;
+            } else if (pass) {
+                applyChange(op, name, value, aOrder);
+                n++;
+            }
+        }
+    }
+    HDEBUG(n << "change(s)");
+    return true;
+}
+
+void FoilPicsModel::ModelInfo::applyChange(int aOp, QString aName,
+    QString aValue, OrderList* aOrder)
+{
+    switch ((Ops::Op)aOp) {
+    case Ops::OpRemove:
+        aOrder->remove(aName);
+        iThumbMap.remove(aName);
+        iDigestMap.remove(aName);
+        iTitleMap.remove(aName);
+        iGroupIdMap.remove(aName);
+        break;
+    case Ops::OpPlace:
+        aOrder->insertAfter(aName, aValue);
+        break;
+    case Ops::OpThumb:
+        if (aValue.isEmpty()) {
+            iThumbMap.remove(aName);
+        } else {
+            iThumbMap.insert(aName, aValue);
+        }
+        break;
+    case Ops::OpDigest:
+        if (aValue.isEmpty()) {
+            iDigestMap.remove(aName);
+        } else {
+            iDigestMap.insert(aName, aValue);
+        }
+        break;
+    case Ops::OpTitle:
+        iTitleMap.insert(aName, aValue);
+        break;
+    case Ops::OpGroupId:
+        iGroupIdMap.insert(aName, aValue);
+        break;
+    case Ops::OpGroups:
+        iGroups = FoilPicsGroupModel::Group::decodeList(aValue.toUtf8().
+            constData());
+        break;
+    }
+}
+
+// Flushes the file (or the directory) to the storage
+bool FoilPicsModel::ModelInfo::sync(const char* aPath, int aFlags)
+{
+    bool ok = false;
+    const int fd = open(aPath, O_RDONLY | aFlags);
+    if (fd >= 0) {
+        if (fsync(fd) == 0) {
+            ok = true;
+        } else {
+            HWARN("Failed to sync" << aPath << strerror(errno));
+        }
+        close(fd);
+    } else {
+        HWARN("Failed to open" << aPath << strerror(errno));
+    }
+    return ok;
+}
+
+bool FoilPicsModel::ModelInfo::save(QString aDir, FoilPrivateKey* aPrivate,
     FoilKey* aPublic)
 {
+    // Write the snapshot next to the old one and then replace it, so that
+    // there's always a complete snapshot matching the journal. The journal
+    // can only be deleted once the new snapshot has made it to the storage,
+    // which means syncing both the file and (after the rename) the directory.
+    bool ok = false;
     QString fullPath(aDir + "/" INFO_FILE);
+    QString tmpPath(fullPath + ".tmp");
     const QByteArray path(fullPath.toUtf8());
+    const QByteArray tmp(tmpPath.toUtf8());
     const char* fname = path.constData();
-    FoilOutput* out = foil_output_file_new_open(fname);
+    FoilOutput* out = foil_output_file_new_open(tmp.constData());
     if (out) {
-        QString buf;
-        const int n = iOrder.count();
-        for (int i=0; i<n; i++) {
-            if (!buf.isEmpty()) buf += QChar(INFO_ORDER_DELIMITER);
-            QString img(iOrder.at(i));
-            QString thumb(iThumbMap.value(img));
-            buf += img;
-            if (!thumb.isEmpty()) {
-                buf += QChar(INFO_ORDER_THUMB_DELIMITER);
-                buf += thumb;
-            }
-        }
-
-        const QByteArray order(buf.toUtf8());
-        const QByteArray groups = FoilPicsGroupModel::Group::encodeList(iGroups);
+        const QByteArray catalog(encodeCatalog());
+        char generation[16], version[16];
+        snprintf(generation, sizeof(generation), "%u", iGeneration);
+        snprintf(version, sizeof(version), "%d", INFO_CATALOG_VERSION);
 
         HDEBUG("Saving" << fname);
-        HDEBUG(INFO_ORDER_HEADER ":" << order.constData());
-        HDEBUG(INFO_GROUPS_HEADER ":" << groups.constData());
+        HDEBUG(INFO_GENERATION_HEADER ":" << generation);
+        HDEBUG(iOrder.count() << "entries," << catalog.size() << "bytes");
 
         FoilMsgHeaders headers;
         FoilMsgHeader header[2];
         headers.header = header;
         headers.count = 0;
-        header[headers.count].name = INFO_ORDER_HEADER;
-        header[headers.count].value = order.constData();
+        header[headers.count].name = INFO_GENERATION_HEADER;
+        header[headers.count].value = generation;
         headers.count++;
-        header[headers.count].name = INFO_GROUPS_HEADER;
-        header[headers.count].value = groups.constData();
+        header[headers.count].name = INFO_CATALOG_HEADER;
+        header[headers.count].value = version;
         headers.count++;
 
         FoilMsgEncryptOptions opt;
@@ -595,13 +933,208 @@ void FoilPicsModel::ModelInfo::save(QString aDir, FoilPrivateKey* aPrivate,
         opt.key_type = ENCRYPT_KEY_TYPE;
 
         FoilBytes data;
-        foil_bytes_from_string(&data, INFO_CONTENTS);
-        foilmsg_encrypt(out, &data, NULL, &headers, aPrivate, aPublic,
-            &opt, NULL);
+        data.val = (guint8*)catalog.constData();
+        data.len = catalog.size();
+        ok = foilmsg_encrypt(out, &data, NULL, &headers, aPrivate, aPublic,
+            &opt, NULL) && foil_output_flush(out);
+        foil_output_unref(out);
+        ok = ok && sync(tmp.constData(), 0);
+        if (ok && rename(tmp.constData(), fname) < 0) {
+            HWARN("Failed to rename" << tmp.constData() << strerror(errno));
+            ok = false;
+        }
+        if (ok) {
+            // If the directory can't be synced, the rename may not survive
+            // a crash. Keep the journal matching the old snapshot then, and
+            // let the next save write the full snapshot again.
+            ok = sync(QFile::encodeName(aDir).constData(), O_DIRECTORY);
+            if (ok) {
+                // The journal belongs to the previous generation
+                QFile::remove(aDir + "/" JOURNAL_FILE);
+            }
+        } else {
+            unlink(tmp.constData());
+        }
+    } else {
+        HWARN("Failed to open" << tmp.constData());
+    }
+    return ok;
+}
+
+// ==========================================================================
+// FoilPicsModel::ModelInfo::Ops
+// ==========================================================================
+
+void FoilPicsModel::ModelInfo::Ops::clear()
+{
+    iData.clear();
+    iCount = 0;
+    iThumbMap.clear();
+}
+
+void FoilPicsModel::ModelInfo::Ops::add(Op aOp, QString aName,
+    const QByteArray aValue)
+{
+    iData.append((char)aOp);
+    writeString(&iData, aName.toUtf8());
+    writeString(&iData, aValue);
+    iCount++;
+}
+
+void FoilPicsModel::ModelInfo::Ops::remove(QString aName)
+{
+    add(OpRemove, aName, QByteArray());
+    iThumbMap.insert(aName, QString());
+}
+
+void FoilPicsModel::ModelInfo::Ops::place(QString aName, QString aPrev)
+{
+    add(OpPlace, aName, aPrev.toUtf8());
+}
+
+void FoilPicsModel::ModelInfo::Ops::set(Op aOp, QString aName,
+    QString aValue)
+{
+    add(aOp, aName, aValue.toUtf8());
+    if (aOp == OpThumb) {
+        iThumbMap.insert(aName, aValue);
+    }
+}
+
+void FoilPicsModel::ModelInfo::Ops::setGroups(FoilPicsGroupModel::GroupList
+    aGroups)
+{
+    add(OpGroups, QString(), FoilPicsGroupModel::Group::encodeList(aGroups));
+}
+
+// Appends a record to the journal of the current generation. Returns
+// false if it couldn't be written.
+bool FoilPicsModel::ModelInfo::Ops::append(QString aDir,
+    FoilPrivateKey* aPrivate, FoilKey* aPublic, CatalogState* aState) const
+{
+    if (!iCount) {
+        HDEBUG("Nothing to save");
+        return true;
+    }
+
+    char generation[16];
+    snprintf(generation, sizeof(generation), "%u", aState->iGeneration);
+
+    FoilMsgHeaders headers;
+    FoilMsgHeader header[1];
+    headers.header = header;
+    headers.count = 0;
+    header[headers.count].name = INFO_GENERATION_HEADER;
+    header[headers.count].value = generation;
+    headers.count++;
+
+    FoilMsgEncryptOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.key_type = ENCRYPT_KEY_TYPE;
+
+    bool ok = false;
+    FoilBytes data;
+    data.val = (guint8*)iData.constData();
+    data.len = iData.size();
+    FoilOutput* out = foil_output_mem_new(NULL);
+    if (foilmsg_encrypt(out, &data, NULL, &headers, aPrivate, aPublic,
+        &opt, NULL)) {
+        GBytes* record = foil_output_free_to_bytes(out);
+        gsize size = 0;
+        const char* bytes = (const char*)g_bytes_get_data(record, &size);
+        uchar len[JOURNAL_RECORD_HEADER_SIZE];
+        len[0] = (uchar)(size >> 24);
+        len[1] = (uchar)(size >> 16);
+        len[2] = (uchar)(size >> 8);
+        len[3] = (uchar)size;
+
+        // Drop whatever may have been left by an interrupted write
+        QFile file(aDir + "/" JOURNAL_FILE);
+        if (file.open(QIODevice::ReadWrite) &&
+            file.resize(aState->iJournalSize) &&
+            file.seek(aState->iJournalSize) &&
+            file.write((char*)len, sizeof(len)) == sizeof(len) &&
+            file.write(bytes, size) == (qint64)size &&
+            file.flush() && fsync(file.handle()) == 0) {
+            HDEBUG("Journal record" << aState->iJournalRecords << ":" <<
+                iCount << "change(s)," << size << "bytes");
+            aState->iJournalSize += sizeof(len) + size;
+            aState->iJournalRecords++;
+            ok = true;
+        } else {
+            HWARN("Failed to write" << qPrintable(file.fileName()));
+        }
+        g_bytes_unref(record);
+    } else {
         foil_output_unref(out);
+    }
+    return ok;
+}
+
+// ==========================================================================
+// FoilPicsModel::ModelInfo::OrderList
+// ==========================================================================
+
+FoilPicsModel::ModelInfo::OrderList::OrderList(const QStringList aOrder)
+{
+    const int n = aOrder.count();
+    iLinks.reserve(n);
+    for (int i = 0; i < n; i++) {
+        insertAfter(aOrder.at(i), iLast);
+    }
+}
+
+void FoilPicsModel::ModelInfo::OrderList::remove(QString aName)
+{
+    QHash<QString,Link>::iterator it = iLinks.find(aName);
+    if (it != iLinks.end()) {
+        const Link link(it.value());
+        iLinks.erase(it);
+        if (link.iPrev.isEmpty()) {
+            iFirst = link.iNext;
+        } else {
+            iLinks[link.iPrev].iNext = link.iNext;
+        }
+        if (link.iNext.isEmpty()) {
+            iLast = link.iPrev;
+        } else {
+            iLinks[link.iNext].iPrev = link.iPrev;
+        }
+    }
+}
+
+void FoilPicsModel::ModelInfo::OrderList::insertAfter(QString aName,
+    QString aPrev)
+{
+    // Unknown previous entry puts this one at the end
+    remove(aName);
+    Link link;
+    link.iPrev = (aPrev.isEmpty() || iLinks.contains(aPrev)) ? aPrev : iLast;
+    if (link.iPrev.isEmpty()) {
+        link.iNext = iFirst;
+        iFirst = aName;
     } else {
-        HWARN("Failed to open" << fname);
+        Link& prev = iLinks[link.iPrev];
+        link.iNext = prev.iNext;
+        prev.iNext = aName;
+    }
+    if (link.iNext.isEmpty()) {
+        iLast = aName;
+    } else {
+        iLinks[link.iNext].iPrev = aName;
+    }
+    iLinks.insert(aName, link);
+}
+
+QStringList FoilPicsModel::ModelInfo::OrderList::toList() const
+{
+    QStringList list;
+    list.reserve(iLinks.count());
+    for (QString name(iFirst); !name.isEmpty() &&
+        list.count() < iLinks.count(); name = iLinks.value(name).iNext) {
+        list.append(name);
     }
+    return list;
 }
 
 // ==========================================================================
@@ -612,32 +1145,141 @@ class FoilPicsModel::BaseTask : public FoilPicsTask {
     Q_OBJECT
 
 public:
+    enum ThumbFormat {
+        ThumbFormatOriginal,    // Same as the original image
+        ThumbFormatJpeg,
+        ThumbFormatWebp,        // JPEG if WebP is not supported
+        ThumbFormatArgb32,      // Raw ARGB32 premultiplied
+        ThumbFormatRgb565       // Raw RGB565
+    };
+
+    struct ThumbLevel {
+        QSize size;
+        gsize offset;
+        gsize length;
+    };
+
     BaseTask(QThreadPool* aPool, FoilPrivateKey* aPrivateKey,
         FoilKey* aPublicKey);
     virtual ~BaseTask();
 
     FoilMsg* decryptAndVerify(QString aFileName) const;
     FoilMsg* decryptAndVerify(const char* aFileName) const;
-    QString writeThumb(QImage aImage, const FoilMsgHeaders* aHeaders,
-        const char* aContentType, QImage aThumb, QString aDestDir) const;
+    FoilMsg* decryptAndVerify(int aFd, const char* aFileName) const;
+    FoilMsg* decryptAndVerifyRecord(QString aDir, QString aRef) const;
+    FoilMsg* decryptHeaders(QString aFileName) const;
+    bool writeHeaderBlock(FoilOutput* aOut, const FoilMsgHeaders* aHeaders,
+        const char* aContentType, const FoilMsgEncryptOptions* aOpt) const;
+    bool encryptMessage(FoilOutput* aOut, const FoilBytes* aBytes,
+        const char* aContentType, const FoilMsgHeaders* aHeaders,
+        const FoilMsgEncryptOptions* aOpt) const;
+    FoilMsg* verify(FoilMsg* aMsg, const char* aWhat) const;
+    QString writeThumb(QSize aFullSize, const FoilMsgHeaders* aHeaders,
+        const char* aContentType, QList<QImage> aLevels,
+        QString aDestDir) const;
 
     static bool removeFile(QString aPath);
     static QImage toImage(const FoilMsg* aMsg);
-    static FoilOutput* createFoilFile(QString aDestDir, GString* aOutPath);
+    static ThumbFormat thumbFormat(QString aName);
+    static bool canWrite(const char* aFormat);
+    static QImage decodeThumbLevel(const guint8* aData, gsize aSize,
+        QSize aLevelSize, const char* aFormat);
+    static QList<QImage> makeThumbLevels(QImage aThumb,
+        QImage aCoverLevel = QImage());
+    static QList<ThumbLevel> thumbLevels(const FoilMsg* aMsg);
+    static QImage decodeThumbLevel(const FoilMsg* aMsg,
+        const ThumbLevel& aLevel);
+    static QImage loadThumbLevel(const FoilMsg* aMsg, QSize aLevelSize);
+    static QImage loadThumbnail(const FoilMsg* aMsg, QSize aThumbSize,
+        bool* aExact);
+    static QImage toThumbnail(const FoilMsg* aMsg, QSize aThumbSize,
+        int aRotate, QSize* aFullSize, QSize aCoverLevelSize = QSize(),
+        QImage* aCoverLevel = NULL);
+    static QImage toThumbnail(const void* aData, gsize aSize,
+        const char* aContentType, QSize aThumbSize, int aRotate,
+        QSize* aFullSize, QSize aCoverLevelSize = QSize(),
+        QImage* aCoverLevel = NULL);
+    static QSize coverSize(QSize aFullSize, QSize aThumbSize);
+    static bool exifThumbnail(const guint8* aData, gsize aSize,
+        const guint8** aThumb, gsize* aThumbSize);
+    static guint32 exifInt(const guint8* aPtr, int aBytes, bool aBigEndian);
+    static FoilOutput* createFoilFile(QString aDestDir, GString* aOutPath,
+        bool aSharded);
+    static bool headerBlockLength(const char* aFileName, guint32* aLength);
+    static bool headerBlockLength(const guint8* aData, gsize aSize,
+        guint32* aLength);
     static bool addHeader(FoilMsgHeader* aHeader,
         const FoilMsgHeaders* aHeaders, const char* aKey);
 
 public:
     FoilPrivateKey* iPrivateKey;
     FoilKey* iPublicKey;
+    ThumbFormat iThumbFormat;
+    int iThumbQuality;
+    bool iThumbSegments;
+    bool iSharded;
+    bool iSeparateHeaders;
+    QSize iCoverLevelSize;
+    ModelData::Strings::Ptr iStrings;
 };
 
 FoilPicsModel::BaseTask::BaseTask(QThreadPool* aPool,
     FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey) :
     FoilPicsTask(aPool),
     iPrivateKey(foil_private_key_ref(aPrivateKey)),
-    iPublicKey(foil_key_ref(aPublicKey))
+    iPublicKey(foil_key_ref(aPublicKey)),
+    iThumbFormat(ThumbFormatOriginal),
+    iThumbQuality(-1),
+    iThumbSegments(false),
+    iSharded(false),
+    iSeparateHeaders(false)
+{
+}
+
+FoilPicsModel::BaseTask::ThumbFormat
+FoilPicsModel::BaseTask::thumbFormat(QString aName)
+{
+    if (aName == QLatin1String("jpeg")) {
+        return ThumbFormatJpeg;
+    } else if (aName == QLatin1String("webp")) {
+        return ThumbFormatWebp;
+    } else if (aName == QLatin1String("argb32")) {
+        return ThumbFormatArgb32;
+    } else if (aName == QLatin1String("rgb565")) {
+        return ThumbFormatRgb565;
+    } else {
+        return ThumbFormatOriginal;
+    }
+}
+
+bool FoilPicsModel::BaseTask::canWrite(const char* aFormat)
 {
+    return aFormat && QImageWriter::supportedImageFormats().
+        contains(QByteArray(aFormat).toLower());
+}
+
+QImage FoilPicsModel::BaseTask::decodeThumbLevel(const guint8* aData,
+    gsize aSize, QSize aLevelSize, const char* aFormat)
+{
+    QImage::Format raw = QImage::Format_Invalid;
+    if (aFormat && !strcmp(aFormat, THUMB_FORMAT_ARGB32P)) {
+        raw = QImage::Format_ARGB32_Premultiplied;
+    } else if (aFormat && !strcmp(aFormat, THUMB_FORMAT_RGB565)) {
+        raw = QImage::Format_RGB16;
+    }
+    if (raw == QImage::Format_Invalid) {
+        return QImage::fromData(aData, aSize, aFormat);
+    } else {
+        // No decoding, just copy the pixels
+        const int bpl = aLevelSize.width() *
+            ((raw == QImage::Format_RGB16) ? 2 : 4);
+        if (aSize == (gsize)bpl * aLevelSize.height()) {
+            return QImage(aData, aLevelSize.width(), aLevelSize.height(),
+                bpl, raw).copy();
+        }
+        HWARN("Unexpected thumbnail size" << aSize);
+        return QImage();
+    }
 }
 
 FoilPicsModel::BaseTask::~BaseTask()
@@ -669,42 +1311,532 @@ FoilMsg* FoilPicsModel::BaseTask::decryptAndVerify(QString aFileName) const
 
 FoilMsg* FoilPicsModel::BaseTask::decryptAndVerify(const char* aFileName) const
 {
+    FoilMsg* msg = NULL;
     if (aFileName) {
+        const int fd = open(aFileName, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            msg = decryptAndVerify(fd, aFileName);
+            close(fd);
+        } else {
+            HDEBUG("Failed to open" << aFileName << strerror(errno));
+        }
+    }
+    return msg;
+}
+
+// The file gets mapped once, the header block (if there is one) is
+// skipped right in the mapping
+FoilMsg* FoilPicsModel::BaseTask::decryptAndVerify(int aFd,
+    const char* aFileName) const
+{
+    FoilMsg* msg = NULL;
+    GMappedFile* map = g_mapped_file_new_from_fd(aFd, FALSE, NULL);
+    if (map) {
+        GBytes* bytes = g_mapped_file_get_bytes(map);
+        gsize size;
+        const guint8* data = (const guint8*)g_bytes_get_data(bytes, &size);
+        guint32 len;
         HDEBUG("Decrypting" << aFileName);
-        FoilMsg* msg = foilmsg_decrypt_file(iPrivateKey, aFileName, NULL);
-        if (msg) {
-#if HARBOUR_DEBUG
-            for (uint i=0; i<msg->headers.count; i++) {
-                const FoilMsgHeader* header = msg->headers.header + i;
-                HDEBUG(" " << header->name << ":" << header->value);
+        if (headerBlockLength(data, size, &len)) {
+            // The message that follows the header block is complete,
+            // the block is only decrypted to check that they match
+            const gsize offset = HEADER_BLOCK_PREFIX_SIZE + len;
+            if (offset < size) {
+                GBytes* block = g_bytes_new_from_bytes(bytes,
+                    HEADER_BLOCK_PREFIX_SIZE, len);
+                GBytes* body = g_bytes_new_from_bytes(bytes, offset,
+                    size - offset);
+                FoilMsg* headers = verify(foilmsg_decrypt(iPrivateKey,
+                    block, NULL), aFileName);
+                if (headers) {
+                    msg = foilmsg_decrypt(iPrivateKey, body, NULL);
+                    if (msg && g_strcmp0(foilmsg_get_value(headers,
+                        HEADER_BLOCK_ID), foilmsg_get_value(msg,
+                        HEADER_BLOCK_ID))) {
+                        HWARN("Header block doesn't match" << aFileName);
+                        foilmsg_free(msg);
+                        msg = NULL;
+                    }
+                    foilmsg_free(headers);
+                }
+                g_bytes_unref(body);
+                g_bytes_unref(block);
             }
+        } else {
+            msg = foilmsg_decrypt(iPrivateKey, bytes, NULL);
+        }
+        g_bytes_unref(bytes);
+        g_mapped_file_unref(map);
+    }
+    return verify(msg, aFileName);
+}
+
+// Decrypts only the headers if the file has the header block, otherwise
+// the whole thing. Either way, the headers are all there.
+FoilMsg* FoilPicsModel::BaseTask::decryptHeaders(QString aFileName) const
+{
+    guint32 len;
+    const QByteArray path(aFileName.toUtf8());
+    const char* fname = path.constData();
+    if (!aFileName.isEmpty() && headerBlockLength(fname, &len)) {
+        FoilMsg* msg = NULL;
+        FILE* f = fopen(fname, "rb");
+        if (f) {
+            void* buf = g_malloc(len);
+            if (fseek(f, HEADER_BLOCK_PREFIX_SIZE, SEEK_SET) == 0 &&
+                fread(buf, 1, len, f) == len) {
+                GBytes* bytes = g_bytes_new_take(buf, len);
+                HDEBUG("Decrypting headers of" << fname);
+                msg = foilmsg_decrypt(iPrivateKey, bytes, NULL);
+                g_bytes_unref(bytes);
+            } else {
+                g_free(buf);
+            }
+            fclose(f);
+        }
+        return verify(msg, fname);
+    }
+    return decryptAndVerify(aFileName);
+}
+
+bool FoilPicsModel::BaseTask::headerBlockLength(const char* aFileName,
+    guint32* aLength)
+{
+    bool ok = false;
+    FILE* f = fopen(aFileName, "rb");
+    if (f) {
+        guint8 prefix[HEADER_BLOCK_PREFIX_SIZE];
+        ok = fread(prefix, 1, sizeof(prefix), f) == sizeof(prefix) &&
+            headerBlockLength(prefix, sizeof(prefix), aLength);
+        fclose(f);
+    }
+    return ok;
+}
+
+bool FoilPicsModel::BaseTask::headerBlockLength(const guint8* aData,
+    gsize aSize, guint32* aLength)
+{
+    if (aSize >= HEADER_BLOCK_PREFIX_SIZE &&
+        !memcmp(aData, HEADER_BLOCK_MAGIC, HEADER_BLOCK_MAGIC_SIZE)) {
+        const guint8* len = aData + HEADER_BLOCK_MAGIC_SIZE;
+        *aLength = ((guint32)len[0] << 24) | ((guint32)len[1] << 16) |
+            ((guint32)len[2] << 8) | len[3];
+        return (*aLength > 0 && *aLength <= HEADER_BLOCK_MAX_SIZE);
+    }
+    return false;
+}
+
+bool FoilPicsModel::BaseTask::writeHeaderBlock(FoilOutput* aOut,
+    const FoilMsgHeaders* aHeaders, const char* aContentType,
+    const FoilMsgEncryptOptions* aOpt) const
+{
+    bool ok = false;
+    FoilBytes data;
+    foil_bytes_from_string(&data, HEADER_BLOCK_CONTENTS);
+    FoilOutput* out = foil_output_mem_new(NULL);
+    if (foilmsg_encrypt(out, &data, aContentType, aHeaders, iPrivateKey,
+        iPublicKey, aOpt, NULL)) {
+        GBytes* block = foil_output_free_to_bytes(out);
+        const gsize size = g_bytes_get_size(block);
+        guint8 prefix[HEADER_BLOCK_PREFIX_SIZE];
+        memcpy(prefix, HEADER_BLOCK_MAGIC, HEADER_BLOCK_MAGIC_SIZE);
+        prefix[HEADER_BLOCK_MAGIC_SIZE] = (guint8)(size >> 24);
+        prefix[HEADER_BLOCK_MAGIC_SIZE + 1] = (guint8)(size >> 16);
+        prefix[HEADER_BLOCK_MAGIC_SIZE + 2] = (guint8)(size >> 8);
+        prefix[HEADER_BLOCK_MAGIC_SIZE + 3] = (guint8)size;
+        GBytes* bytes = g_bytes_new_static(prefix, sizeof(prefix));
+        ok = foil_output_write_bytes_all(aOut, bytes) &&
+            foil_output_write_bytes_all(aOut, block);
+        g_bytes_unref(bytes);
+        g_bytes_unref(block);
+    } else {
+        foil_output_unref(out);
+    }
+    return ok;
+}
+
+// Writes the message, preceded by the header block if iSeparateHeaders
+// is set, in which case both get the same random id
+bool FoilPicsModel::BaseTask::encryptMessage(FoilOutput* aOut,
+    const FoilBytes* aBytes, const char* aContentType,
+    const FoilMsgHeaders* aHeaders, const FoilMsgEncryptOptions* aOpt) const
+{
+    if (iSeparateHeaders) {
+        guint8 id[HEADER_BLOCK_ID_SIZE];
+        char idString[2 * HEADER_BLOCK_ID_SIZE + 1];
+        foil_random_generate(FOIL_RANDOM_DEFAULT, id, sizeof(id));
+        for (int i = 0; i < HEADER_BLOCK_ID_SIZE; i++) {
+            snprintf(idString + 2 * i, 3, "%02X", id[i]);
+        }
+
+        const int n = aHeaders->count;
+        QVector<FoilMsgHeader> header(n + 1);
+        for (int i = 0; i < n; i++) {
+            header[i] = aHeaders->header[i];
+        }
+        header[n].name = HEADER_BLOCK_ID;
+        header[n].value = idString;
+
+        FoilMsgHeaders headers;
+        headers.header = header.data();
+        headers.count = n + 1;
+        return writeHeaderBlock(aOut, &headers, aContentType, aOpt) &&
+            foilmsg_encrypt(aOut, aBytes, aContentType, &headers,
+                iPrivateKey, iPublicKey, aOpt, NULL);
+    } else {
+        return foilmsg_encrypt(aOut, aBytes, aContentType, aHeaders,
+            iPrivateKey, iPublicKey, aOpt, NULL);
+    }
+}
+
+FoilMsg* FoilPicsModel::BaseTask::decryptAndVerifyRecord(QString aDir,
+    QString aRef) const
+{
+    const QByteArray record(FoilPicsSegmentStore::read(aDir, aRef));
+    if (!record.isEmpty()) {
+        const QByteArray ref(aRef.toUtf8());
+        GBytes* bytes = g_bytes_new_static(record.constData(), record.size());
+        HDEBUG("Decrypting" << ref.constData());
+        FoilMsg* msg = verify(foilmsg_decrypt(iPrivateKey, bytes, NULL),
+            ref.constData());
+        g_bytes_unref(bytes);
+        return msg;
+    }
+    return NULL;
+}
+
+FoilMsg* FoilPicsModel::BaseTask::verify(FoilMsg* aMsg, const char* aWhat) const
+{
+    if (aMsg) {
+#if HARBOUR_DEBUG
+        for (uint i=0; i<aMsg->headers.count; i++) {
+            const FoilMsgHeader* header = aMsg->headers.header + i;
+            HDEBUG(" " << header->name << ":" << header->value);
+        }
 #endif // HARBOUR_DEBUG
-            if (foilmsg_verify(msg, iPublicKey)) {
-                return msg;
+        if (foilmsg_verify(aMsg, iPublicKey)) {
+            return aMsg;
+        } else {
+            HWARN("Could not verify" << aWhat);
+        }
+        foilmsg_free(aMsg);
+    }
+    return NULL;
+}
+
+QImage FoilPicsModel::BaseTask::toImage(const FoilMsg* aMsg)
+{
+    if (aMsg) {
+        const char* type = aMsg->content_type;
+        if (!type || g_str_has_prefix(type, "image/")) {
+            gsize size;
+            const uchar* data = (uchar*)g_bytes_get_data(aMsg->data, &size);
+            if (data && size) {
+                return QImage::fromData(data, size, ModelData::format(type));
+            }
+        } else {
+            HWARN("Unexpected content type" << type);
+        }
+    }
+    return QImage();
+}
+
+QList<QImage> FoilPicsModel::BaseTask::makeThumbLevels(QImage aThumb,
+    QImage aCoverLevel)
+{
+    // The cover level (if any) goes first, then the thumbnail followed
+    // by its halves
+    QList<QImage> levels;
+    if (!aThumb.isNull()) {
+        if (!aCoverLevel.isNull() && aCoverLevel.size() != aThumb.size()) {
+            levels.append(aCoverLevel);
+        }
+        levels.append(aThumb);
+        QSize size(aThumb.size() / 2);
+        while (size.width() >= THUMB_MIN_LEVEL_SIZE &&
+            size.height() >= THUMB_MIN_LEVEL_SIZE) {
+            QImage level(FoilPicsThumbnail::make(levels.last(), size, 0));
+            if (level.isNull()) break;
+            levels.append(level);
+            size /= 2;
+        }
+    }
+    return levels;
+}
+
+QList<FoilPicsModel::BaseTask::ThumbLevel>
+FoilPicsModel::BaseTask::thumbLevels(const FoilMsg* aMsg)
+{
+    // The levels are "WxH@offset+length" separated by commas
+    QList<ThumbLevel> index;
+    const char* spec = foilmsg_get_value(aMsg, HEADER_THUMB_LEVELS);
+    if (spec) {
+        gsize size = 0;
+        g_bytes_get_data(aMsg->data, &size);
+        char** strv = g_strsplit(spec, INFO_ORDER_DELIMITER_S, -1);
+        for (char** ptr = strv; *ptr; ptr++) {
+            int w, h;
+            unsigned long off, len;
+            if (sscanf(*ptr, " %dx%d@%lu+%lu", &w, &h, &off, &len) == 4 &&
+                w > 0 && h > 0 && off <= size && len <= (size - off)) {
+                ThumbLevel level;
+                level.size = QSize(w, h);
+                level.offset = off;
+                level.length = len;
+                index.append(level);
             } else {
-                HWARN("Could not verify" << aFileName);
+                HWARN("Invalid thumbnail level" << *ptr);
             }
-            foilmsg_free(msg);
         }
+        g_strfreev(strv);
+    }
+    return index;
+}
+
+QImage FoilPicsModel::BaseTask::decodeThumbLevel(const FoilMsg* aMsg,
+    const ThumbLevel& aLevel)
+{
+    const char* format = foilmsg_get_value(aMsg, HEADER_THUMB_FORMAT);
+    if (!format) format = ModelData::format(aMsg->content_type);
+    const guint8* data = (guint8*)g_bytes_get_data(aMsg->data, NULL);
+    QImage image(decodeThumbLevel(data + aLevel.offset, aLevel.length,
+        aLevel.size, format));
+    return (image.size() == aLevel.size) ? image : QImage();
+}
+
+QImage FoilPicsModel::BaseTask::loadThumbLevel(const FoilMsg* aMsg,
+    QSize aLevelSize)
+{
+    // Decodes only the level of exactly this size
+    const QList<ThumbLevel> index(thumbLevels(aMsg));
+    for (int i = 0; i < index.count(); i++) {
+        if (index.at(i).size == aLevelSize) {
+            return decodeThumbLevel(aMsg, index.at(i));
+        }
+    }
+    return QImage();
+}
+
+QImage FoilPicsModel::BaseTask::loadThumbnail(const FoilMsg* aMsg,
+    QSize aThumbSize, bool* aExact)
+{
+    // Decodes the level of aThumbSize or scales down the smallest level
+    // that's still larger. Nothing else gets decoded.
+    *aExact = false;
+    if (!foilmsg_get_value(aMsg, HEADER_THUMB_LEVELS)) {
+        // Thumbnail written by an older version, with a single level
+        QImage image(toImage(aMsg));
+        if (image.size() == aThumbSize) {
+            *aExact = true;
+            return image;
+        }
+        return QImage();
+    }
+
+    const QList<ThumbLevel> index(thumbLevels(aMsg));
+    int pos = -1;
+    for (int i = 0; i < index.count(); i++) {
+        const QSize levelSize(index.at(i).size);
+        if (levelSize == aThumbSize) {
+            QImage image(decodeThumbLevel(aMsg, index.at(i)));
+            *aExact = !image.isNull();
+            return image;
+        } else if (levelSize.width() >= aThumbSize.width() &&
+            levelSize.height() >= aThumbSize.height() && (pos < 0 ||
+            (qint64)levelSize.width() * levelSize.height() <
+            (qint64)index.at(pos).size.width() * index.at(pos).size.height())) {
+            pos = i;
+        }
+    }
+
+    if (pos >= 0) {
+        QImage image(decodeThumbLevel(aMsg, index.at(pos)));
+        if (!image.isNull()) {
+            HDEBUG("Scaling" << image.size() << "=>" << aThumbSize);
+            return ModelData::thumbnail(image, aThumbSize, 0);
+        }
+    }
+    return QImage();
+}
+
+QImage FoilPicsModel::BaseTask::toThumbnail(const FoilMsg* aMsg,
+    QSize aThumbSize, int aRotate, QSize* aFullSize, QSize aCoverLevelSize,
+    QImage* aCoverLevel)
+{
+    if (aMsg) {
+        const char* type = aMsg->content_type;
+        if (!type || g_str_has_prefix(type, "image/")) {
+            gsize size;
+            const void* data = g_bytes_get_data(aMsg->data, &size);
+            if (data && size) {
+                return toThumbnail(data, size, type, aThumbSize, aRotate,
+                    aFullSize, aCoverLevelSize, aCoverLevel);
+            }
+        } else {
+            HWARN("Unexpected content type" << type);
+        }
+    }
+    return QImage();
+}
+
+// Produces the thumbnail without decoding the full-size image, if possible.
+// The full size is read from the image header. JPEGs first try the EXIF
+// thumbnail, then all formats decode straight to the size that covers the
+// thumbnail (which JPEG does by DCT scaling). If the cover level is
+// requested too, the image is decoded once at the size covering both.
+// Either way, the main image gets decoded, which validates it.
+QImage FoilPicsModel::BaseTask::toThumbnail(const void* aData, gsize aSize,
+    const char* aContentType, QSize aThumbSize, int aRotate, QSize* aFullSize,
+    QSize aCoverLevelSize, QImage* aCoverLevel)
+{
+    // The levels are stored rotated, crop before rotating
+    const bool wantCoverLevel = aCoverLevel && !aCoverLevelSize.isEmpty();
+    const QSize coverCrop((aRotate % 180) ? aCoverLevelSize.transposed() :
+        aCoverLevelSize);
+    const char* format = ModelData::format(aContentType);
+    QBuffer buffer;
+    buffer.setData(QByteArray::fromRawData((const char*)aData, aSize));
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer, format);
+    QImage image;
+    QSize fullSize(reader.size());
+    if (fullSize.isValid() && !fullSize.isEmpty()) {
+        QSize cover(coverSize(fullSize, aThumbSize));
+        if (wantCoverLevel) {
+            cover = cover.expandedTo(coverSize(fullSize, coverCrop));
+        }
+        const guint8* exifData;
+        gsize exifSize;
+        if (format && !strcmp(format, "JPEG") &&
+            exifThumbnail((const guint8*)aData, aSize, &exifData, &exifSize)) {
+            QImage exif(QImage::fromData(exifData, exifSize, format));
+            // The aspect ratio must match, otherwise it's probably
+            // letterboxed and we don't want black bars in our thumbnail
+            if (exif.width() >= cover.width() &&
+                exif.height() >= cover.height() &&
+                qAbs(qint64(exif.width()) * fullSize.height() -
+                     qint64(exif.height()) * fullSize.width()) <=
+                qMax(fullSize.width(), fullSize.height())) {
+                // The EXIF thumbnail says nothing about the image itself.
+                // The original gets deleted once it's encrypted, so decode
+                // the main stream anyway, as small as DCT scaling allows.
+                reader.setScaledSize(QSize((fullSize.width() + 7)/8,
+                    (fullSize.height() + 7)/8));
+                if (reader.read().isNull()) {
+                    HWARN("Failed to decode the main image");
+                    return QImage();
+                }
+                HDEBUG("Using EXIF thumbnail" << exif.size());
+                image = exif;
+            }
+        }
+        if (image.isNull()) {
+            if (cover.width() < fullSize.width()) {
+                reader.setScaledSize(cover);
+            }
+            image = reader.read();
+        }
+    } else {
+        // The handler can't tell the size without decoding the image
+        image = reader.read();
+        fullSize = image.size();
+    }
+    if (!image.isNull()) {
+        HDEBUG(fullSize << "=>" << image.size());
+        if (aFullSize) *aFullSize = fullSize;
+        if (wantCoverLevel) {
+            *aCoverLevel = ModelData::thumbnail(image, coverCrop, aRotate);
+        }
+        return ModelData::thumbnail(image, aThumbSize, aRotate);
+    } else {
+        HWARN("Failed to decode" << (format ? format : aContentType));
+        return QImage();
     }
-    return NULL;
 }
 
-QImage FoilPicsModel::BaseTask::toImage(const FoilMsg* aMsg)
+// The smallest size with the original aspect ratio that covers the thumbnail
+QSize FoilPicsModel::BaseTask::coverSize(QSize aFullSize, QSize aThumbSize)
 {
-    if (aMsg) {
-        const char* type = aMsg->content_type;
-        if (!type || g_str_has_prefix(type, "image/")) {
-            gsize size;
-            const uchar* data = (uchar*)g_bytes_get_data(aMsg->data, &size);
-            if (data && size) {
-                return QImage::fromData(data, size, ModelData::format(type));
+    const qint64 w = aFullSize.width();
+    const qint64 h = aFullSize.height();
+    const qint64 tw = aThumbSize.width();
+    const qint64 th = aThumbSize.height();
+    if (w * th > tw * h) {
+        return QSize((int)((w * th + h - 1) / h), (int)th);
+    } else {
+        return QSize((int)tw, (int)((h * tw + w - 1) / w));
+    }
+}
+
+guint32 FoilPicsModel::BaseTask::exifInt(const guint8* aPtr, int aBytes,
+    bool aBigEndian)
+{
+    guint32 value = 0;
+    for (int i = 0; i < aBytes; i++) {
+        value |= ((guint32)aPtr[aBigEndian ? i : (aBytes - i - 1)]) <<
+            (8 * (aBytes - i - 1));
+    }
+    return value;
+}
+
+// Locates the JPEG thumbnail in IFD1 of the EXIF block (APP1 segment)
+bool FoilPicsModel::BaseTask::exifThumbnail(const guint8* aData, gsize aSize,
+    const guint8** aThumb, gsize* aThumbSize)
+{
+    if (aSize < 4 || aData[0] != 0xff || aData[1] != 0xd8) {
+        return false;
+    }
+    gsize pos = 2;
+    while (pos + 4 <= aSize && aData[pos] == 0xff) {
+        const guint8 marker = aData[pos + 1];
+        const gsize len = exifInt(aData + pos + 2, 2, true);
+        if (marker == 0xda || len < 2 || len > aSize - pos - 2) {
+            // Start of scan or garbage
+            break;
+        } else if (marker == 0xe1 && len >= 16 &&
+            !memcmp(aData + pos + 4, "Exif\0\0", 6)) {
+            const guint8* tiff = aData + pos + 10;
+            const gsize tiffSize = len - 8;
+            const bool be = (tiff[0] == 'M');
+            if (tiff[0] != tiff[1] || (tiff[0] != 'M' && tiff[0] != 'I') ||
+                exifInt(tiff + 2, 2, be) != 42) {
+                break;
             }
-        } else {
-            HWARN("Unexpected content type" << type);
+            // Skip IFD0
+            gsize ifd = exifInt(tiff + 4, 4, be);
+            if (ifd >= tiffSize || tiffSize - ifd < 2) break;
+            gsize count = exifInt(tiff + ifd, 2, be);
+            const gsize next = ifd + 2 + 12 * count;
+            if (next >= tiffSize || tiffSize - next < 4) break;
+            // And look at IFD1
+            ifd = exifInt(tiff + next, 4, be);
+            if (!ifd || ifd >= tiffSize || tiffSize - ifd < 2) break;
+            count = exifInt(tiff + ifd, 2, be);
+            if (tiffSize - ifd - 2 < 12 * count) break;
+            gsize offset = 0, size = 0;
+            for (gsize i = 0; i < count; i++) {
+                const guint8* entry = tiff + ifd + 2 + 12 * i;
+                const guint tag = exifInt(entry, 2, be);
+                const guint type = exifInt(entry + 2, 2, be);
+                const gsize value = (type == 3) ? exifInt(entry + 8, 2, be) :
+                    (type == 4) ? exifInt(entry + 8, 4, be) : 0;
+                if (tag == 0x0201) {
+                    offset = value;     // JPEGInterchangeFormat
+                } else if (tag == 0x0202) {
+                    size = value;       // JPEGInterchangeFormatLength
+                }
+            }
+            if (offset && size && offset < tiffSize &&
+                size <= tiffSize - offset) {
+                *aThumb = tiff + offset;
+                *aThumbSize = size;
+                return true;
+            }
+            break;
         }
+        pos += 2 + len;
     }
-    return QImage();
+    return false;
 }
 
 bool FoilPicsModel::BaseTask::addHeader(FoilMsgHeader* aHeader,
@@ -723,19 +1855,22 @@ bool FoilPicsModel::BaseTask::addHeader(FoilMsgHeader* aHeader,
 }
 
 FoilOutput* FoilPicsModel::BaseTask::createFoilFile(QString aDestDir,
-    GString* aOutPath)
+    GString* aOutPath, bool aSharded)
 {
     // Generate random name for the encrypted file
     FoilOutput* out = NULL;
     const QByteArray dir(aDestDir.toUtf8());
-    g_string_truncate(aOutPath, 0);
-    g_string_append_len(aOutPath, dir.constData(), dir.size());
-    g_string_append_c(aOutPath, '/');
-    const gsize prefix_len = aOutPath->len;
     for (int i=0; i<100 && !out; i++) {
         guint8 data[8];
         foil_random_generate(FOIL_RANDOM_DEFAULT, data, sizeof(data));
-        g_string_truncate(aOutPath, prefix_len);
+        g_string_truncate(aOutPath, 0);
+        g_string_append_len(aOutPath, dir.constData(), dir.size());
+        if (aSharded) {
+            // Same as FoilPicsVaultLayout::shardOf() for this name
+            g_string_append_printf(aOutPath, "/%02x/%02x", data[0], data[1]);
+            g_mkdir_with_parents(aOutPath->str, 0755);
+        }
+        g_string_append_c(aOutPath, '/');
         g_string_append_printf(aOutPath, "%02X%02X%02X%02X%02X%02X%02X%02X",
             data[0],data[1],data[2],data[3],data[4],data[5],data[6],data[7]);
         out = foil_output_file_new_open(aOutPath->str);
@@ -744,12 +1879,12 @@ FoilOutput* FoilPicsModel::BaseTask::createFoilFile(QString aDestDir,
     return out;
 }
 
-QString FoilPicsModel::BaseTask::writeThumb(QImage aImage,
+QString FoilPicsModel::BaseTask::writeThumb(QSize aFullSize,
     const FoilMsgHeaders* aHeaders, const char* aContentType,
-    QImage aThumb, QString aDestDir) const
+    QList<QImage> aLevels, QString aDestDir) const
 {
     QString thumbName;
-    if (!aThumb.isNull()) {
+    if (!aLevels.isEmpty()) {
         static const char* keys[] = {
             HEADER_ORIGINAL_PATH,
             HEADER_ORIGINAL_SIZE,
@@ -763,11 +1898,12 @@ QString FoilPicsModel::BaseTask::writeThumb(QImage aImage,
             HEADER_ALTITUDE,
             HEADER_IMAGE_DATE,
             HEADER_TITLE,
-            HEADER_GROUP
+            HEADER_GROUP,
+            HEADER_IMAGE_ID
         };
 
         FoilMsgHeaders headers;
-        FoilMsgHeader header[G_N_ELEMENTS(keys) + 2];
+        FoilMsgHeader header[G_N_ELEMENTS(keys) + 4];
 
         FoilMsgEncryptOptions opt;
         memset(&opt, 0, sizeof(opt));
@@ -785,34 +1921,115 @@ QString FoilPicsModel::BaseTask::writeThumb(QImage aImage,
 
         char width[16], height[16];
 
-        snprintf(width, sizeof(width), "%d", aImage.width());
+        snprintf(width, sizeof(width), "%d", aFullSize.width());
         header[headers.count].name = HEADER_THUMB_FULL_WIDTH;
         header[headers.count].value = width;
         headers.count++;
 
-        snprintf(height, sizeof(height), "%d", aImage.height());
+        snprintf(height, sizeof(height), "%d", aFullSize.height());
         header[headers.count].name = HEADER_THUMB_FULL_HEIGHT;
         header[headers.count].value = height;
         headers.count++;
 
+        // Pick the encoding
+        const char* format = ModelData::format(aContentType);
+        QImage::Format raw = QImage::Format_Invalid;
+        int quality = iThumbQuality;
+        switch (iThumbFormat) {
+        case ThumbFormatArgb32:
+            raw = QImage::Format_ARGB32_Premultiplied;
+            format = THUMB_FORMAT_ARGB32P;
+            break;
+        case ThumbFormatRgb565:
+            raw = QImage::Format_RGB16;
+            format = THUMB_FORMAT_RGB565;
+            break;
+        case ThumbFormatWebp:
+            if (canWrite("WEBP")) {
+                format = "WEBP";
+                break;
+            }
+            // fall through
+        case ThumbFormatJpeg:
+            // JPEG has no alpha channel
+            if (aLevels.first().hasAlphaChannel()) {
+                format = "PNG";
+            } else {
+                format = "JPEG";
+                if (quality < 0) quality = THUMB_DEFAULT_JPEG_QUALITY;
+            }
+            break;
+        case ThumbFormatOriginal:
+            break;
+        }
+        if (raw == QImage::Format_Invalid && !canWrite(format)) {
+            // e.g. SVG or GIF
+            format = "PNG";
+        }
+
+        // All levels are packed into the same message
         QByteArray thumbData;
+        QByteArray levels;
         QBuffer buffer(&thumbData);
-        aThumb.save(&buffer, ModelData::format(aContentType));
+        buffer.open(QIODevice::WriteOnly);
+        for (int i = 0; i < aLevels.count(); i++) {
+            const QImage& level = aLevels.at(i);
+            const qint64 offset = buffer.pos();
+            if (raw == QImage::Format_Invalid) {
+                level.save(&buffer, format, quality);
+            } else {
+                const QImage pixels(level.convertToFormat(raw));
+                const int bpl = pixels.width() * pixels.depth() / 8;
+                for (int y = 0; y < pixels.height(); y++) {
+                    buffer.write((const char*)pixels.constScanLine(y), bpl);
+                }
+            }
+            if (!levels.isEmpty()) levels.append(INFO_ORDER_DELIMITER);
+            levels.append(QString().sprintf("%dx%d@%lu+%lu", level.width(),
+                level.height(), (gulong)offset, (gulong)(buffer.pos() -
+                offset)).toLatin1());
+        }
+        buffer.close();
 
-        GString* dest = g_string_sized_new(aDestDir.size() + 9);
-        FoilOutput* out = createFoilFile(aDestDir, dest);
-        if (out) {
-            FoilBytes bytes;
-            bytes.val = (guint8*)thumbData.constData();
-            bytes.len = thumbData.size();
-            HDEBUG("Writing thumbnail to" << dest->str);
+        header[headers.count].name = HEADER_THUMB_LEVELS;
+        header[headers.count].value = levels.constData();
+        headers.count++;
+
+        header[headers.count].name = HEADER_THUMB_FORMAT;
+        header[headers.count].value = format;
+        headers.count++;
+
+        FoilBytes bytes;
+        bytes.val = (guint8*)thumbData.constData();
+        bytes.len = thumbData.size();
+        if (iThumbSegments) {
+            // Encrypt in memory and append to the segment file
+            FoilOutput* out = foil_output_mem_new(NULL);
             if (foilmsg_encrypt(out, &bytes, aContentType, &headers,
                 iPrivateKey, iPublicKey, &opt, NULL)) {
-                thumbName = QFileInfo(dest->str).fileName();
+                GBytes* record = foil_output_free_to_bytes(out);
+                gsize size = 0;
+                const void* data = g_bytes_get_data(record, &size);
+                thumbName = FoilPicsSegmentStore::append(aDestDir,
+                    QByteArray::fromRawData((const char*)data, size));
+                HDEBUG("Wrote thumbnail to" << thumbName);
+                g_bytes_unref(record);
+            } else {
+                foil_output_unref(out);
             }
-            foil_output_unref(out);
+        } else {
+            GString* dest = g_string_sized_new(aDestDir.size() + 9);
+            FoilOutput* out = createFoilFile(aDestDir, dest, iSharded);
+            if (out) {
+                HDEBUG("Writing thumbnail to" << dest->str);
+                if (encryptMessage(out, &bytes, aContentType, &headers,
+                    &opt)) {
+                    thumbName = QFileInfo(dest->str).fileName();
+                }
+                foil_output_unref(out);
+            }
+            g_string_free(dest, TRUE);
         }
-        g_string_free(dest, TRUE);
     }
     return thumbName;
 }
@@ -870,6 +2087,190 @@ void FoilPicsModel::GenerateKeyTask::performTask()
     HDEBUG("Done!");
 }
 
+// ==========================================================================
+// FoilPicsModel::EncryptFile
+//
+// The state of a file travelling through the encryption pipeline:
+//
+//   ReadFileTask (I/O) => ThumbnailTask (CPU) => EncryptTask (crypto + I/O)
+//
+// The file is mapped into memory once and the same mapping is handed
+// from one stage to the next.
+// ==========================================================================
+
+class FoilPicsModel::EncryptFile {
+public:
+    typedef QSharedPointer<EncryptFile> Ptr;
+
+    EncryptFile(QString aSourceFile, QVariantMap aMetaData);
+    ~EncryptFile();
+
+    const char* contentType() const;
+    const guint8* contents() const;
+    gsize length() const;
+
+public:
+    const QString iSourceFile;
+    const QByteArray iPath;
+    const QVariantMap iMetaData;
+    const QVariant iOrientationVar;
+    const int iOrientation;
+    GMappedFile* iMap;
+    QByteArray iContentType;
+    QByteArray iImageId;
+    bool iHaveStat;
+    struct stat iStat;
+    QSize iFullSize;
+    QImage iThumb;
+    QSize iCoverLevelSize;
+    QList<QImage> iThumbLevels;
+};
+
+FoilPicsModel::EncryptFile::EncryptFile(QString aSourceFile,
+    QVariantMap aMetaData) :
+    iSourceFile(aSourceFile),
+    iPath(aSourceFile.toUtf8()),
+    iMetaData(aMetaData),
+    iOrientationVar(aMetaData.value(MetaOrientation)),
+    iOrientation(iOrientationVar.toInt()),
+    iMap(NULL),
+    iHaveStat(false)
+{
+    memset(&iStat, 0, sizeof(iStat));
+}
+
+FoilPicsModel::EncryptFile::~EncryptFile()
+{
+    if (iMap) {
+        g_mapped_file_unref(iMap);
+    }
+}
+
+inline const char* FoilPicsModel::EncryptFile::contentType() const
+{
+    return iContentType.isEmpty() ? NULL : iContentType.constData();
+}
+
+inline const guint8* FoilPicsModel::EncryptFile::contents() const
+{
+    return iMap ? (const guint8*)g_mapped_file_get_contents(iMap) : NULL;
+}
+
+inline gsize FoilPicsModel::EncryptFile::length() const
+{
+    return iMap ? g_mapped_file_get_length(iMap) : 0;
+}
+
+// ==========================================================================
+// FoilPicsModel::ReadFileTask
+// ==========================================================================
+
+class FoilPicsModel::ReadFileTask : public FoilPicsTask {
+    Q_OBJECT
+
+public:
+    ReadFileTask(QThreadPool* aPool, EncryptFile::Ptr aFile);
+
+    virtual void performTask();
+
+public:
+    EncryptFile::Ptr iFile;
+};
+
+FoilPicsModel::ReadFileTask::ReadFileTask(QThreadPool* aPool,
+    EncryptFile::Ptr aFile) :
+    FoilPicsTask(aPool),
+    iFile(aFile)
+{
+    HDEBUG("Encrypting" << qPrintable(aFile->iSourceFile) << aFile->iMetaData);
+}
+
+void FoilPicsModel::ReadFileTask::performTask()
+{
+    if (!isCanceled()) {
+        const char* fname = iFile->iPath.constData();
+        GError* error = NULL;
+        HDEBUG(fname);
+        iFile->iMap = g_mapped_file_new(fname, FALSE, &error);
+        if (iFile->iMap) {
+            iFile->iHaveStat = (stat(fname, &iFile->iStat) == 0);
+
+            QMimeDatabase db;
+            QMimeType type = db.mimeTypeForFile(iFile->iSourceFile);
+            if (type.isValid()) {
+                iFile->iContentType = type.name().toUtf8();
+                HDEBUG(iFile->iContentType.constData());
+            }
+
+            // Hashing the file faults the pages in, so that the next
+            // stages don't stall on I/O while holding a CPU or the crypto
+            // worker. It's done in chunks to be able to bail out quickly
+            // when the task gets canceled.
+            const guint8* data = iFile->contents();
+            const gsize size = iFile->length();
+            if (data && size) {
+                FoilDigest* digest = foil_digest_new(DIGEST_TYPE);
+                gsize off = 0;
+                madvise((void*)data, size, MADV_WILLNEED);
+                while (off < size && !isCanceled()) {
+                    const gsize chunk = MIN(size - off, DIGEST_CHUNK_SIZE);
+                    foil_digest_update(digest, data + off, chunk);
+                    off += chunk;
+                }
+                if (off == size) {
+                    GBytes* bytes = foil_digest_finish(digest);
+                    iFile->iImageId = ModelData::imageId(bytes).toLatin1();
+                }
+                foil_digest_unref(digest);
+            }
+        } else {
+            HWARN("Failed to read" << fname << error->message);
+            g_error_free(error);
+        }
+    }
+}
+
+// ==========================================================================
+// FoilPicsModel::ThumbnailTask
+// ==========================================================================
+
+class FoilPicsModel::ThumbnailTask : public FoilPicsTask {
+    Q_OBJECT
+
+public:
+    ThumbnailTask(QThreadPool* aPool, EncryptFile::Ptr aFile,
+        QSize aThumbSize, QSize aCoverLevelSize);
+
+    virtual void performTask();
+
+public:
+    EncryptFile::Ptr iFile;
+    QSize iThumbSize;
+    QSize iCoverLevelSize;
+};
+
+FoilPicsModel::ThumbnailTask::ThumbnailTask(QThreadPool* aPool,
+    EncryptFile::Ptr aFile, QSize aThumbSize, QSize aCoverLevelSize) :
+    FoilPicsTask(aPool),
+    iFile(aFile),
+    iThumbSize(aThumbSize),
+    iCoverLevelSize(aCoverLevelSize)
+{
+}
+
+void FoilPicsModel::ThumbnailTask::performTask()
+{
+    if (!isCanceled() && iFile->iMap) {
+        // This also validates the image
+        QImage cover;
+        iFile->iThumb = BaseTask::toThumbnail(iFile->contents(),
+            iFile->length(), iFile->contentType(), iThumbSize,
+            iFile->iOrientation, &iFile->iFullSize, iCoverLevelSize, &cover);
+        iFile->iCoverLevelSize = cover.size();
+        iFile->iThumbLevels = BaseTask::makeThumbLevels(iFile->iThumb, cover);
+    }
+}
+
 // ==========================================================================
 // FoilPicsModel::EncryptTask
 // ==========================================================================
@@ -878,32 +2279,27 @@ class FoilPicsModel::EncryptTask : public BaseTask {
     Q_OBJECT
 
 public:
-    EncryptTask(QThreadPool* aPool, QString aSourceFile, QString aDestDir,
-        FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, QSize aThumbSize,
-        QVariantMap aMetaData);
+    EncryptTask(QThreadPool* aPool, EncryptFile::Ptr aFile, QString aDestDir,
+        FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey);
 
     virtual void performTask();
     static bool addDoubleHeader(QVariant aValue, FoilMsgHeader* aHeader,
         const char* aName, char* aBuffer);
 
 public:
-    QString iSourceFile;
+    EncryptFile::Ptr iFile;
     QString iDestDir;
-    QSize iThumbSize;
-    QVariantMap iMetaData;
     ModelData* iData;
 };
 
-FoilPicsModel::EncryptTask::EncryptTask(QThreadPool* aPool, QString aSourceFile,
-    QString aDestDir, FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey,
-    QSize aThumbSize, QVariantMap aMetaData) :
-    BaseTask(aPool, aPrivateKey, aPublicKey), iSourceFile(aSourceFile),
+FoilPicsModel::EncryptTask::EncryptTask(QThreadPool* aPool,
+    EncryptFile::Ptr aFile, QString aDestDir, FoilPrivateKey* aPrivateKey,
+    FoilKey* aPublicKey) :
+    BaseTask(aPool, aPrivateKey, aPublicKey),
+    iFile(aFile),
     iDestDir(aDestDir),
-    iThumbSize(aThumbSize),
-    iMetaData(aMetaData),
     iData(NULL)
 {
-    HDEBUG("Encrypting" << qPrintable(aSourceFile) << aMetaData);
 }
 
 bool FoilPicsModel::EncryptTask::addDoubleHeader(QVariant aValue,
@@ -925,232 +2321,406 @@ bool FoilPicsModel::EncryptTask::addDoubleHeader(QVariant aValue,
 
 void FoilPicsModel::EncryptTask::performTask()
 {
-    const QByteArray path(iSourceFile.toUtf8());
-    const char* fname = path.constData();
+    if (isCanceled() || !iFile->iMap) {
+        return;
+    } else if (iFile->iThumb.isNull()) {
+        return;
+    }
+
+    const QString sourceFile(iFile->iSourceFile);
+    const QVariantMap& metaData = iFile->iMetaData;
+    const char* fname = iFile->iPath.constData();
+    const char* content_type = iFile->contentType();
+    const QSize fullSize(iFile->iFullSize);
+    const QImage thumb(iFile->iThumb);
+    const int orientation = iFile->iOrientation;
+    const struct stat& st = iFile->iStat;
     HDEBUG(fname);
-    GError* error = NULL;
-    GMappedFile* map = g_mapped_file_new(fname, FALSE, &error);
-    if (map) {
-        GString* dest = g_string_sized_new(iDestDir.size() + 9);
-        FoilOutput* out = createFoilFile(iDestDir, dest);
-        if (out) {
-            QMimeDatabase db;
-            QMimeType type = db.mimeTypeForFile(iSourceFile);
-            QByteArray mimeTypeBytes;
-            const char* content_type = NULL;
-            if (type.isValid()) {
-                mimeTypeBytes = type.name().toUtf8();
-                content_type = mimeTypeBytes.constData();
-                HDEBUG(content_type);
-            }
 
-            FoilBytes bytes;
-            bytes.val = (guint8*)g_mapped_file_get_contents(map);
-            bytes.len = g_mapped_file_get_length(map);
-            QImage image = QImage::fromData(bytes.val, bytes.len,
-                ModelData::format(content_type));
-            if (!image.isNull()) {
-                char* mtime = NULL;
-                char* atime = NULL;
-                char* ttime = NULL;
-                QDateTime sortTime, dateTaken;
-                QString title(ModelData::defaultTitle(iSourceFile));
-                const QByteArray titleBytes(title.toUtf8());
-                QString cameraMaker, cameraModel;
-                QByteArray cameraMakerBytes, cameraModelBytes;
-
-                FoilMsgEncryptOptions opt;
-                memset(&opt, 0, sizeof(opt));
-                opt.key_type = ENCRYPT_KEY_TYPE;
-
-                FoilMsgHeaders headers;
-                FoilMsgHeader header[12];
-
-                headers.header = header;
-                headers.count = 0;
-
-                header[headers.count].name = HEADER_ORIGINAL_PATH;
-                header[headers.count].value = fname;
-                headers.count++;
+    GString* dest = g_string_sized_new(iDestDir.size() + 9);
+    FoilOutput* out = createFoilFile(iDestDir, dest, iSharded);
+    if (out) {
+        FoilBytes bytes;
+        bytes.val = iFile->contents();
+        bytes.len = iFile->length();
+
+        char* mtime = NULL;
+        char* atime = NULL;
+        char* ttime = NULL;
+        QDateTime sortTime, dateTaken;
+        QString title(ModelData::defaultTitle(sourceFile));
+        const QByteArray titleBytes(title.toUtf8());
+        QString cameraMaker, cameraModel;
+        QByteArray cameraMakerBytes, cameraModelBytes;
 
-                char fsize[16];
-                snprintf(fsize, sizeof(fsize), "%lu", (gulong)bytes.len);
-                header[headers.count].name = HEADER_ORIGINAL_SIZE;
-                header[headers.count].value = fsize;
-                headers.count++;
+        FoilMsgEncryptOptions opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.key_type = ENCRYPT_KEY_TYPE;
 
-                header[headers.count].name = HEADER_TITLE;
-                header[headers.count].value = titleBytes.constData();
-                headers.count++;
+        FoilMsgHeaders headers;
+        FoilMsgHeader header[13];
 
-                struct stat st;
-                if (stat(fname, &st) == 0) {
-                    GTimeVal tv;
-                    tv.tv_sec = st.st_mtim.tv_sec;
-                    tv.tv_usec = st.st_mtim.tv_nsec / 1000;
-                    mtime = g_time_val_to_iso8601(&tv);
-                    header[headers.count].name = HEADER_MODIFICATION_TIME;
-                    header[headers.count].value = mtime;
-                    headers.count++;
-
-                    sortTime.setMSecsSinceEpoch(((qint64)tv.tv_sec) * 1000 +
-                        st.st_mtim.tv_nsec/1000000);
-
-                    tv.tv_sec = st.st_atim.tv_sec;
-                    tv.tv_usec = st.st_atim.tv_nsec / 1000;
-                    atime = g_time_val_to_iso8601(&tv);
-                    header[headers.count].name = HEADER_ACCESS_TIME;
-                    header[headers.count].value = atime;
-                    headers.count++;
-                }
+        headers.header = header;
+        headers.count = 0;
 
-                // Metadata
-                char degrees[16];
-                int orientation = 0;
-                QVariant var(iMetaData.value(MetaOrientation));
-                if (var.isValid()) {
-                    orientation = var.toInt();
-                    snprintf(degrees, sizeof(degrees), "%d", orientation);
-                    header[headers.count].name = HEADER_ORIENTATION;
-                    header[headers.count].value = degrees;
-                    headers.count++;
-                }
+        header[headers.count].name = HEADER_ORIGINAL_PATH;
+        header[headers.count].value = fname;
+        headers.count++;
 
-                var = iMetaData.value(MetaImageDate);
-                if (var.isValid()) {
-                    QDateTime dateTime(var.toDateTime());
-                    if (dateTime.isValid()) {
-                        GTimeVal tv;
-                        qint64 msec = dateTime.toMSecsSinceEpoch();
-                        tv.tv_sec = (glong)(msec/1000);
-                        tv.tv_usec = (glong)(msec%1000) * 1000;
-                        ttime = g_time_val_to_iso8601(&tv);
-                        header[headers.count].name = HEADER_IMAGE_DATE;
-                        header[headers.count].value = ttime;
-                        headers.count++;
-                        sortTime = dateTime;
-                        dateTaken = dateTime;
-                    }
-                }
+        char fsize[16];
+        snprintf(fsize, sizeof(fsize), "%lu", (gulong)bytes.len);
+        header[headers.count].name = HEADER_ORIGINAL_SIZE;
+        header[headers.count].value = fsize;
+        headers.count++;
 
-                cameraMaker = iMetaData.value(MetaCameraManufacturer).toString();
-                if (!cameraMaker.isEmpty()) {
-                    cameraMakerBytes = cameraMaker.toUtf8();
-                    header[headers.count].name = HEADER_CAMERA_MANUFACTURER;
-                    header[headers.count].value = cameraMakerBytes.constData();
-                    headers.count++;
-                }
+        header[headers.count].name = HEADER_TITLE;
+        header[headers.count].value = titleBytes.constData();
+        headers.count++;
 
-                cameraModel = iMetaData.value(MetaCameraModel).toString();
-                if (!cameraModel.isEmpty()) {
-                    cameraModelBytes = cameraModel.toUtf8();
-                    header[headers.count].name = HEADER_CAMERA_MODEL;
-                    header[headers.count].value = cameraModelBytes.constData();
-                    headers.count++;
-                }
+        header[headers.count].name = HEADER_IMAGE_ID;
+        header[headers.count].value = iFile->iImageId.constData();
+        headers.count++;
 
-                char latitude[G_ASCII_DTOSTR_BUF_SIZE];
-                if (addDoubleHeader(iMetaData.value(MetaLatitude),
-                    header + headers.count, HEADER_LATITUDE, latitude)) {
-                    headers.count++;
-                }
+        if (iFile->iHaveStat) {
+            GTimeVal tv;
+            tv.tv_sec = st.st_mtim.tv_sec;
+            tv.tv_usec = st.st_mtim.tv_nsec / 1000;
+            mtime = g_time_val_to_iso8601(&tv);
+            header[headers.count].name = HEADER_MODIFICATION_TIME;
+            header[headers.count].value = mtime;
+            headers.count++;
 
-                char longitude[G_ASCII_DTOSTR_BUF_SIZE];
-                if (addDoubleHeader(iMetaData.value(MetaLongitude),
-                    header + headers.count, HEADER_LONGITUDE, longitude)) {
-                    headers.count++;
-                }
+            sortTime.setMSecsSinceEpoch(((qint64)tv.tv_sec) * 1000 +
+                st.st_mtim.tv_nsec/1000000);
 
-                char altitude[G_ASCII_DTOSTR_BUF_SIZE];
-                if (addDoubleHeader(iMetaData.value(MetaAltitude),
-                    header + headers.count, HEADER_ALTITUDE, altitude)) {
-                    headers.count++;
-                }
+            tv.tv_sec = st.st_atim.tv_sec;
+            tv.tv_usec = st.st_atim.tv_nsec / 1000;
+            atime = g_time_val_to_iso8601(&tv);
+            header[headers.count].name = HEADER_ACCESS_TIME;
+            header[headers.count].value = atime;
+            headers.count++;
+        }
 
-                HASSERT(headers.count <= G_N_ELEMENTS(header));
-                HDEBUG("Writing" << dest->str);
-                if (foilmsg_encrypt(out, &bytes, content_type, &headers,
-                    iPrivateKey, iPublicKey, &opt, NULL)) {
-                    if (atime && mtime) {
-                        foil_output_close(out);
-                        foil_output_unref(out);
-                        out = NULL;
-
-                        struct timeval times[2];
-                        times[0].tv_sec = st.st_atim.tv_sec;
-                        times[0].tv_usec = st.st_atim.tv_nsec / 1000;
-                        times[1].tv_sec = st.st_mtim.tv_sec;
-                        times[1].tv_usec = st.st_mtim.tv_nsec / 1000;
-                        if (utimes(dest->str, times) < 0) {
-                            HWARN("Failed to set times on" <<
-                                dest->str << ":" << strerror(errno));
-                        }
-                    }
+        // Metadata
+        char degrees[16];
+        if (iFile->iOrientationVar.isValid()) {
+            snprintf(degrees, sizeof(degrees), "%d", orientation);
+            header[headers.count].name = HEADER_ORIENTATION;
+            header[headers.count].value = degrees;
+            headers.count++;
+        }
+
+        QVariant var(metaData.value(MetaImageDate));
+        if (var.isValid()) {
+            QDateTime dateTime(var.toDateTime());
+            if (dateTime.isValid()) {
+                GTimeVal tv;
+                qint64 msec = dateTime.toMSecsSinceEpoch();
+                tv.tv_sec = (glong)(msec/1000);
+                tv.tv_usec = (glong)(msec%1000) * 1000;
+                ttime = g_time_val_to_iso8601(&tv);
+                header[headers.count].name = HEADER_IMAGE_DATE;
+                header[headers.count].value = ttime;
+                headers.count++;
+                sortTime = dateTime;
+                dateTaken = dateTime;
+            }
+        }
 
-                    GBytes* digest = foil_digest_data(DIGEST_TYPE,
-                        bytes.val, bytes.len);
-                    QImage thumb = ModelData::thumbnail(image, iThumbSize,
-                        orientation);
-                    QString thumbName = writeThumb(image, &headers,
-                        content_type, thumb, iDestDir);
-                    iData = new ModelData(iSourceFile, bytes.len, image.size(),
-                        digest, dest->str, thumbName, thumb, title,
-                        content_type, sortTime, orientation, cameraMaker,
-                        cameraModel, latitude, longitude, altitude,
-                        dateTaken, NULL);
-                    g_bytes_unref(digest);
+        cameraMaker = metaData.value(MetaCameraManufacturer).toString();
+        if (!cameraMaker.isEmpty()) {
+            cameraMakerBytes = cameraMaker.toUtf8();
+            header[headers.count].name = HEADER_CAMERA_MANUFACTURER;
+            header[headers.count].value = cameraMakerBytes.constData();
+            headers.count++;
+        }
+
+        cameraModel = metaData.value(MetaCameraModel).toString();
+        if (!cameraModel.isEmpty()) {
+            cameraModelBytes = cameraModel.toUtf8();
+            header[headers.count].name = HEADER_CAMERA_MODEL;
+            header[headers.count].value = cameraModelBytes.constData();
+            headers.count++;
+        }
+
+        char latitude[G_ASCII_DTOSTR_BUF_SIZE];
+        if (addDoubleHeader(metaData.value(MetaLatitude),
+            header + headers.count, HEADER_LATITUDE, latitude)) {
+            headers.count++;
+        }
+
+        char longitude[G_ASCII_DTOSTR_BUF_SIZE];
+        if (addDoubleHeader(metaData.value(MetaLongitude),
+            header + headers.count, HEADER_LONGITUDE, longitude)) {
+            headers.count++;
+        }
+
+        char altitude[G_ASCII_DTOSTR_BUF_SIZE];
+        if (addDoubleHeader(metaData.value(MetaAltitude),
+            header + headers.count, HEADER_ALTITUDE, altitude)) {
+            headers.count++;
+        }
+
+        HASSERT(headers.count <= G_N_ELEMENTS(header));
+        HDEBUG("Writing" << dest->str);
+        if (encryptMessage(out, &bytes, content_type, &headers, &opt)) {
+            if (atime && mtime) {
+                foil_output_close(out);
+                foil_output_unref(out);
+                out = NULL;
+
+                struct timeval times[2];
+                times[0].tv_sec = st.st_atim.tv_sec;
+                times[0].tv_usec = st.st_atim.tv_nsec / 1000;
+                times[1].tv_sec = st.st_mtim.tv_sec;
+                times[1].tv_usec = st.st_mtim.tv_nsec / 1000;
+                if (utimes(dest->str, times) < 0) {
+                    HWARN("Failed to set times on" <<
+                        dest->str << ":" << strerror(errno));
                 }
-                g_free(mtime);
-                g_free(atime);
-                g_free(ttime);
             }
 
-            foil_output_unref(out);
+            QString thumbName = writeThumb(fullSize, &headers,
+                content_type, iFile->iThumbLevels, iDestDir);
+            iData = new ModelData(iStrings.data(), sourceFile, bytes.len,
+                fullSize, QString::fromLatin1(iFile->iImageId), dest->str,
+                thumbName, thumb, title, content_type, sortTime, orientation,
+                ModelData::Exif::create(iStrings.data(), cameraMaker,
+                cameraModel, latitude, longitude, altitude, dateTaken), NULL);
+            iData->iCoverLevelSize = iFile->iCoverLevelSize;
         }
-        g_mapped_file_unref(map);
-        if (iData) {
-            removeFile(iSourceFile);
+        g_free(mtime);
+        g_free(atime);
+        g_free(ttime);
+        foil_output_unref(out);
+    }
+    if (iData) {
+        removeFile(sourceFile);
+    } else {
+        unlink(dest->str);
+    }
+    g_string_free(dest, TRUE);
+}
+
+// ==========================================================================
+// FoilPicsModel::SaveInfoTask
+// ==========================================================================
+
+class FoilPicsModel::SaveInfoTask : public BaseTask {
+    Q_OBJECT
+
+public:
+    SaveInfoTask(QThreadPool* aPool, ModelInfo aInfo, QString aDir,
+        CatalogState::Ptr aCatalog, FoilPrivateKey* aPrivateKey,
+        FoilKey* aPublicKey);
+    SaveInfoTask(QThreadPool* aPool, ModelInfo::Ops aOps, QString aDir,
+        CatalogState::Ptr aCatalog, FoilPrivateKey* aPrivateKey,
+        FoilKey* aPublicKey);
+
+    virtual void performTask();
+
+public:
+    ModelInfo iInfo;
+    ModelInfo::Ops iOps;
+    bool iSnapshot;
+    QString iFoilDir;
+    CatalogState::Ptr iCatalog;
+    bool iSnapshotNeeded;
+};
+
+FoilPicsModel::SaveInfoTask::SaveInfoTask(QThreadPool* aPool, ModelInfo aInfo,
+    QString aFoilDir, CatalogState::Ptr aCatalog, FoilPrivateKey* aPrivateKey,
+    FoilKey* aPublicKey) :
+    BaseTask(aPool, aPrivateKey, aPublicKey),
+    iInfo(aInfo),
+    iSnapshot(true),
+    iFoilDir(aFoilDir),
+    iCatalog(aCatalog),
+    iSnapshotNeeded(false)
+{
+}
+
+FoilPicsModel::SaveInfoTask::SaveInfoTask(QThreadPool* aPool,
+    ModelInfo::Ops aOps, QString aFoilDir, CatalogState::Ptr aCatalog,
+    FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey) :
+    BaseTask(aPool, aPrivateKey, aPublicKey),
+    iOps(aOps),
+    iSnapshot(false),
+    iFoilDir(aFoilDir),
+    iCatalog(aCatalog),
+    iSnapshotNeeded(false)
+{
+}
+
+void FoilPicsModel::SaveInfoTask::performTask()
+{
+    // Either writes the full snapshot and starts a new journal, or
+    // appends the changes to the journal. If the changes can't be
+    // appended, the rest of them are useless until the next snapshot,
+    // and the model is told to take one.
+    CatalogState* state = iCatalog.data();
+    if (state->iReadOnly) {
+        HWARN("Not overwriting the catalog written by a newer version");
+    } else if (!isCanceled()) {
+        if (iSnapshot) {
+            iInfo.iGeneration = state->iGeneration + 1;
+            state->iLoaded = iInfo.save(iFoilDir, iPrivateKey, iPublicKey);
+            if (state->iLoaded) {
+                state->iGeneration = iInfo.iGeneration;
+                state->iThumbMap = iInfo.iThumbMap;
+                state->iStale = false;
+                state->iJournalRecords = 0;
+                state->iJournalSize = 0;
+            } else {
+                // The next save will try again
+                state->iStale = true;
+            }
+        } else if (state->iStale || !state->iLoaded ||
+            state->iJournalRecords >= JOURNAL_MAX_RECORDS ||
+            !iOps.append(iFoilDir, iPrivateKey, iPublicKey, state)) {
+            state->iStale = true;
+            iSnapshotNeeded = true;
         } else {
-            unlink(dest->str);
+            QHashIterator<QString,QString> it(iOps.iThumbMap);
+            while (it.hasNext()) {
+                it.next();
+                if (it.value().isEmpty()) {
+                    state->iThumbMap.remove(it.key());
+                } else {
+                    state->iThumbMap.insert(it.key(), it.value());
+                }
+            }
         }
-        g_string_free(dest, TRUE);
-    } else {
-        HWARN("Failed to read" << fname << error->message);
-        g_error_free(error);
     }
 }
 
 // ==========================================================================
-// FoilPicsModel::SaveInfoTask
+// FoilPicsModel::CompactThumbsTask
 // ==========================================================================
 
-class FoilPicsModel::SaveInfoTask : public BaseTask {
+class FoilPicsModel::CompactThumbsTask : public FoilPicsTask {
     Q_OBJECT
 
 public:
-    SaveInfoTask(QThreadPool* aPool, ModelInfo aInfo, QString aDir,
-        FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey);
+    CompactThumbsTask(QThreadPool* aPool, QString aDir, QStringList aRefs,
+        CatalogState::Ptr aCatalog);
 
     virtual void performTask();
 
 public:
-    ModelInfo iInfo;
-    QString iFoilDir;
+    QString iDir;
+    QStringList iRefs;
+    CatalogState::Ptr iCatalog;
+    FoilPicsSegmentStore::Remap iRemap;
 };
 
-FoilPicsModel::SaveInfoTask::SaveInfoTask(QThreadPool* aPool, ModelInfo aInfo,
-    QString aFoilDir, FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey) :
-    BaseTask(aPool, aPrivateKey, aPublicKey),
-    iInfo(aInfo),
-    iFoilDir(aFoilDir)
+FoilPicsModel::CompactThumbsTask::CompactThumbsTask(QThreadPool* aPool,
+    QString aDir, QStringList aRefs, CatalogState::Ptr aCatalog) :
+    FoilPicsTask(aPool),
+    iDir(aDir),
+    iRefs(aRefs),
+    iCatalog(aCatalog)
 {
 }
 
-void FoilPicsModel::SaveInfoTask::performTask()
+void FoilPicsModel::CompactThumbsTask::performTask()
 {
     if (!isCanceled()) {
-        iInfo.save(iFoilDir, iPrivateKey, iPublicKey);
+        // This runs on the same thread as SaveInfoTask, i.e. after the
+        // saves queued so far, and sees what has actually been committed.
+        // Without a usable catalog on disk, it's not known what else may
+        // be referring to the segments, so nothing gets deleted.
+        const CatalogState* state = iCatalog.data();
+        const bool known = state->iLoaded && !state->iReadOnly;
+        QStringList saved;
+        if (known) {
+            QHashIterator<QString,QString> it(state->iThumbMap);
+            while (it.hasNext()) {
+                const QString thumb(it.next().value());
+                if (FoilPicsSegmentStore::isRef(thumb)) {
+                    saved.append(thumb);
+                }
+            }
+        }
+        iRemap = FoilPicsSegmentStore::compact(iDir, iRefs, saved, known);
+    }
+}
+
+// ==========================================================================
+// FoilPicsModel::MigrateVaultTask
+// ==========================================================================
+
+class FoilPicsModel::MigrateVaultTask : public FoilPicsTask {
+    Q_OBJECT
+
+public:
+    MigrateVaultTask(QThreadPool* aPool, QString aDir, bool aSharded,
+        QSet<QString> aBusyPaths, QStringList aPending);
+
+    virtual void performTask();
+
+public:
+    QString iDir;
+    bool iSharded;
+    QSet<QString> iBusyPaths;
+    QStringList iPending;   // Paths left to move, listed by the first task
+    QHash<QString,QString> iMoved; // Old path => new path
+    bool iMore;             // Not just the busy paths are left
+};
+
+FoilPicsModel::MigrateVaultTask::MigrateVaultTask(QThreadPool* aPool,
+    QString aDir, bool aSharded, QSet<QString> aBusyPaths,
+    QStringList aPending) :
+    FoilPicsTask(aPool),
+    iDir(aDir),
+    iSharded(aSharded),
+    iBusyPaths(aBusyPaths),
+    iPending(aPending),
+    iMore(false)
+{
+}
+
+void FoilPicsModel::MigrateVaultTask::performTask()
+{
+    // Moves up to VAULT_MIGRATE_BATCH files at a time, so that the model
+    // gets to update its paths every now and then. The vault is listed
+    // by the first task, the following ones get what's left of the list.
+    if (iPending.isEmpty()) {
+        const FoilPicsVaultLayout::Files files(FoilPicsVaultLayout::
+            listFiles(iDir));
+        QHashIterator<QString,QString> it(files);
+        while (it.hasNext()) {
+            it.next();
+            const QString path(it.value());
+            if (FoilPicsVaultLayout::isId(it.key()) &&
+                path != FoilPicsVaultLayout::filePath(iDir, it.key(),
+                iSharded)) {
+                iPending.append(path);
+            }
+        }
+        HDEBUG(iPending.count() << "file(s) to move");
+    }
+    // Files which are busy now are left where they are, and go to
+    // the end of the list
+    int i;
+    QStringList busy;
+    for (i = 0; i < iPending.count() && !isCanceled() &&
+        iMoved.count() < VAULT_MIGRATE_BATCH; i++) {
+        const QString path(iPending.at(i));
+        if (iBusyPaths.contains(path)) {
+            busy.append(path);
+        } else {
+            const QString dest(FoilPicsVaultLayout::move(iDir, path,
+                iSharded));
+            if (!dest.isEmpty()) {
+                iMoved.insert(path, dest);
+            }
+        }
     }
+    iPending = iPending.mid(i);
+    iMore = !iPending.isEmpty() && !isCanceled();
+    iPending.append(busy);
+    HDEBUG(iMoved.count() << "file(s) moved," << iPending.count() << "left");
 }
 
 // ==========================================================================
@@ -1178,29 +2748,29 @@ void FoilPicsModel::CheckPicsTask::performTask()
     const QString path(iDir);
     HDEBUG("Checking" << iDir);
 
-    QDir dir(path);
-    QFileInfoList list = dir.entryInfoList(QDir::Files |
-        QDir::Dirs | QDir::NoDotAndDotDot, QDir::NoSort);
-
-    const QString infoFile(INFO_FILE);
+    const QStringList list(FoilPicsVaultLayout::listFiles(path).values());
     for (int i=0; i<list.count() && !iMayHaveEncryptedPictures; i++) {
-        const QFileInfo& info = list.at(i);
-        if (info.isFile() && info.fileName() != infoFile) {
-            const QByteArray fileNameBytes(info.filePath().toUtf8());
-            const char* fname = fileNameBytes.constData();
-            GMappedFile* map = g_mapped_file_new(fname, FALSE, NULL);
-            if (map) {
-                FoilBytes bytes;
-                bytes.val = (guint8*)g_mapped_file_get_contents(map);
-                bytes.len = g_mapped_file_get_length(map);
-                FoilMsgInfo* info = foilmsg_parse(&bytes);
-                if (info) {
-                    HDEBUG(fname << "may be a foiled picture");
-                    iMayHaveEncryptedPictures = true;
-                    foilmsg_info_free(info);
-                }
-                g_mapped_file_unref(map);
+        const QByteArray fileNameBytes(list.at(i).toUtf8());
+        const char* fname = fileNameBytes.constData();
+        GMappedFile* map = g_mapped_file_new(fname, FALSE, NULL);
+        if (map) {
+            FoilBytes bytes;
+            guint32 len;
+            bytes.val = (guint8*)g_mapped_file_get_contents(map);
+            bytes.len = g_mapped_file_get_length(map);
+            if (BaseTask::headerBlockLength(bytes.val, bytes.len, &len) &&
+                bytes.len > HEADER_BLOCK_PREFIX_SIZE + len) {
+                // The header block is enough to tell
+                bytes.val += HEADER_BLOCK_PREFIX_SIZE;
+                bytes.len = len;
             }
+            FoilMsgInfo* info = foilmsg_parse(&bytes);
+            if (info) {
+                HDEBUG(fname << "may be a foiled picture");
+                iMayHaveEncryptedPictures = true;
+                foilmsg_info_free(info);
+            }
+            g_mapped_file_unref(map);
         }
     }
 }
@@ -1241,17 +2811,23 @@ public:
 
     virtual void performTask();
 
-    ModelData* decryptThumb(QString aImagePath, QString aThumbPath);
-    ModelData* decryptImage(QString aImagePath);
-    bool decryptFile(QString aPath, QString aThumbPath);
+    ModelData* decryptThumb(QString aImagePath, QString aThumbPath,
+        int aThumbFd = -1);
+    ModelData* decryptImage(QString aImagePath, int aFd = -1);
+    bool decryptFile(QString aPath, QString aThumbPath, int aFd = -1,
+        int aThumbFd = -1);
+    bool isThumbFile(QString aPath) const;
 
 Q_SIGNALS:
     void groupsDecrypted(FoilPicsGroupModel::GroupList aGroups);
+    void filesMissing(QStringList aPaths);
     void progress(DecryptPicsTask::Progress::Ptr aProgress);
 
 public:
     QString iDir;
     QSize iThumbSize;
+    CatalogState::Ptr iCatalog;
+    ModelInfo iInfo;
     bool iSaveInfo;
 };
 
@@ -1268,22 +2844,28 @@ FoilPicsModel::DecryptPicsTask::DecryptPicsTask(QThreadPool* aPool,
 }
 
 FoilPicsModel::ModelData*
-FoilPicsModel::DecryptPicsTask::decryptImage(QString aImagePath)
+FoilPicsModel::DecryptPicsTask::decryptImage(QString aImagePath, int aFd)
 {
     FoilPicsModel::ModelData* data = NULL;
-    FoilMsg* msg = decryptAndVerify(aImagePath);
+    FoilMsg* msg = (aFd >= 0) ?
+        decryptAndVerify(aFd, aImagePath.toUtf8().constData()) :
+        decryptAndVerify(aImagePath);
     if (msg) {
         QString origPath = ModelData::headerString(msg, HEADER_ORIGINAL_PATH);
         if (!origPath.isEmpty()) {
-            QImage image = toImage(msg);
-            if (!image.isNull()) {
+            QSize fullSize;
+            const int deg = ModelData::headerInt(msg, HEADER_ORIENTATION);
+            QImage cover;
+            QImage thumb = toThumbnail(msg, iThumbSize, deg, &fullSize,
+                iCoverLevelSize, &cover);
+            if (!thumb.isNull()) {
                 HDEBUG("Loaded image from" << qPrintable(aImagePath));
-                int deg = ModelData::headerInt(msg, HEADER_ORIENTATION);
-                QImage thumb = ModelData::thumbnail(image, iThumbSize, deg);
-                QString thumbName = writeThumb(image, &msg->headers,
-                    msg->content_type, thumb, iDir);
-                data = ModelData::fromFoilMsg(msg, origPath, image.size(),
+                QString thumbName = writeThumb(fullSize, &msg->headers,
+                    msg->content_type, makeThumbLevels(thumb, cover), iDir);
+                data = ModelData::fromFoilMsg(iStrings.data(), msg,
+                    origPath, fullSize,
                     aImagePath, thumbName, thumb, msg->content_type, deg);
+                data->iCoverLevelSize = cover.size();
             }
         }
         foilmsg_free(msg);
@@ -1293,26 +2875,61 @@ FoilPicsModel::DecryptPicsTask::decryptImage(QString aImagePath)
 
 FoilPicsModel::ModelData*
 FoilPicsModel::DecryptPicsTask::decryptThumb(QString aImagePath,
-    QString aThumbPath)
+    QString aThumbPath, int aThumbFd)
 {
     FoilPicsModel::ModelData* data = NULL;
-    FoilMsg* msg = decryptAndVerify(aThumbPath);
+    const bool isRef = FoilPicsSegmentStore::isRef(aThumbPath);
+    FoilMsg* msg = isRef ? decryptAndVerifyRecord(iDir, aThumbPath) :
+        (aThumbFd >= 0) ?
+        decryptAndVerify(aThumbFd, aThumbPath.toUtf8().constData()) :
+        decryptAndVerify(aThumbPath);
     if (msg) {
         // Thumbnail absolutely must have these:
         const int w = ModelData::headerInt(msg, HEADER_THUMB_FULL_WIDTH);
         const int h = ModelData::headerInt(msg, HEADER_THUMB_FULL_HEIGHT);
         QString origPath = ModelData::headerString(msg, HEADER_ORIGINAL_PATH);
         if (w > 0 && h > 0 && !origPath.isEmpty()) {
-            // Make sure that the size is right
-            QImage thumbImage = toImage(msg);
-            QString thumbName = QFileInfo(aThumbPath).fileName();
-            HDEBUG(thumbName << thumbImage.size());
-            if (!thumbImage.isNull() && thumbImage.size() == iThumbSize) {
+            // Any level at least as large as we need will do
+            bool exact;
+            QImage thumb(loadThumbnail(msg, iThumbSize, &exact));
+            QString thumbName = isRef ? aThumbPath :
+                QFileInfo(aThumbPath).fileName();
+            if (!thumb.isNull()) {
+                // The cover level isn't decoded unless it has to be
+                // rewritten, only its size is remembered
+                QSize coverLevelSize;
+                QImage cover;
+                const QList<ThumbLevel> index(thumbLevels(msg));
+                for (int i = 0; i < index.count() &&
+                    !coverLevelSize.isValid(); i++) {
+                    if (index.at(i).size == iCoverLevelSize) {
+                        coverLevelSize = iCoverLevelSize;
+                    }
+                }
+                if (!exact) {
+                    // Store the regenerated chain, so that the scaling
+                    // doesn't have to be repeated on every unlock
+                    if (coverLevelSize.isValid()) {
+                        cover = loadThumbLevel(msg, coverLevelSize);
+                        coverLevelSize = cover.size();
+                    }
+                    QString newName = writeThumb(QSize(w, h), &msg->headers,
+                        msg->content_type, makeThumbLevels(thumb, cover),
+                        iDir);
+                    if (!newName.isEmpty()) {
+                        HDEBUG("Rewrote" << thumbName << "as" << newName);
+                        if (!isRef) removeFile(aThumbPath);
+                        thumbName = newName;
+                        iSaveInfo = true;
+                    }
+                }
                 // This thumb is good to go
                 HDEBUG("Loaded thumbnail from" << qPrintable(aThumbPath));
-                data = ModelData::fromFoilMsg(msg, origPath, QSize(w, h),
-                    aImagePath, thumbName, thumbImage, msg->content_type,
+                data = ModelData::fromFoilMsg(iStrings.data(), msg,
+                    origPath, QSize(w, h),
+                    aImagePath, thumbName, thumb, msg->content_type,
                     ModelData::headerInt(msg, HEADER_ORIENTATION));
+                data->iCoverLevelSize = coverLevelSize;
             }
         }
         foilmsg_free(msg);
@@ -1320,14 +2937,33 @@ FoilPicsModel::DecryptPicsTask::decryptThumb(QString aImagePath,
     return data;
 }
 
+// Only looks at the files with the header block, anything else would
+// have to be decrypted in full twice.
+bool FoilPicsModel::DecryptPicsTask::isThumbFile(QString aPath) const
+{
+    bool thumb = false;
+    guint32 len;
+    const QByteArray path(aPath.toUtf8());
+    if (headerBlockLength(path.constData(), &len)) {
+        FoilMsg* msg = decryptHeaders(aPath);
+        if (msg) {
+            thumb = ModelData::headerInt(msg, HEADER_THUMB_FULL_WIDTH) > 0;
+            foilmsg_free(msg);
+        }
+    }
+    return thumb;
+}
+
+// The file descriptors, if any, remain owned by the caller
 bool FoilPicsModel::DecryptPicsTask::decryptFile(QString aImagePath,
-    QString aThumbPath)
+    QString aThumbPath, int aFd, int aThumbFd)
 {
-    ModelData* data = decryptThumb(aImagePath, aThumbPath);
+    ModelData* data = decryptThumb(aImagePath, aThumbPath, aThumbFd);
     if (!data) {
-        data = decryptImage(aImagePath);
+        data = decryptImage(aImagePath, aFd);
     }
     if (data) {
+        iInfo.apply(data);
         // The Progress takes ownership of ModelData
         Q_EMIT progress(Progress::Ptr(new Progress(data, this)));
         return true;
@@ -1338,63 +2974,76 @@ bool FoilPicsModel::DecryptPicsTask::decryptFile(QString aImagePath,
 void FoilPicsModel::DecryptPicsTask::performTask()
 {
     if (!isCanceled()) {
-        const QString path(iDir);
         HDEBUG("Checking" << iDir);
 
-        QDir dir(path);
-        QFileInfoList list = dir.entryInfoList(QDir::Files |
-            QDir::Dirs | QDir::NoDotAndDotDot, QDir::NoSort);
-
         // Restore the order
-        ModelInfo info = ModelInfo::load(iDir, iPrivateKey, iPublicKey);
+        ModelInfo info = ModelInfo::load(iDir, iPrivateKey, iPublicKey,
+            iCatalog.data());
+        iInfo = info;
         Q_EMIT groupsDecrypted(info.iGroups);
 
-        const QString infoFile(INFO_FILE);
-        QHash<QString,QString> fileMap;
+        // First decrypt files in known order. Trust the catalog, there's
+        // no need to list the directory before showing the first picture.
+        // The files may be in either layout while being migrated, each
+        // one gets opened once wherever it's found.
         int i;
-        for (i=0; i<list.count(); i++) {
-            const QFileInfo& info = list.at(i);
-            if (info.isFile()) {
-                const QString name(info.fileName());
-                if (name != infoFile) {
-                    fileMap.insert(name, info.filePath());
-                }
-            }
-        }
-
-        // First decrypt files in known order
+        QSet<QString> known;
+        QStringList paths;
         for (i=0; i<info.iOrder.count() && !isCanceled(); i++) {
             const QString image(info.iOrder.at(i));
             const QString thumb(info.iThumbMap.value(image));
-            QString imagePath, thumbPath;
-            if (fileMap.contains(image)) {
-                imagePath = fileMap.take(image);
-            } else {
-                // Broken order
-                HDEBUG(qPrintable(image) << "oops!");
+            QString path, thumbPath;
+            const int fd = FoilPicsVaultLayout::open(iDir, image, iSharded,
+                &path);
+            int thumbFd = -1;
+            known.insert(image);
+            paths.append(path);
+            if (FoilPicsSegmentStore::isRef(thumb)) {
+                thumbPath = thumb;
+            } else if (!thumb.isEmpty()) {
+                known.insert(thumb);
+                thumbFd = FoilPicsVaultLayout::open(iDir, thumb, iSharded,
+                    &thumbPath);
+            }
+            // A missing thumbnail simply fails to decrypt and gets
+            // regenerated from the image
+            if (!decryptFile(path, thumbPath, fd, thumbFd)) {
                 iSaveInfo = true;
             }
-            if (!thumb.isEmpty()) {
-                if (fileMap.contains(thumb)) {
-                    thumbPath = fileMap.take(thumb);
-                } else {
+            if (thumbFd >= 0) close(thumbFd);
+            if (fd >= 0) close(fd);
+        }
+
+        // Then reconcile the catalog with what's actually there
+        if (!isCanceled()) {
+            const FoilPicsVaultLayout::Files files(FoilPicsVaultLayout::
+                listFiles(iDir));
+            const QStringList names(files.keys());
+            QStringList missing;
+            for (i=0; i<paths.count(); i++) {
+                const QString image(info.iOrder.at(i));
+                if (!files.contains(image)) {
                     // Broken order
-                    HDEBUG(qPrintable(thumb) << "oops!");
-                    iSaveInfo = true;
+                    HDEBUG(qPrintable(image) << "oops!");
+                    missing.append(paths.at(i));
                 }
             }
-            if (!decryptFile(imagePath, thumbPath)) {
+            if (!missing.isEmpty()) {
                 iSaveInfo = true;
+                Q_EMIT filesMissing(missing);
             }
-        }
 
-        // Followed by the remaining files in no particular order
-        if (!fileMap.isEmpty()) {
-            QStringList remainingFiles = fileMap.values();
-            for (i=0; i<remainingFiles.count() && !isCanceled(); i++) {
-                if (decryptFile(remainingFiles.at(i), QString())) {
-                    HDEBUG(remainingFiles.at(i) << "was not expected");
-                    iSaveInfo = true;
+            // Followed by the remaining files in no particular order
+            for (i=0; i<names.count() && !isCanceled(); i++) {
+                const QString name(names.at(i));
+                if (!known.contains(name)) {
+                    const QString path(files.value(name));
+                    if (isThumbFile(path)) {
+                        HDEBUG(name << "is an orphaned thumbnail");
+                    } else if (decryptFile(path, QString())) {
+                        HDEBUG(name << "was not expected");
+                        iSaveInfo = true;
+                    }
                 }
             }
         }
@@ -1493,15 +3142,17 @@ bool FoilPicsModel::DecryptTask::saveDecrypted(FoilMsg* msg)
 
 void FoilPicsModel::DecryptTask::performTask()
 {
-    FoilMsg* msg = decryptAndVerify(iPath);
+    const QString path(FoilPicsVaultLayout::resolve(iPath));
+    FoilMsg* msg = decryptAndVerify(path);
     if (msg) {
         iOk = (!isCanceled() && saveDecrypted(msg));
         foilmsg_free(msg);
         if (iOk) {
-            removeFile(iPath);
-            if (!iThumbFile.isEmpty()) {
-                QString thumbPath(QFileInfo(iPath).dir().filePath(iThumbFile));
-                removeFile(thumbPath);
+            removeFile(path);
+            // Segment records are reclaimed by compaction
+            if (!iThumbFile.isEmpty() &&
+                !FoilPicsSegmentStore::isRef(iThumbFile)) {
+                removeFile(FoilPicsVaultLayout::siblingPath(path, iThumbFile));
             }
         }
     }
@@ -1528,6 +3179,9 @@ public:
     QByteArray iBytes;
     QString iContentType;
     FoilPicsImageRequest iRequest;
+    QString iDir;
+    QString iThumbFile;     // Set if the cover level is good enough
+    QSize iCoverLevelSize;
 };
 
 FoilPicsModel::ImageRequestTask::ImageRequestTask(QThreadPool* aPool,
@@ -1553,8 +3207,25 @@ void FoilPicsModel::ImageRequestTask::performTask()
     FoilMsg* msg = NULL;
     QByteArray contentTypeBytes = iContentType.toLatin1();
     const char* type = contentTypeBytes.constData();
+    if (iBytes.isEmpty() && !iThumbFile.isEmpty() && !isCanceled()) {
+        // Small requests (e.g. the cover) don't need the full image
+        msg = FoilPicsSegmentStore::isRef(iThumbFile) ?
+            decryptAndVerifyRecord(iDir, iThumbFile) :
+            decryptAndVerify(FoilPicsVaultLayout::resolve(FoilPicsVaultLayout::
+                siblingPath(iPath, iThumbFile)));
+        if (msg) {
+            const QImage image(loadThumbLevel(msg, iCoverLevelSize));
+            foilmsg_free(msg);
+            msg = NULL;
+            if (!image.isNull()) {
+                HDEBUG(qPrintable(iPath) << "cover" << image.size());
+                iRequest.reply(image);
+                return;
+            }
+        }
+    }
     if (iBytes.isEmpty() && !isCanceled()) {
-        const QByteArray path(iPath.toUtf8());
+        const QByteArray path(FoilPicsVaultLayout::resolve(iPath).toUtf8());
         const char* fname = path.constData();
         msg = decryptAndVerify(fname);
         if (msg && !isCanceled()) {
@@ -1576,156 +3247,6 @@ void FoilPicsModel::ImageRequestTask::performTask()
     foilmsg_free(msg);
 }
 
-// ==========================================================================
-// FoilPicsModel::SetHeaderTask
-// ==========================================================================
-
-class FoilPicsModel::SetHeaderTask : public BaseTask {
-    Q_OBJECT
-
-public:
-    SetHeaderTask(QThreadPool* aPool, FoilPrivateKey* aPrivateKey,
-        FoilKey* aPublicKey,  ModelData* aData, const char* aHeaderName,
-        QByteArray aHeaderValue);
-
-    static SetHeaderTask* createTitleTask(QThreadPool* aPool,
-        FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, ModelData* aData);
-    static SetHeaderTask* createGroupTask(QThreadPool* aPool,
-        FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, ModelData* aData);
-
-    virtual void performTask();
-    QString setHeaderAndEncrypt(FoilMsg* aMsg);
-
-public:
-    ModelData* iData;
-    const QString iPath;
-    const QString iThumbFile;
-    const char* iHeaderName;
-    const QByteArray iHeaderValue;
-    QString iNewPath;
-    QString iNewThumbFile;
-    bool iOk;
-};
-
-FoilPicsModel::SetHeaderTask::SetHeaderTask(QThreadPool* aPool,
-    FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, ModelData* aData,
-    const char* aHeaderName, QByteArray aHeaderValue) :
-    BaseTask(aPool, aPrivateKey, aPublicKey),
-    iData(aData),
-    iPath(aData->iPath),
-    iThumbFile(aData->iThumbFile),
-    iHeaderName(aHeaderName),
-    iHeaderValue(aHeaderValue),
-    iOk(false)
-{
-}
-
-FoilPicsModel::SetHeaderTask*
-FoilPicsModel::SetHeaderTask::createTitleTask(QThreadPool* aPool,
-    FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, ModelData* aData)
-{
-    return new SetHeaderTask(aPool, aPrivateKey, aPublicKey, aData,
-        HEADER_TITLE, aData->iTitle.toUtf8());
-}
-
-FoilPicsModel::SetHeaderTask*
-FoilPicsModel::SetHeaderTask::createGroupTask(QThreadPool* aPool,
-    FoilPrivateKey* aPrivateKey, FoilKey* aPublicKey, ModelData* aData)
-{
-    return new SetHeaderTask(aPool, aPrivateKey, aPublicKey, aData,
-        HEADER_GROUP, aData->iGroupId);
-}
-
-QString FoilPicsModel::SetHeaderTask::setHeaderAndEncrypt(FoilMsg* aMsg)
-{
-    QString destPath;
-    QString destDir(QFileInfo(iPath).dir().path());
-    GString* dest = g_string_sized_new(destDir.size() + 9);
-    FoilOutput* out = createFoilFile(destDir, dest);
-    if (out) {
-        // Allocate one more in case if the header in question is missing
-        FoilMsgHeader* header = new FoilMsgHeader[aMsg->headers.count + 1];
-        FoilMsgHeaders headers;
-        uint i;
-
-        HDEBUG("Writing" << dest->str);
-
-        // Copy the headers (except the one we are going to change)
-        headers.header = header;
-        headers.count = 0;
-        for (i = 0; i < aMsg->headers.count; i++) {
-            const FoilMsgHeader* src = aMsg->headers.header + i;
-            if (strcmp(src->name, iHeaderName)) {
-                HDEBUG(" " << src->name << ":" << src->value);
-                header[headers.count++] = *src;
-            }
-        }
-
-        // Now add the header in question (unless it's empty)
-        if (!iHeaderValue.isEmpty()) {
-            HDEBUG(" " << iHeaderName << ":" << iHeaderValue.constData());
-            header[headers.count].name = iHeaderName;
-            header[headers.count].value = iHeaderValue.constData();
-            headers.count++;
-        }
-
-        FoilMsgEncryptOptions opt;
-        memset(&opt, 0, sizeof(opt));
-        opt.key_type = ENCRYPT_KEY_TYPE;
-
-        FoilBytes bytes;
-        if (foilmsg_encrypt(out, foil_bytes_from_data(&bytes, aMsg->data),
-            aMsg->content_type, &headers, iPrivateKey, iPublicKey, &opt,
-            NULL)) {
-            destPath = QString(dest->str);
-            HDEBUG("Wrote" << foil_output_bytes_written(out) << "bytes");
-        }
-        foil_output_unref(out);
-        g_string_free(dest, TRUE);
-        delete [] header;
-    }
-    return destPath;
-}
-
-void FoilPicsModel::SetHeaderTask::performTask()
-{
-    FoilMsg* fileMsg = decryptAndVerify(iPath);
-    if (fileMsg) {
-        if (!isCanceled()) {
-            QString thumbPath(QFileInfo(iPath).dir().filePath(iThumbFile));
-            FoilMsg* thumbMsg = decryptAndVerify(thumbPath);
-            if (thumbMsg) {
-                if (!isCanceled()) {
-                    QString newFile = setHeaderAndEncrypt(fileMsg);
-                    if (!newFile.isEmpty()) {
-                        if (!isCanceled()) {
-                            QString newThumb = setHeaderAndEncrypt(thumbMsg);
-                            if (!newThumb.isEmpty()) {
-                                // All good
-                                iOk = true;
-                                iNewPath = newFile;
-                                iNewThumbFile = QFileInfo(newThumb).fileName();
-                                HDEBUG(iNewPath << iNewThumbFile);
-                                // Remove the old files
-                                removeFile(iPath);
-                                removeFile(thumbPath);
-                            } else {
-                                // Failed to save thumb
-                                removeFile(newFile);
-                            }
-                        } else {
-                            // Cancelled
-                            removeFile(newFile);
-                        }
-                    }
-                }
-                foilmsg_free(thumbMsg);
-            }
-        }
-        foilmsg_free(fileMsg);
-    }
-}
-
 // ==========================================================================
 // FoilPicsModel::Private
 // ==========================================================================
@@ -1755,52 +3276,110 @@ public:
 
     FoilPicsModel* parentModel();
     ModelData* dataAt(int aIndex);
-    int compare(const ModelData* aData1, const ModelData* aData2) const;
+    static int compare(const ModelData* aData1, const ModelData* aData2);
+    static int compare(quint64 aKey1, const ModelData* aData1,
+        quint64 aKey2, const ModelData* aData2);
+    int rowOf(const ModelData* aData, quint64 aSortKey) const;
+    void updateSortKey(ModelData* aData) const;
+    void updateSortKeys();
+    void updateGroupOffsets();
+    void addToGroup(int aGroupIndex, int aDelta);
     static int sortProc(const void* aPtr1, const void* aPtr2, void* aThis);
 
     struct LessThan {
         Private* obj;
         bool operator()(ModelData* aData1, ModelData* aData2) const {
-            return obj->compare(aData1, aData2) < 0;
+            return (aData1->iSortKey != aData2->iSortKey) ?
+                (aData1->iSortKey < aData2->iSortKey) :
+                (obj->compare(aData1, aData2) < 0);
         }
         LessThan(Private* aThis) : obj(aThis) {}
     };
 
+    struct SortEntry {
+        quint64 key;
+        ModelData* data;
+        int row;
+        bool operator<(const SortEntry& aEntry) const {
+            return (key != aEntry.key) ? (key < aEntry.key) :
+                (compare(data, aEntry.data) < 0);
+        }
+    };
+
+    // Fenwick tree counting the rows anchored at each position
+    class RowCounter {
+    public:
+        RowCounter(int aPositions) : iTree(aPositions + 1, 0) {}
+        void add(int aPos, int aDelta);
+        int countUpTo(int aPos) const;
+
+    private:
+        QVector<int> iTree;
+    };
+
 public Q_SLOTS:
     void onCheckPicsTaskDone();
     void onGroupsDecrypted(FoilPicsGroupModel::GroupList aGroups);
+    void onFilesMissing(QStringList aPaths);
     void onDecryptPicsProgress(DecryptPicsTask::Progress::Ptr aProgress);
     void onDecryptPicsTaskDone();
     void onGenerateKeyTaskDone();
+    void onReadFileTaskDone();
+    void onThumbnailTaskDone();
     void onEncryptTaskDone();
     void onDecryptTaskDone();
     void onDecryptAllProgress();
-    void onSetTitleTaskDone();
-    void onSetGroupTaskDone();
     void onSaveInfoDone();
+    void onCompactThumbsTaskDone();
+    void onMigrateVaultTaskDone();
+    void onVaultLayoutChanged();
     void onImageRequestDone();
     void onGroupModelChanged();
+    void onGroupModelDataChanged(const QModelIndex& aTopLeft,
+        const QModelIndex& aBottomRight, const QVector<int>& aRoles);
+    void flushDataChanged();
 
 public:
     static size_t maxBytesToDecrypt();
+    static int maxEncryptsInProgress();
     void queueSignal(Signal aSignal);
     void emitQueuedSignals();
     bool checkPassword(QString aPassword);
     bool changePassword(QString aOldPassword, QString aNewPassword);
     void setKeys(FoilPrivateKey* aPrivate, FoilKey* aPublic = NULL);
     void setFoilState(FoilState aState);
-    void insertModelData(ModelData* aModelData);
+    int insertModelData(ModelData* aModelData);
+    QString thumbPrefix() const;
+    QString imagePrefix() const;
     void destroyItemAt(int aIndex);
     bool destroyItemAndRemoveFilesAt(int aIndex);
     void removeAt(int aIndex);
     void removeFiles(QList<int> aRows);
     void clearGroupModel();
     void clearModel();
+    static QString catalogName(const ModelData* aData);
+    void journalInsert(int aRow);
+    void journalPlace(int aRow);
+    void journalRemove(const ModelData* aData);
+    void journalSet(ModelInfo::Ops::Op aOp, const ModelData* aData,
+        QString aValue);
+    void journalGroups();
+    void journalChanged();
+    void resetJournal();
     void saveInfo();
     void generate(int aBits, QString aPassword);
     void lock(bool aTimeout);
     bool unlock(QString aPassword);
     void encryptFile(QString aFile, QVariantMap aMetaData);
+    void submitEncryptTasks();
+    void cancelEncryptTasks();
+    void finishEncryptBatch();
+    void setupThumbFormat(BaseTask* aTask) const;
+    void compactThumbs();
+    void migrateVault(QStringList aPending = QStringList());
+    bool shardedLayout() const;
+    bool encrypting() const;
+    bool isKnownDigest(QString aDigestKey) const;
     bool encrypt(QUrl aUrl, QVariantMap aMetaData);
     void encryptFiles(QAbstractItemModel* aModel, QList<int> aRows);
     void decryptAt(int aIndex);
@@ -1809,14 +3388,16 @@ public:
     void decryptTaskDone(DecryptTask* aTask, bool aLast);
     void setTitleAt(int aIndex, QString aTitle);
     bool setGroupId(ModelData* aData, QByteArray aId);
+    void regroup(ModelData* aData, quint64 aPrevSortKey);
+    void moveToGroup(ModelData* aData, quint64 aPrevSortKey);
+    void regroup(const ModelData::List aChanged);
     void clearGroup(QByteArray aId);
     bool sortModel();
+    QVector<int> rearrange();
     void setGroupIdAt(int aIndex, QByteArray aId);
     void setGroupIdForRows(QList<int> aRows, QByteArray aId);
-    void dataChanged(int aIndex, ModelData::Role aRole);
-    void dataChanged(QList<int> aRows, ModelData::Role aRole);
+    void dataChanged(ModelData* aData, ModelData::Role aRole);
     void imageRequest(QString aPath, FoilPicsImageRequest aRequest);
-    void headerUpdateDone(SetHeaderTask* aTask);
     int findPath(QString aPath);
     bool dropDecryptedData(int aDontTouch);
     bool tooMuchDataDecrypted();
@@ -1824,12 +3405,14 @@ public:
 
 public:
     const size_t iMaxBytesToDecrypt;
+    const int iMaxEncryptsInProgress;
     bool iMayHaveEncryptedPictures;
     SignalMask iQueuedSignals;
     int iFirstQueuedSignal;
     FoilPicsImageProvider* iImageProvider;
     FoilPicsThumbnailProvider* iThumbnailProvider;
     QSize iThumbSize;
+    QSize iCoverSize;
     ModelData::List iData;
     FoilState iFoilState;
     QString iFoilPicsDir;
@@ -1838,19 +3421,43 @@ public:
     FoilPrivateKey* iPrivateKey;
     FoilKey* iPublicKey;
     QThreadPool* iThreadPool;
+    QThreadPool* iReadThreadPool;
+    QThreadPool* iThumbnailThreadPool;
     CheckPicsTask* iCheckPicsTask;
     SaveInfoTask* iSaveInfoTask;
+    CatalogState::Ptr iCatalog;
+    ModelInfo::Ops iJournalOps; // Changes made since the last save
+    bool iSnapshotNeeded;       // Rather than the journal record
     GenerateKeyTask* iGenerateKeyTask;
     DecryptPicsTask* iDecryptPicsTask;
+    CompactThumbsTask* iCompactThumbsTask;
+    MigrateVaultTask* iMigrateVaultTask;
+    QStringList iMigratePending; // Were busy when the migration got to them
+    QList<EncryptFile::Ptr> iEncryptQueue;
+    QList<ReadFileTask*> iReadFileTasks;
+    QList<ThumbnailTask*> iThumbnailTasks;
     QList<EncryptTask*> iEncryptTasks;
     QList<ImageRequestTask*> iImageRequestTasks;
+    MGConfItem* iThumbFormatConf;
+    MGConfItem* iThumbQualityConf;
+    MGConfItem* iThumbStoreConf;
+    MGConfItem* iVaultLayoutConf;
+    MGConfItem* iSeparateHeadersConf;
+    QHash<QString,int> iDigests; // Digest key => number of pictures
+    ModelData::Strings::Ptr iStrings; // Shared by all ModelData objects
+    int iDuplicatesSkipped;
+    qlonglong iDuplicateBytesSkipped;
     FoilPicsGroupModel* iGroupModel;
     bool iIgnoreGroupModelChange;
+    QVector<int> iGroupOffsets; // First row of each group plus row count
+    QHash<ModelData*,uint> iChangedRoles; // Role bits
+    bool iFlushDataChangedQueued;
 };
 
 FoilPicsModel::Private::Private(FoilPicsModel* aParent) :
     QObject(aParent),
     iMaxBytesToDecrypt(maxBytesToDecrypt()),
+    iMaxEncryptsInProgress(maxEncryptsInProgress()),
     iMayHaveEncryptedPictures(false),
     iQueuedSignals(0),
     iFirstQueuedSignal(NoSignal),
@@ -1864,15 +3471,36 @@ FoilPicsModel::Private::Private(FoilPicsModel* aParent) :
     iPrivateKey(NULL),
     iPublicKey(NULL),
     iThreadPool(new QThreadPool(this)),
+    iReadThreadPool(new QThreadPool(this)),
+    iThumbnailThreadPool(new QThreadPool(this)),
     iCheckPicsTask(NULL),
     iSaveInfoTask(NULL),
+    iCatalog(new CatalogState),
+    iSnapshotNeeded(false),
     iGenerateKeyTask(NULL),
     iDecryptPicsTask(NULL),
+    iCompactThumbsTask(NULL),
+    iMigrateVaultTask(NULL),
+    iThumbFormatConf(new MGConfItem(KEY_THUMB_FORMAT, this)),
+    iThumbQualityConf(new MGConfItem(KEY_THUMB_QUALITY, this)),
+    iThumbStoreConf(new MGConfItem(KEY_THUMB_STORE, this)),
+    iVaultLayoutConf(new MGConfItem(KEY_VAULT_LAYOUT, this)),
+    iSeparateHeadersConf(new MGConfItem(KEY_SEPARATE_HEADERS, this)),
+    iStrings(new ModelData::Strings),
+    iDuplicatesSkipped(0),
+    iDuplicateBytesSkipped(0),
     iGroupModel(new FoilPicsGroupModel(aParent)),
-    iIgnoreGroupModelChange(false)
+    iIgnoreGroupModelChange(false),
+    iFlushDataChangedQueued(false)
 {
     // Serialize the tasks:
     iThreadPool->setMaxThreadCount(1);
+    // Encryption is pipelined. Files are read one at a time (flash
+    // doesn't like being hit from several threads at once), thumbnails
+    // are generated in parallel, encryption and writing are serialized
+    // together with everything else on iThreadPool.
+    iReadThreadPool->setMaxThreadCount(1);
+    iThumbnailThreadPool->setMaxThreadCount(QThread::idealThreadCount());
     qRegisterMetaType<DecryptPicsTask::Progress::Ptr>("DecryptPicsTask::Progress::Ptr");
 
     HDEBUG("Key file" << qPrintable(iFoilKeyFile));
@@ -1917,6 +3545,10 @@ FoilPicsModel::Private::Private(FoilPicsModel* aParent) :
     iCheckPicsTask = new CheckPicsTask(iThreadPool, iFoilPicsDir);
     iCheckPicsTask->submit(this, SLOT(onCheckPicsTaskDone()));
 
+    // Move the files around when the layout changes
+    connect(iVaultLayoutConf, SIGNAL(valueChanged()),
+        SLOT(onVaultLayoutChanged()));
+
     // Save the info whenever group model changes
     connect(iGroupModel, SIGNAL(modelReset()),
         SLOT(onGroupModelChanged()));
@@ -1927,7 +3559,8 @@ FoilPicsModel::Private::Private(FoilPicsModel* aParent) :
     connect(iGroupModel, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
         SLOT(onGroupModelChanged()));
     connect(iGroupModel, SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)),
-        SLOT(onGroupModelChanged()));
+        SLOT(onGroupModelDataChanged(QModelIndex,QModelIndex,QVector<int>)));
+    updateGroupOffsets();
 }
 
 FoilPicsModel::Private::~Private()
@@ -1938,15 +3571,15 @@ FoilPicsModel::Private::~Private()
     if (iSaveInfoTask) iSaveInfoTask->release(this);
     if (iGenerateKeyTask) iGenerateKeyTask->release(this);
     if (iDecryptPicsTask) iDecryptPicsTask->release(this);
-    int i;
-    for (i=0; i<iEncryptTasks.count(); i++) {
-        iEncryptTasks.at(i)->release(this);
-    }
-    iEncryptTasks.clear();
-    for (i=0; i<iImageRequestTasks.count(); i++) {
+    if (iCompactThumbsTask) iCompactThumbsTask->release(this);
+    if (iMigrateVaultTask) iMigrateVaultTask->release(this);
+    cancelEncryptTasks();
+    for (int i=0; i<iImageRequestTasks.count(); i++) {
         iImageRequestTasks.at(i)->release(this);
     }
     iImageRequestTasks.clear();
+    iReadThreadPool->waitForDone();
+    iThumbnailThreadPool->waitForDone();
     iThreadPool->waitForDone();
     qDeleteAll(iData);
     if (iImageProvider) {
@@ -1965,6 +3598,13 @@ size_t FoilPicsModel::Private::maxBytesToDecrypt()
     return 5*kbTotal;
 }
 
+int FoilPicsModel::Private::maxEncryptsInProgress()
+{
+    // Enough to keep every stage of the pipeline busy but not so many
+    // that we map half of the gallery into memory at once
+    return qMax(QThread::idealThreadCount(), 1) + 2;
+}
+
 inline FoilPicsModel* FoilPicsModel::Private::parentModel()
 {
     return qobject_cast<FoilPicsModel*>(parent());
@@ -2127,21 +3767,17 @@ void FoilPicsModel::Private::setFoilState(FoilState aState)
     }
 }
 
-int FoilPicsModel::Private::compare(const ModelData* aData1, const ModelData* aData2) const
+int FoilPicsModel::Private::compare(const ModelData* aData1, const ModelData* aData2)
 {
-    if (aData1->iGroupId != aData2->iGroupId) {
-        // Different groups
-        return iGroupModel->indexOfGroup(aData1->iGroupId) -
-            iGroupModel->indexOfGroup(aData2->iGroupId);
-    }
+    return compare(aData1->iSortKey, aData1, aData2->iSortKey, aData2);
+}
 
-    // Most recent first (within the group)
-    const qint64 msec1 = aData1->iSortTime.toMSecsSinceEpoch();
-    const qint64 msec2 = aData2->iSortTime.toMSecsSinceEpoch();
-    if (msec1 > msec2) {
-        return -1;
-    } else if (msec1 < msec2) {
-        return 1;
+int FoilPicsModel::Private::compare(quint64 aKey1, const ModelData* aData1,
+    quint64 aKey2, const ModelData* aData2)
+{
+    // Group and time are packed into the sort key
+    if (aKey1 != aKey2) {
+        return (aKey1 < aKey2) ? -1 : 1;
     }
 
     // Finally compare the original file name. If those match too,
@@ -2150,6 +3786,87 @@ int FoilPicsModel::Private::compare(const ModelData* aData1, const ModelData* aD
     return res ? res : aData1->iImageId.compare(aData2->iImageId);
 }
 
+int FoilPicsModel::Private::rowOf(const ModelData* aData,
+    quint64 aSortKey) const
+{
+    // The list is sorted, with aData placed according to aSortKey
+    // which may differ from its current sort key
+    int lo = 0, hi = iData.count();
+    while (lo < hi) {
+        const int mid = (lo + hi)/2;
+        const ModelData* data = iData.at(mid);
+        if (data == aData) {
+            return mid;
+        } else if (compare(data->iSortKey, data, aSortKey, aData) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    HWARN("Model is out of order");
+    return iData.indexOf((ModelData*)aData);
+}
+
+void FoilPicsModel::Private::updateSortKey(ModelData* aData) const
+{
+    aData->setGroupIndex(iGroupModel->indexOfGroup(aData->iGroupId));
+}
+
+void FoilPicsModel::Private::updateSortKeys()
+{
+    // Called when the order of groups changes
+    const int n = iData.count();
+    for (int i = 0; i < n; i++) {
+        updateSortKey(iData.at(i));
+    }
+    // Group offsets get updated when the model gets sorted
+}
+
+void FoilPicsModel::Private::updateGroupOffsets()
+{
+    // Must be called when the rows are where the sort keys say they
+    // are, i.e. after the model has been sorted
+    const int groups = iGroupModel->rowCount();
+    const int n = iData.count();
+    iGroupOffsets.fill(0, groups + 1);
+    for (int i = 0; i < n; i++) {
+        const int group = iData.at(i)->groupIndex();
+        if (group < groups) {
+            iGroupOffsets[group + 1]++;
+        }
+    }
+    for (int k = 1; k <= groups; k++) {
+        iGroupOffsets[k] += iGroupOffsets.at(k - 1);
+    }
+}
+
+void FoilPicsModel::Private::addToGroup(int aGroupIndex, int aDelta)
+{
+    // Shifts the groups following this one
+    const int n = iGroupOffsets.count();
+    HASSERT(aGroupIndex + 1 < n);
+    for (int k = aGroupIndex + 1; k < n; k++) {
+        iGroupOffsets[k] += aDelta;
+    }
+}
+
+void FoilPicsModel::Private::RowCounter::add(int aPos, int aDelta)
+{
+    const int n = iTree.count();
+    for (int i = aPos + 1; i < n; i += (i & -i)) {
+        iTree[i] += aDelta;
+    }
+}
+
+int FoilPicsModel::Private::RowCounter::countUpTo(int aPos) const
+{
+    int count = 0;
+    for (int i = aPos + 1; i > 0; i -= (i & -i)) {
+        count += iTree.at(i);
+    }
+    return count;
+}
+
 int FoilPicsModel::Private::sortProc(const void* aPtr1, const void* aPtr2,
     void* aThis)
 {
@@ -2158,7 +3875,17 @@ int FoilPicsModel::Private::sortProc(const void* aPtr1, const void* aPtr2,
     return ((Private*)aThis)->compare(*aDataPtr1, *aDataPtr2);
 }
 
-void FoilPicsModel::Private::insertModelData(ModelData* aData)
+QString FoilPicsModel::Private::thumbPrefix() const
+{
+    return iThumbnailProvider ? iThumbnailProvider->prefix() : QString();
+}
+
+QString FoilPicsModel::Private::imagePrefix() const
+{
+    return iImageProvider ? iImageProvider->prefix() : QString();
+}
+
+int FoilPicsModel::Private::insertModelData(ModelData* aData)
 {
     FoilPicsModel* model = parentModel();
 
@@ -2168,23 +3895,28 @@ void FoilPicsModel::Private::insertModelData(ModelData* aData)
         iThumbnailProvider = FoilPicsThumbnailProvider::createForObject(model);
     }
     if (iThumbnailProvider) {
-        aData->iThumbSource = iThumbnailProvider->addThumbnail(aData->iImageId,
-            aData->iThumbnail);
-        aData->updateVariant(ModelData::ThumbnailRole);
+        iThumbnailProvider->addThumbnail(aData->iImageId, aData->iThumbnail);
     }
+    // The provider holds the only copy from now on
+    aData->iThumbnail = QImage();
     if (!iImageProvider) {
         iImageProvider = FoilPicsImageProvider::createForObject(model);
     }
     if (iImageProvider) {
-        aData->iImageSource = iImageProvider->addImage(aData->iImageId,
-            aData->iPath);
-        aData->updateVariant(ModelData::UrlRole);
+        iImageProvider->addImage(aData->iImageId, aData->iPath);
+    }
+
+    // Remember the digest so that we don't encrypt the same thing twice
+    if (!aData->iImageId.isEmpty()) {
+        iDigests[aData->digestKey()]++;
     }
 
     // Make sure that group id is valid
     if (!iGroupModel->isKnownGroup(aData->iGroupId)) {
         aData->iGroupId = QByteArray(); // Default group
     }
+    updateSortKey(aData);
+    addToGroup(aData->groupIndex(), 1);
 
     // Insert the data into the model
     ModelData::ConstIterator it = qLowerBound(iData.begin(), iData.end(),
@@ -2192,8 +3924,7 @@ void FoilPicsModel::Private::insertModelData(ModelData* aData)
     const int pos = it - iData.begin();
     model->beginInsertRows(QModelIndex(), pos, pos);
     iData.insert(pos, aData);
-    HDEBUG(iData.count() << aData->iSortTime.
-        toString(Qt::SystemLocaleShortDate) << "at" << pos);    
+    HDEBUG(iData.count() << aData->iFileName << "at" << pos);    
 
     // And this tells the app that we better not generate a new key:
     if (!iMayHaveEncryptedPictures) {
@@ -2202,6 +3933,7 @@ void FoilPicsModel::Private::insertModelData(ModelData* aData)
     }
     model->endInsertRows();
     queueSignal(SignalCountChanged);
+    return pos;
 }
 
 void FoilPicsModel::Private::destroyItemAt(int aIndex)
@@ -2213,8 +3945,17 @@ void FoilPicsModel::Private::destroyItemAt(int aIndex)
         // Providers must have been created by insertModelData
         iThumbnailProvider->releaseThumbnail(data->iImageId);
         iImageProvider->releaseImage(data->iImageId);
+        if (!data->iImageId.isEmpty()) {
+            const QString key(data->digestKey());
+            if (--iDigests[key] <= 0) {
+                iDigests.remove(key);
+            }
+        }
         model->beginRemoveRows(QModelIndex(), aIndex, aIndex);
         iData.removeAt(aIndex);
+        iChangedRoles.remove(data);
+        addToGroup(data->groupIndex(), -1);
+        journalRemove(data);
         delete data;
         // We no longer have any decryptable pictures:
         if (iMayHaveEncryptedPictures) {
@@ -2232,8 +3973,10 @@ bool FoilPicsModel::Private::destroyItemAndRemoveFilesAt(int aIndex)
     if (data) {
         QString path(data->iPath);
         QString thumbPath;
-        if (!data->iThumbFile.isEmpty()) {
-            thumbPath = (QFileInfo(path).dir().filePath(data->iThumbFile));
+        if (!data->iThumbFile.isEmpty() &&
+            !FoilPicsSegmentStore::isRef(data->iThumbFile)) {
+            thumbPath = FoilPicsVaultLayout::siblingPath(path,
+                data->iThumbFile);
             HDEBUG("Removing" << qPrintable(thumbPath));
         }
         destroyItemAt(aIndex);
@@ -2292,6 +4035,10 @@ void FoilPicsModel::Private::clearModel()
         model->beginRemoveRows(QModelIndex(), 0, n-1);
         qDeleteAll(iData);
         iData.clear();
+        iDigests.clear();
+        iStrings = ModelData::Strings::Ptr(new ModelData::Strings);
+        iChangedRoles.clear();
+        updateGroupOffsets();
         // We no longer have any decryptable pictures:
         if (iMayHaveEncryptedPictures) {
             iMayHaveEncryptedPictures = false;
@@ -2302,41 +4049,138 @@ void FoilPicsModel::Private::clearModel()
     }
 }
 
-void FoilPicsModel::Private::onCheckPicsTaskDone()
+void FoilPicsModel::Private::onCheckPicsTaskDone()
+{
+    HDEBUG("Done");
+    if (sender() == iCheckPicsTask) {
+        const bool mayHave = iCheckPicsTask->iMayHaveEncryptedPictures;
+        if (iMayHaveEncryptedPictures != mayHave) {
+            iMayHaveEncryptedPictures = mayHave;
+            queueSignal(SignalMayHaveEncryptedPicturesChanged);
+        }
+        iCheckPicsTask->release(this);
+        iCheckPicsTask = NULL;
+        if (!busy()) {
+            // We know we were busy when we received this signal
+            queueSignal(SignalBusyChanged);
+        }
+        emitQueuedSignals();
+    }
+}
+
+void FoilPicsModel::Private::onGroupModelChanged()
+{
+    // Group indices may have changed
+    updateSortKeys();
+    if (!iIgnoreGroupModelChange) {
+        journalGroups();
+        sortModel();
+        saveInfo();
+    }
+}
+
+void FoilPicsModel::Private::onGroupModelDataChanged(const QModelIndex&,
+    const QModelIndex&, const QVector<int>& aRoles)
+{
+    // Picture counts and such don't need to be saved, only the names
+    if (!iIgnoreGroupModelChange && (aRoles.isEmpty() ||
+        aRoles.contains(FoilPicsGroupModel::groupNameRole()))) {
+        journalGroups();
+        saveInfo();
+    }
+}
+
+QString FoilPicsModel::Private::catalogName(const ModelData* aData)
+{
+    return QFileInfo(aData->iPath).fileName();
+}
+
+void FoilPicsModel::Private::journalInsert(int aRow)
+{
+    // Everything the catalog knows about the new entry
+    const ModelData* data = iData.at(aRow);
+    journalPlace(aRow);
+    if (!data->iThumbFile.isEmpty()) {
+        journalSet(ModelInfo::Ops::OpThumb, data, data->iThumbFile);
+    }
+    if (!data->iImageId.isEmpty()) {
+        journalSet(ModelInfo::Ops::OpDigest, data, data->digestKey());
+    }
+    journalSet(ModelInfo::Ops::OpTitle, data, data->iTitle);
+    journalSet(ModelInfo::Ops::OpGroupId, data,
+        QString::fromLatin1(data->iGroupId));
+}
+
+void FoilPicsModel::Private::journalPlace(int aRow)
+{
+    // Called after the row has been moved (or inserted) there
+    if (!iSnapshotNeeded) {
+        iJournalOps.place(catalogName(iData.at(aRow)), aRow ?
+            catalogName(iData.at(aRow - 1)) : QString());
+        journalChanged();
+    }
+}
+
+void FoilPicsModel::Private::journalRemove(const ModelData* aData)
 {
-    HDEBUG("Done");
-    if (sender() == iCheckPicsTask) {
-        const bool mayHave = iCheckPicsTask->iMayHaveEncryptedPictures;
-        if (iMayHaveEncryptedPictures != mayHave) {
-            iMayHaveEncryptedPictures = mayHave;
-            queueSignal(SignalMayHaveEncryptedPicturesChanged);
-        }
-        iCheckPicsTask->release(this);
-        iCheckPicsTask = NULL;
-        if (!busy()) {
-            // We know we were busy when we received this signal
-            queueSignal(SignalBusyChanged);
-        }
-        emitQueuedSignals();
+    if (!iSnapshotNeeded) {
+        iJournalOps.remove(catalogName(aData));
+        journalChanged();
     }
 }
 
-void FoilPicsModel::Private::onGroupModelChanged()
+void FoilPicsModel::Private::journalSet(ModelInfo::Ops::Op aOp,
+    const ModelData* aData, QString aValue)
 {
-    if (!iIgnoreGroupModelChange) {
-        sortModel();
-        saveInfo();
+    if (!iSnapshotNeeded) {
+        iJournalOps.set(aOp, catalogName(aData), aValue);
+        journalChanged();
+    }
+}
+
+void FoilPicsModel::Private::journalGroups()
+{
+    if (!iSnapshotNeeded) {
+        iJournalOps.setGroups(iGroupModel->groups());
+        journalChanged();
+    }
+}
+
+void FoilPicsModel::Private::journalChanged()
+{
+    // Past a certain point it's cheaper to write the whole thing
+    if (iJournalOps.count() > qMax(JOURNAL_MIN_OPS, iData.count() / 4)) {
+        HDEBUG(iJournalOps.count() << "changes, time for a snapshot");
+        iSnapshotNeeded = true;
+        iJournalOps.clear();
     }
 }
 
+void FoilPicsModel::Private::resetJournal()
+{
+    // Whatever hasn't been saved by now is gone
+    iJournalOps.clear();
+    iSnapshotNeeded = false;
+}
+
 void FoilPicsModel::Private::saveInfo()
 {
     // N.B. This method may change the busy state but doesn't queue
     // BusyChanged signal, it's done by the caller.
+    //
+    // Normally only the changes made since the last save get passed
+    // to the task. The full catalog is only put together when it's
+    // time to write the snapshot.
     if (iSaveInfoTask) iSaveInfoTask->release(this);
-    iSaveInfoTask = new SaveInfoTask(iThreadPool,
-        ModelInfo(iData, iGroupModel->groups()),
-        iFoilPicsDir, iPrivateKey, iPublicKey);
+    if (iSnapshotNeeded) {
+        iSaveInfoTask = new SaveInfoTask(iThreadPool,
+            ModelInfo(iData, iGroupModel->groups()),
+            iFoilPicsDir, iCatalog, iPrivateKey, iPublicKey);
+    } else {
+        iSaveInfoTask = new SaveInfoTask(iThreadPool, iJournalOps,
+            iFoilPicsDir, iCatalog, iPrivateKey, iPublicKey);
+    }
+    resetJournal();
     iSaveInfoTask->submit(this, SLOT(onSaveInfoDone()));
 }
 
@@ -2344,8 +4188,14 @@ void FoilPicsModel::Private::onSaveInfoDone()
 {
     HDEBUG("Done");
     if (sender() == iSaveInfoTask) {
+        const bool snapshot = iSaveInfoTask->iSnapshotNeeded;
         iSaveInfoTask->release(this);
         iSaveInfoTask = NULL;
+        if (snapshot) {
+            // The journal couldn't take the changes
+            iSnapshotNeeded = true;
+            saveInfo();
+        }
         if (!busy()) {
             // We know we were busy when we received this signal
             queueSignal(SignalBusyChanged);
@@ -2398,18 +4248,24 @@ void FoilPicsModel::Private::lock(bool aTimeout)
         iSaveInfoTask->release(this);
         iSaveInfoTask = NULL;
     }
+    resetJournal();
     if (iDecryptPicsTask) {
         iDecryptPicsTask->release(this);
         iDecryptPicsTask = NULL;
     }
-    int i;
-    for (i=0; i<iEncryptTasks.count(); i++) {
-        iEncryptTasks.at(i)->release(this);
+    if (iCompactThumbsTask) {
+        iCompactThumbsTask->release(this);
+        iCompactThumbsTask = NULL;
     }
-    for (i=0; i<iImageRequestTasks.count(); i++) {
+    if (iMigrateVaultTask) {
+        iMigrateVaultTask->release(this);
+        iMigrateVaultTask = NULL;
+    }
+    iMigratePending.clear();
+    cancelEncryptTasks();
+    for (int i=0; i<iImageRequestTasks.count(); i++) {
         iImageRequestTasks.at(i)->release(this);
     }
-    iEncryptTasks.clear();
     iImageRequestTasks.clear();
     // Destroy decrypted pictures
     if (!iData.isEmpty()) {
@@ -2417,6 +4273,10 @@ void FoilPicsModel::Private::lock(bool aTimeout)
         model->beginRemoveRows(QModelIndex(), 0, iData.count()-1);
         qDeleteAll(iData);
         iData.clear();
+        iDigests.clear();
+        iStrings = ModelData::Strings::Ptr(new ModelData::Strings);
+        iChangedRoles.clear();
+        updateGroupOffsets();
         model->endRemoveRows();
         queueSignal(SignalCountChanged);
     }
@@ -2463,12 +4323,21 @@ bool FoilPicsModel::Private::unlock(QString aPassword)
                 if (iDecryptPicsTask) iDecryptPicsTask->release(this);
                 iDecryptPicsTask = new DecryptPicsTask(iThreadPool,
                     iFoilPicsDir, iPrivateKey, iPublicKey, iThumbSize);
+                // Tasks still holding the old state keep it to themselves
+                iCatalog = CatalogState::Ptr(new CatalogState);
+                iDecryptPicsTask->iCatalog = iCatalog;
+                resetJournal();
+                setupThumbFormat(iDecryptPicsTask);
                 clearModel();
                 clearGroupModel();
                 connect(iDecryptPicsTask,
                     SIGNAL(groupsDecrypted(FoilPicsGroupModel::GroupList)),
                     SLOT(onGroupsDecrypted(FoilPicsGroupModel::GroupList)),
                     Qt::QueuedConnection);
+                connect(iDecryptPicsTask,
+                    SIGNAL(filesMissing(QStringList)),
+                    SLOT(onFilesMissing(QStringList)),
+                    Qt::QueuedConnection);
                 connect(iDecryptPicsTask,
                     SIGNAL(progress(DecryptPicsTask::Progress::Ptr)),
                     SLOT(onDecryptPicsProgress(DecryptPicsTask::Progress::Ptr)),
@@ -2507,10 +4376,200 @@ void FoilPicsModel::Private::encryptFile(QString aFile, QVariantMap aMetaData)
         aMetaData.remove(MetaLongitude);
         aMetaData.remove(MetaAltitude);
     }
-    EncryptTask* task = new EncryptTask(iThreadPool, aFile, iFoilPicsDir,
-        iPrivateKey, iPublicKey, iThumbSize, aMetaData);
-    iEncryptTasks.append(task);
-    task->submit(this, SLOT(onEncryptTaskDone()));
+    iEncryptQueue.append(EncryptFile::Ptr(new EncryptFile(aFile, aMetaData)));
+    submitEncryptTasks();
+}
+
+void FoilPicsModel::Private::submitEncryptTasks()
+{
+    // Don't let the reader run too far ahead of the encryptor
+    while (!iEncryptQueue.isEmpty() && (iReadFileTasks.count() +
+        iThumbnailTasks.count() + iEncryptTasks.count()) <
+        iMaxEncryptsInProgress) {
+        ReadFileTask* task = new ReadFileTask(iReadThreadPool,
+            iEncryptQueue.takeFirst());
+        iReadFileTasks.append(task);
+        task->submit(this, SLOT(onReadFileTaskDone()));
+    }
+}
+
+void FoilPicsModel::Private::cancelEncryptTasks()
+{
+    int i;
+    for (i=0; i<iReadFileTasks.count(); i++) {
+        iReadFileTasks.at(i)->release(this);
+    }
+    for (i=0; i<iThumbnailTasks.count(); i++) {
+        iThumbnailTasks.at(i)->release(this);
+    }
+    for (i=0; i<iEncryptTasks.count(); i++) {
+        iEncryptTasks.at(i)->release(this);
+    }
+    iEncryptQueue.clear();
+    iReadFileTasks.clear();
+    iThumbnailTasks.clear();
+    iEncryptTasks.clear();
+    iDuplicatesSkipped = 0;
+    iDuplicateBytesSkipped = 0;
+}
+
+void FoilPicsModel::Private::setupThumbFormat(BaseTask* aTask) const
+{
+    aTask->iThumbFormat = BaseTask::thumbFormat(iThumbFormatConf->value().
+        toString());
+    aTask->iThumbQuality = qBound(-1, iThumbQualityConf->value(-1).toInt(),
+        100);
+    aTask->iThumbSegments = (iThumbStoreConf->value().toString() ==
+        QLatin1String(THUMB_STORE_SEGMENTS));
+    aTask->iSharded = shardedLayout();
+    aTask->iSeparateHeaders = iSeparateHeadersConf->value(false).toBool();
+    aTask->iCoverLevelSize = iCoverSize;
+    aTask->iStrings = iStrings;
+}
+
+bool FoilPicsModel::Private::shardedLayout() const
+{
+    return iVaultLayoutConf->value().toString() ==
+        QLatin1String(VAULT_LAYOUT_SHARDED);
+}
+
+void FoilPicsModel::Private::compactThumbs()
+{
+    // Not while new thumbnails may be on their way to the model
+    if (!iCompactThumbsTask && !encrypting()) {
+        QStringList refs;
+        const int n = iData.count();
+        for (int i = 0; i < n; i++) {
+            const QString thumb(iData.at(i)->iThumbFile);
+            if (FoilPicsSegmentStore::isRef(thumb)) {
+                refs.append(thumb);
+            }
+        }
+        iCompactThumbsTask = new CompactThumbsTask(iThreadPool,
+            iFoilPicsDir, refs, iCatalog);
+        iCompactThumbsTask->submit(this, SLOT(onCompactThumbsTaskDone()));
+    }
+}
+
+void FoilPicsModel::Private::migrateVault(QStringList aPending)
+{
+    // Not while new files may be appearing in the vault
+    if (!iMigrateVaultTask && !iDecryptPicsTask && !encrypting()) {
+        // Leave alone the files being decrypted
+        QSet<QString> busyPaths;
+        const int n = iData.count();
+        for (int i = 0; i < n; i++) {
+            const ModelData* data = iData.at(i);
+            if (data->iDecryptTask) {
+                busyPaths.insert(data->iPath);
+            }
+        }
+        iMigrateVaultTask = new MigrateVaultTask(iThreadPool, iFoilPicsDir,
+            shardedLayout(), busyPaths, aPending);
+        iMigratePending.clear();
+        iMigrateVaultTask->submit(this, SLOT(onMigrateVaultTaskDone()));
+    }
+}
+
+void FoilPicsModel::Private::onMigrateVaultTaskDone()
+{
+    if (sender() == iMigrateVaultTask) {
+        const QHash<QString,QString> moved(iMigrateVaultTask->iMoved);
+        const QStringList pending(iMigrateVaultTask->iPending);
+        const bool more = iMigrateVaultTask->iMore;
+        const bool sharded = iMigrateVaultTask->iSharded;
+        iMigrateVaultTask->release(this);
+        iMigrateVaultTask = NULL;
+        if (!moved.isEmpty()) {
+            // The catalog only has the names, nothing to save
+            const int n = iData.count();
+            for (int i = 0; i < n; i++) {
+                ModelData* data = iData.at(i);
+                if (moved.contains(data->iPath)) {
+                    data->iPath = moved.value(data->iPath);
+                    if (iImageProvider) {
+                        // Same image source, new path
+                        iImageProvider->addImage(data->iImageId,
+                            data->iPath);
+                    }
+                }
+            }
+        }
+        if (sharded != shardedLayout()) {
+            // The layout has changed in the meantime, start over
+            migrateVault();
+        } else if (more) {
+            migrateVault(pending);
+        } else {
+            // Whatever is left is busy, try again when it's not
+            iMigratePending = pending;
+        }
+    }
+}
+
+void FoilPicsModel::Private::onVaultLayoutChanged()
+{
+    HDEBUG(iVaultLayoutConf->value().toString());
+    if (iFoilState == FoilPicsReady) {
+        migrateVault();
+    }
+}
+
+void FoilPicsModel::Private::onCompactThumbsTaskDone()
+{
+    if (sender() == iCompactThumbsTask) {
+        const FoilPicsSegmentStore::Remap remap(iCompactThumbsTask->iRemap);
+        iCompactThumbsTask->release(this);
+        iCompactThumbsTask = NULL;
+        if (!remap.isEmpty()) {
+            HDEBUG(remap.count() << "thumbnail(s) moved");
+            const int n = iData.count();
+            for (int i = 0; i < n; i++) {
+                ModelData* data = iData.at(i);
+                if (remap.contains(data->iThumbFile)) {
+                    data->iThumbFile = remap.value(data->iThumbFile);
+                    journalSet(ModelInfo::Ops::OpThumb, data,
+                        data->iThumbFile);
+                }
+            }
+            // The old segments get deleted once the catalog no longer
+            // refers to them
+            const bool wasBusy = busy();
+            saveInfo();
+            if (wasBusy != busy()) {
+                queueSignal(SignalBusyChanged);
+            }
+        }
+    }
+    emitQueuedSignals();
+}
+
+bool FoilPicsModel::Private::encrypting() const
+{
+    return !iEncryptQueue.isEmpty() ||
+        !iReadFileTasks.isEmpty() ||
+        !iThumbnailTasks.isEmpty() ||
+        !iEncryptTasks.isEmpty();
+}
+
+void FoilPicsModel::Private::finishEncryptBatch()
+{
+    if (!encrypting() && iDuplicatesSkipped) {
+        const int count = iDuplicatesSkipped;
+        const qlonglong bytes = iDuplicateBytesSkipped;
+        HDEBUG("Skipped" << count << "duplicate(s)," << bytes << "bytes");
+        iDuplicatesSkipped = 0;
+        iDuplicateBytesSkipped = 0;
+        Q_EMIT parentModel()->duplicatesSkipped(count, bytes);
+    }
+}
+
+bool FoilPicsModel::Private::isKnownDigest(QString aDigestKey) const
+{
+    // Only pictures that have been decrypted and verified count, the
+    // catalog is just a hint. MD5 ids written by older versions never
+    // match the SHA-256 ones.
+    return iDigests.contains(aDigestKey);
 }
 
 bool FoilPicsModel::Private::encrypt(QUrl aUrl, QVariantMap aMetaData)
@@ -2577,18 +4636,79 @@ void FoilPicsModel::Private::encryptFiles(QAbstractItemModel* aModel, QList<int>
     }
 }
 
+void FoilPicsModel::Private::onReadFileTaskDone()
+{
+    ReadFileTask* task = qobject_cast<ReadFileTask*>(sender());
+    HVERIFY(iReadFileTasks.removeAll(task));
+    EncryptFile::Ptr file(task->iFile);
+    if (file->iMap && iPrivateKey && !file->iImageId.isEmpty() &&
+        isKnownDigest(ModelData::digestKey(QString::fromLatin1
+        (file->iImageId), file->length()))) {
+        // No need to decode and encrypt it again. The original stays
+        // where it is, it's up to the user to delete it.
+        HDEBUG(qPrintable(file->iSourceFile) << "is already encrypted");
+        iDuplicatesSkipped++;
+        iDuplicateBytesSkipped += file->length();
+        submitEncryptTasks();
+        finishEncryptBatch();
+    } else if (file->iMap) {
+        ThumbnailTask* next = new ThumbnailTask(iThumbnailThreadPool,
+            file, iThumbSize, iCoverSize);
+        iThumbnailTasks.append(next);
+        next->submit(this, SLOT(onThumbnailTaskDone()));
+    } else {
+        // Failed to read the file, let the gallery know anyway
+        FoilPicsFileUtil::instance()->mediaDeleted(file->iSourceFile);
+        submitEncryptTasks();
+        finishEncryptBatch();
+    }
+    task->release(this);
+    if (!busy()) {
+        // We know we were busy when we received this signal
+        queueSignal(SignalBusyChanged);
+    }
+    emitQueuedSignals();
+}
+
+void FoilPicsModel::Private::onThumbnailTaskDone()
+{
+    ThumbnailTask* task = qobject_cast<ThumbnailTask*>(sender());
+    HVERIFY(iThumbnailTasks.removeAll(task));
+    if (!task->iFile->iThumb.isNull() && iPrivateKey) {
+        EncryptTask* next = new EncryptTask(iThreadPool, task->iFile,
+            iFoilPicsDir, iPrivateKey, iPublicKey);
+        setupThumbFormat(next);
+        iEncryptTasks.append(next);
+        next->submit(this, SLOT(onEncryptTaskDone()));
+    } else {
+        HWARN("Not an image" << qPrintable(task->iFile->iSourceFile));
+        FoilPicsFileUtil::instance()->mediaDeleted(task->iFile->iSourceFile);
+        submitEncryptTasks();
+        finishEncryptBatch();
+    }
+    task->release(this);
+    if (!busy()) {
+        // We know we were busy when we received this signal
+        queueSignal(SignalBusyChanged);
+    }
+    emitQueuedSignals();
+}
+
 void FoilPicsModel::Private::onEncryptTaskDone()
 {
     EncryptTask* task = qobject_cast<EncryptTask*>(sender());
     HVERIFY(iEncryptTasks.removeAll(task));
-    HDEBUG("Encrypted" << qPrintable(task->iSourceFile));
+    const QString sourceFile(task->iFile->iSourceFile);
+    HDEBUG("Encrypted" << qPrintable(sourceFile));
     if (task->iData) {
-        insertModelData(task->iData);
+        journalInsert(insertModelData(task->iData));
         task->iData = NULL;
         saveInfo();
     }
-    FoilPicsFileUtil::instance()->mediaDeleted(task->iSourceFile);
+    FoilPicsFileUtil::instance()->mediaDeleted(sourceFile);
     task->release(this);
+    submitEncryptTasks();
+    finishEncryptBatch();
     if (!busy()) {
         // We know we were busy when we received this signal
         queueSignal(SignalBusyChanged);
@@ -2624,6 +4744,10 @@ void FoilPicsModel::Private::decryptTaskDone(DecryptTask* aTask, bool aLast)
         destroyItemAt(iData.indexOf(data));
         if (aLast) {
             saveInfo();
+            if (!iMigratePending.isEmpty()) {
+                // The files that were being decrypted can be moved now
+                migrateVault(iMigratePending);
+            }
         }
         if (!busy()) {
             // We know we were busy when we received this signal
@@ -2708,6 +4832,7 @@ void FoilPicsModel::Private::onGroupsDecrypted(FoilPicsGroupModel::GroupList aGr
     iIgnoreGroupModelChange = true;
     iGroupModel->setGroups(aGroups);
     iIgnoreGroupModelChange = false;
+    sortModel();
 }
 
 void FoilPicsModel::Private::onDecryptPicsProgress(DecryptPicsTask::Progress::Ptr aProgress)
@@ -2720,16 +4845,39 @@ void FoilPicsModel::Private::onDecryptPicsProgress(DecryptPicsTask::Progress::Pt
     emitQueuedSignals();
 }
 
+void FoilPicsModel::Private::onFilesMissing(QStringList aPaths)
+{
+    // The catalog listed these but they are gone, drop whatever
+    // has been loaded from their thumbnails
+    if (sender() == iDecryptPicsTask) {
+        const QSet<QString> paths(aPaths.toSet());
+        for (int i = iData.count() - 1; i >= 0; i--) {
+            if (paths.contains(iData.at(i)->iPath)) {
+                HDEBUG(qPrintable(iData.at(i)->iPath) << "is missing");
+                destroyItemAt(i);
+            }
+        }
+        emitQueuedSignals();
+    }
+}
+
 void FoilPicsModel::Private::onDecryptPicsTaskDone()
 {
     HDEBUG(iData.count() << "picture(s) decrypted");
     if (sender() == iDecryptPicsTask) {
-        if (iDecryptPicsTask->iSaveInfo) saveInfo();
+        if (iDecryptPicsTask->iSaveInfo) {
+            // The pictures loaded from the vault aren't journaled, the
+            // catalog has to be rewritten if it doesn't match them
+            iSnapshotNeeded = true;
+            saveInfo();
+        }
         iDecryptPicsTask->release(this);
         iDecryptPicsTask = NULL;
         if (iFoilState == FoilDecrypting) {
             setFoilState(FoilPicsReady);
         }
+        compactThumbs();
+        migrateVault();
         if (!busy()) {
             // We know we were busy when we received this signal
             queueSignal(SignalBusyChanged);
@@ -2742,22 +4890,17 @@ void FoilPicsModel::Private::setTitleAt(int aIndex, QString aTitle)
 {
     ModelData* data = dataAt(aIndex);
     if (data) {
-        QString title(aTitle.isEmpty() ? data->iDefaultTitle : aTitle);
+        const QString title(aTitle == data->defaultTitle() ?
+            QString() : aTitle);
         if (data->iTitle != title) {
             data->iTitle = title;
-            data->updateVariant(ModelData::TitleRole);
-            dataChanged(aIndex, ModelData::TitleRole);
+            dataChanged(data, ModelData::TitleRole);
+            journalSet(ModelInfo::Ops::OpTitle, data, title);
 
             HDEBUG("Settings title at" << aIndex << "to" << title);
             const bool wasBusy = busy();
-            if (data->iSetTitleTask) {
-                HDEBUG("Dropping previous task");
-                data->iSetTitleTask->release(this);
-                data->iSetTitleTask = NULL;
-            }
-            data->iSetTitleTask = SetHeaderTask::createTitleTask(iThreadPool,
-                iPrivateKey, iPublicKey, data);
-            data->iSetTitleTask->submit(this, SLOT(onSetTitleTaskDone()));
+            // The title is stored in the catalog
+            saveInfo();
             if (!wasBusy) {
                 // We know we are busy now
                 queueSignal(SignalBusyChanged);
@@ -2768,58 +4911,232 @@ void FoilPicsModel::Private::setTitleAt(int aIndex, QString aTitle)
 
 bool FoilPicsModel::Private::sortModel()
 {
-    FoilPicsModel* model = parentModel();
-    ModelData::List data = iData;
-    qSort(data.begin(), data.end(), LessThan(this));
-    if (data != iData) {
-        HDEBUG("list has changed");
-        model->beginResetModel();
-        iData = data;
-        model->endResetModel();
-        return true;
-    } else {
+    // Group views ignore the individual moves, they find out what
+    // has happened to their contents when it's all over. The group
+    // offsets only make sense once all the rows are in place.
+    iGroupModel->picsAboutToBeRearranged();
+    const QVector<int> rows(rearrange());
+    updateGroupOffsets();
+    iGroupModel->picsRearranged(rows);
+    return !rows.isEmpty();
+}
+
+QVector<int> FoilPicsModel::Private::rearrange()
+{
+    // Returns the new row for each of the old ones, empty if nothing
+    // has moved. Sort the keys in a contiguous array, the tiebreak
+    // comparison is only needed when the keys match
+    const int n = iData.count();
+    QVector<SortEntry> entries(n);
+    SortEntry* entry = entries.data();
+    for (int i = 0; i < n; i++, entry++) {
+        entry->data = iData.at(i);
+        entry->key = entry->data->iSortKey;
+        entry->row = i;
+    }
+    qSort(entries.begin(), entries.end());
+
+    QVector<int> target(n);
+    bool sorted = true;
+    for (int t = 0; t < n; t++) {
+        const int row = entries.at(t).row;
+        target[row] = t;
+        if (row != t) sorted = false;
+    }
+    if (sorted) {
         // The order didn't change
-        return false;
+        return QVector<int>();
+    }
+
+    // The rows forming the longest increasing subsequence of target
+    // positions stay where they are, the rest gets moved. That keeps
+    // the delegates alive and the number of moves minimal.
+    QVector<int> prev(n);
+    QVector<int> tails;
+    for (int i = 0; i < n; i++) {
+        const int pos = target.at(i);
+        int lo = 0, hi = tails.count();
+        while (lo < hi) {
+            const int mid = (lo + hi)/2;
+            if (target.at(tails.at(mid)) < pos) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        prev[i] = lo ? tails.at(lo - 1) : -1;
+        if (lo == tails.count()) {
+            tails.append(i);
+        } else {
+            tails[lo] = i;
+        }
+    }
+    QBitArray stays(n);
+    for (int i = tails.isEmpty() ? -1 : tails.last(); i >= 0; i = prev.at(i)) {
+        stays.setBit(target.at(i));
+    }
+
+    // Place each moving row right after its predecessor in the sorted
+    // order. The rows which have already been handled (and those which
+    // stay) are always in the right order relative to each other.
+    // Consecutive rows which are going to the same place are moved
+    // together.
+    //
+    // Current row numbers come from the counter where position 0 is
+    // the beginning of the list and position i + 1 is the original
+    // row i. A row is counted at its original position until it gets
+    // moved, and then at the position of the last row that stays in
+    // front of it. Moved rows end up after the rows which stay at the
+    // same position but in front of the rows which haven't been moved
+    // yet, so the row number is the number of rows counted at lower
+    // positions, which takes O(log n) to figure out.
+    FoilPicsModel* model = parentModel();
+    const QModelIndex parent;
+    RowCounter counter(n + 1);
+    int anchor = 0;
+    int moved = 0;
+    for (int i = 0; i < n; i++) {
+        counter.add(i + 1, 1);
+    }
+    for (int t = 0; t < n;) {
+        const int row = entries.at(t).row;
+        if (stays.testBit(t)) {
+            anchor = row + 1;
+            t++;
+        } else {
+            // Rows which haven't been moved yet and were next to each
+            // other are still next to each other
+            int k = 1;
+            while ((t + k) < n && !stays.testBit(t + k) &&
+                entries.at(t + k).row == (row + k)) {
+                k++;
+            }
+            const int from = counter.countUpTo(row);
+            for (int i = 0; i < k; i++) {
+                counter.add(row + i + 1, -1);
+            }
+            const int to = counter.countUpTo(anchor);
+            counter.add(anchor, k);
+            if (from != to) {
+                ModelData::List::iterator begin = iData.begin();
+                model->beginMoveRows(parent, from, from + k - 1, parent,
+                    (to > from) ? (to + k) : to);
+                if (to > from) {
+                    std::rotate(begin + from, begin + from + k,
+                        begin + to + k);
+                } else {
+                    std::rotate(begin + to, begin + from, begin + from + k);
+                }
+                model->endMoveRows();
+                for (int i = 0; i < k; i++) {
+                    journalPlace(to + i);
+                }
+                moved += k;
+            }
+            t += k;
+        }
     }
+    HDEBUG(moved << "row(s) moved");
+    return target;
 }
 
 bool FoilPicsModel::Private::setGroupId(ModelData* aData, QByteArray aId)
 {
+    // N.B. The caller is expected to regroup the item(s)
     if (aData->iGroupId != aId) {
+        // The caller is expected to save the catalog. The group offsets
+        // get updated after the rows are moved.
         aData->iGroupId = aId;
-        aData->updateVariant(ModelData::GroupIdRole);
-        // Update the encrypted file
-        if (aData->iSetGroupTask) {
-            aData->iSetGroupTask->release(this);
-            aData->iSetGroupTask = NULL;
-        }
-        aData->iSetGroupTask = SetHeaderTask::createGroupTask(iThreadPool,
-            iPrivateKey, iPublicKey, aData);
-        aData->iSetGroupTask->submit(this, SLOT(onSetGroupTaskDone()));
+        updateSortKey(aData);
+        journalSet(ModelInfo::Ops::OpGroupId, aData,
+            QString::fromLatin1(aId));
         return true;
     }
     return false;
 }
 
+void FoilPicsModel::Private::regroup(ModelData* aData, quint64 aPrevSortKey)
+{
+    // Called after changing the group of a single item. Everything
+    // else is sorted, so it takes at most one move, and both the
+    // current and the new position can be found by binary search.
+    // Group views follow the move. If the item stays where it is,
+    // they still need to check whether it has left (or joined) the
+    // group, right away rather than when dataChanged gets emitted.
+    FoilPicsModel* model = parentModel();
+    const int row = rowOf(aData, aPrevSortKey);
+    int lo = 0, hi = iData.count() - 1;
+    while (lo < hi) {
+        // Same as the lower bound with this row removed
+        const int mid = (lo + hi)/2;
+        if (compare(iData.at((mid < row) ? mid : (mid + 1)), aData) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const int pos = lo;
+    if (pos != row) {
+        const QModelIndex parent;
+        HDEBUG(row << "=>" << pos);
+        model->beginMoveRows(parent, row, row, parent,
+            (pos > row) ? (pos + 1) : pos);
+        iData.move(row, pos);
+        model->endMoveRows();
+        journalPlace(pos);
+        moveToGroup(aData, aPrevSortKey);
+    } else {
+        iGroupModel->picsAboutToBeRearranged();
+        moveToGroup(aData, aPrevSortKey);
+        iGroupModel->picsRearranged();
+    }
+    dataChanged(aData, ModelData::GroupIdRole);
+}
+
+void FoilPicsModel::Private::moveToGroup(ModelData* aData, quint64 aPrevSortKey)
+{
+    // Updates the group offsets after the item has been moved
+    const int prevGroup = ModelData::groupIndex(aPrevSortKey);
+    if (aData->groupIndex() != prevGroup) {
+        addToGroup(prevGroup, -1);
+        addToGroup(aData->groupIndex(), 1);
+    }
+}
+
+void FoilPicsModel::Private::regroup(const ModelData::List aChanged)
+{
+    // Called after changing the groups of several items at once.
+    // The moves are figured out in one go and the group changes
+    // are signaled together with the other data changes.
+    const int n = aChanged.count();
+    HDEBUG(n << "item(s) regrouped");
+    sortModel();
+    for (int i = 0; i < n; i++) {
+        dataChanged(aChanged.at(i), ModelData::GroupIdRole);
+    }
+}
+
 void FoilPicsModel::Private::clearGroup(QByteArray aId)
 {
     if (!aId.isEmpty()) {
-        const bool wasBusy = busy();
         const int n = iData.count();
-        QList<int> changedRows;
+        ModelData::List changed;
         for (int i = 0; i < n; i++) {
             ModelData* data = iData.at(i);
             if (data->iGroupId == aId) {
-                HDEBUG(i << QString::fromLatin1(aId));
-                setGroupId(data, QByteArray());
-                changedRows.append(i);
+                changed.append(data);
             }
         }
-        if (!changedRows.isEmpty()) {
-            if (!sortModel()) {
-                // The order hasn't changed => the model wasn't reset
-                dataChanged(changedRows, ModelData::ImageIdRole);
+        if (!changed.isEmpty()) {
+            const int k = changed.count();
+            const bool wasBusy = busy();
+            HDEBUG(k << QString::fromLatin1(aId));
+            for (int i = 0; i < k; i++) {
+                setGroupId(changed.at(i), QByteArray());
             }
+            regroup(changed);
+            // The whole batch goes into a single catalog update
+            saveInfo();
             if (!wasBusy) {
                 // We know we are busy now
                 queueSignal(SignalBusyChanged);
@@ -2835,12 +5152,11 @@ void FoilPicsModel::Private::setGroupIdAt(int aIndex, QByteArray aId)
     ModelData* data = dataAt(aIndex);
     if (data) {
         const bool wasBusy = busy();
+        const quint64 key = data->iSortKey;
         if (setGroupId(data, aId)) {
             HDEBUG(aIndex << QString::fromLatin1(aId));
-            if (!sortModel()) {
-                // The order hasn't changed => the model wasn't reset
-                dataChanged(aIndex, ModelData::ImageIdRole);
-            }
+            regroup(data, key);
+            saveInfo();
             if (!wasBusy) {
                 // We know we are busy now
                 queueSignal(SignalBusyChanged);
@@ -2852,22 +5168,30 @@ void FoilPicsModel::Private::setGroupIdAt(int aIndex, QByteArray aId)
 void FoilPicsModel::Private::setGroupIdForRows(QList<int> aRows, QByteArray aId)
 {
     if (!aRows.isEmpty()) {
-        const bool wasBusy = busy();
-        qSort(aRows);
-        QList<int> updatedRows;
+        // Rows are going to move, remember the items
+        ModelData::List items;
         const int n = aRows.count();
+        qSort(aRows);
         for (int i = 0; i < n; i++) {
-            const int row = aRows.at(i);
-            ModelData* data = dataAt(row);
-            if (setGroupId(data, aId)) {
-                updatedRows.append(row);
+            ModelData* data = dataAt(aRows.at(i));
+            if (data && (!i || aRows.at(i) != aRows.at(i - 1))) {
+                items.append(data);
             }
         }
-        if (!updatedRows.isEmpty()) {
-            if (!sortModel()) {
-                // The order hasn't changed => the model wasn't reset
-                dataChanged(updatedRows, ModelData::ImageIdRole);
+        const int k = items.count();
+        ModelData::List updated;
+        for (int i = 0; i < k; i++) {
+            ModelData* data = items.at(i);
+            if (setGroupId(data, aId)) {
+                updated.append(data);
             }
+        }
+        if (!updated.isEmpty()) {
+            const bool wasBusy = busy();
+            HDEBUG(updated.count() << QString::fromLatin1(aId));
+            regroup(updated);
+            // The whole batch goes into a single catalog update
+            saveInfo();
             if (!wasBusy) {
                 // We know we are busy now
                 queueSignal(SignalBusyChanged);
@@ -2876,74 +5200,62 @@ void FoilPicsModel::Private::setGroupIdForRows(QList<int> aRows, QByteArray aId)
     }
 }
 
-void FoilPicsModel::Private::headerUpdateDone(SetHeaderTask* task)
+void FoilPicsModel::Private::dataChanged(ModelData* aData, ModelData::Role aRole)
 {
-    // task->iData must be valid because if ModelData were deleted
-    // it would cancel the task in the destructor and we wouldn't
-    // receive this signal
-    ModelData* data = task->iData;
-    task->iData = NULL;
-
-    if (task->iOk) {
-        data->iThumbFile = task->iNewThumbFile;
-        data->iPath = task->iNewPath;
-
-        // Image path changed but source URL didn't because it's derived
-        // from the hash of the original file. Just update the path.
-        iImageProvider->addImage(data->iImageId, data->iPath);
-
-        // The file size may have changed
-        const int size = QFileInfo(data->iPath).size();
-        if (data->iEncryptedSize != size) {
-            HDEBUG("Encrypted size" << data->iEncryptedSize << "->" << size);
-            data->iEncryptedSize = size;
-            data->updateVariant(ModelData::EncryptedFileSizeRole);
-            dataChanged(iData.indexOf(data), ModelData::EncryptedFileSizeRole);
-        }
+    // Changes are collected and emitted on the next event loop turn
+    HASSERT(aRole > ModelData::FirstRole && aRole < ModelData::LastRole);
+    iChangedRoles[aData] |= (1u << (aRole - ModelData::FirstRole));
+    if (!iFlushDataChangedQueued) {
+        iFlushDataChangedQueued = true;
+        QMetaObject::invokeMethod(this, "flushDataChanged",
+            Qt::QueuedConnection);
     }
-
-    // There's no need to queue BusyChanged because we were busy when we
-    // received this signal and we are still going to be busy after we
-    // call saveInfo()
-    task->release(this);
-    emitQueuedSignals();
-    saveInfo();
-}
-
-void FoilPicsModel::Private::onSetTitleTaskDone()
-{
-    // task->iData must be valid, see comment in headerUpdateDone
-    SetHeaderTask* task = qobject_cast<SetHeaderTask*>(sender());
-    HDEBUG(QString::fromUtf8(task->iHeaderValue));
-    task->iData->iSetTitleTask = NULL;
-    headerUpdateDone(task);
 }
 
-void FoilPicsModel::Private::onSetGroupTaskDone()
-{
-    // task->iData must be valid, see comment in headerUpdateDone
-    SetHeaderTask* task = qobject_cast<SetHeaderTask*>(sender());
-    HDEBUG(QString::fromUtf8(task->iHeaderValue));
-    task->iData->iSetGroupTask = NULL;
-    headerUpdateDone(task);
-}
+void FoilPicsModel::Private::flushDataChanged()
+{
+    iFlushDataChangedQueued = false;
+    if (!iChangedRoles.isEmpty()) {
+        // Only the changed rows are looked up, the model is sorted
+        // so that takes O(log n) per row
+        QVector<QPair<int,uint> > rows;
+        rows.reserve(iChangedRoles.count());
+        QHashIterator<ModelData*,uint> it(iChangedRoles);
+        while (it.hasNext()) {
+            it.next();
+            const ModelData* data = it.key();
+            const int row = rowOf(data, data->iSortKey);
+            if (row >= 0) {
+                rows.append(QPair<int,uint>(row, it.value()));
+            }
+        }
+        iChangedRoles.clear();
+        qSort(rows.begin(), rows.end());
 
-void FoilPicsModel::Private::dataChanged(int aIndex, ModelData::Role aRole)
-{
-    if (aIndex >= 0 && aIndex < iData.count()) {
-        QVector<int> roles;
-        roles.append(aRole);
+        // One signal per contiguous range of changed rows, with
+        // the roles merged
         FoilPicsModel* model = parentModel();
-        QModelIndex modelIndex(model->index(aIndex));
-        Q_EMIT model->dataChanged(modelIndex, modelIndex, roles);
-    }
-}
-
-void FoilPicsModel::Private::dataChanged(QList<int> aRows, ModelData::Role aRole)
-{
-    const int n = aRows.count();
-    for (int i = 0; i < n; i++) {
-        dataChanged(aRows.at(i), aRole);
+        const int n = rows.count();
+        int i = 0;
+        while (i < n) {
+            const int first = rows.at(i).first;
+            uint mask = rows.at(i).second;
+            int last = first;
+            for (i++; i < n && rows.at(i).first == last + 1; i++) {
+                last++;
+                mask |= rows.at(i).second;
+            }
+            QVector<int> roles;
+            for (int r = ModelData::FirstRole + 1;
+                 r < ModelData::LastRole; r++) {
+                if (mask & (1u << (r - ModelData::FirstRole))) {
+                    roles.append(r);
+                }
+            }
+            HDEBUG(first << ".." << last << roles);
+            Q_EMIT model->dataChanged(model->index(first),
+                model->index(last), roles);
+        }
     }
 }
 
@@ -2973,16 +5285,23 @@ void FoilPicsModel::Private::imageRequest(QString aPath,
 
     // Check if the decrypted data is cached
     const int index = findPath(aPath);
-    if (index >= 0) {
-        ModelData* data = iData.at(index);
-        if (!data->iBytes.isEmpty()) {
-            bytes = data->iBytes;
-            contentType = data->iContentType;
-        }
+    ModelData* data = (index >= 0) ? iData.at(index) : NULL;
+    if (data && !data->iBytes.isEmpty()) {
+        bytes = data->iBytes;
+        contentType = data->iContentType;
     }
     HDEBUG("Requesting" << qPrintable(aPath));
     ImageRequestTask* task = new ImageRequestTask(iThreadPool, aPath,
         bytes, contentType, iPrivateKey, iPublicKey, aRequest);
+    const QSize requested(aRequest.requestedSize());
+    if (data && bytes.isEmpty() && data->iCoverLevelSize.isValid() &&
+        (requested.width() > 0 || requested.height() > 0) &&
+        requested.width() <= data->iCoverLevelSize.width() &&
+        requested.height() <= data->iCoverLevelSize.height()) {
+        task->iDir = iFoilPicsDir;
+        task->iThumbFile = data->iThumbFile;
+        task->iCoverLevelSize = data->iCoverLevelSize;
+    }
     iImageRequestTasks.append(task);
     task->submit(this, SLOT(onImageRequestDone()));
     if (!wasBusy) {
@@ -3076,7 +5395,7 @@ bool FoilPicsModel::Private::busy() const
         iSaveInfoTask ||
         iGenerateKeyTask ||
         iDecryptPicsTask ||
-        !iEncryptTasks.isEmpty() ||
+        encrypting() ||
         !iImageRequestTasks.isEmpty()) {
         return true;
     } else {
@@ -3084,9 +5403,7 @@ bool FoilPicsModel::Private::busy() const
         const int n = iData.count();
         for (int i=0; i<n; i++) {
             ModelData* data = iData.at(i);
-            if (data->iDecryptTask ||
-                data->iSetTitleTask ||
-                data->iSetGroupTask) {
+            if (data->iDecryptTask) {
                 return true;
             }
         }
@@ -3129,6 +5446,11 @@ QSize FoilPicsModel::thumbnailSize() const
     return iPrivate->iThumbSize;
 }
 
+QSize FoilPicsModel::coverSize() const
+{
+    return iPrivate->iCoverSize;
+}
+
 int FoilPicsModel::groupIdRole()
 {
     return ModelData::GroupIdRole;
@@ -3163,7 +5485,8 @@ int FoilPicsModel::rowCount(const QModelIndex& aParent) const
 QVariant FoilPicsModel::data(const QModelIndex& aIndex, int aRole) const
 {
     ModelData* data = iPrivate->dataAt(aIndex.row());
-    return data ? data->get((ModelData::Role)aRole) : QVariant();
+    return data ? data->get((ModelData::Role)aRole,
+        iPrivate->thumbPrefix(), iPrivate->imagePrefix()) : QVariant();
 }
 
 void FoilPicsModel::setThumbnailSize(QSize aSize)
@@ -3176,6 +5499,16 @@ void FoilPicsModel::setThumbnailSize(QSize aSize)
     }
 }
 
+void FoilPicsModel::setCoverSize(QSize aSize)
+{
+    // Pictures encrypted from now on get a thumbnail level of this size
+    if (iPrivate->iCoverSize != aSize) {
+        iPrivate->iCoverSize = aSize;
+        HDEBUG(aSize);
+        Q_EMIT coverSizeChanged();
+    }
+}
+
 void FoilPicsModel::removeAt(int aIndex)
 {
     HDEBUG(aIndex);
@@ -3194,7 +5527,8 @@ QVariantMap FoilPicsModel::get(int aIndex) const
 {
     HDEBUG(aIndex);
     ModelData* data = iPrivate->dataAt(aIndex);
-    return data ? data->iVariant : QVariantMap();
+    return data ? data->toVariantMap(iPrivate->thumbPrefix(),
+        iPrivate->imagePrefix()) : QVariantMap();
 }
 
 void FoilPicsModel::decryptFiles(QList<int> aRows)
@@ -3271,11 +5605,21 @@ void FoilPicsModel::imageRequest(QString aPath, FoilPicsImageRequest aRequest)
 int FoilPicsModel::groupIndexAt(int aIndex) const
 {
     ModelData* data = iPrivate->dataAt(aIndex);
-    if (data) {
-        return iPrivate->iGroupModel->indexOfGroup(data->iGroupId);
-    } else {
-        return -1;
-    }
+    return data ? data->groupIndex() : -1;
+}
+
+int FoilPicsModel::groupFirstRow(int aGroupIndex) const
+{
+    const QVector<int>& offsets = iPrivate->iGroupOffsets;
+    return (aGroupIndex >= 0 && (aGroupIndex + 1) < offsets.count()) ?
+        offsets.at(aGroupIndex) : -1;
+}
+
+int FoilPicsModel::groupRowCount(int aGroupIndex) const
+{
+    const QVector<int>& offsets = iPrivate->iGroupOffsets;
+    return (aGroupIndex >= 0 && (aGroupIndex + 1) < offsets.count()) ?
+        (offsets.at(aGroupIndex + 1) - offsets.at(aGroupIndex)) : 0;
 }
 
 void FoilPicsModel::setGroupIdAt(int aIndex, QString aId)
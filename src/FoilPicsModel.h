@@ -42,6 +42,8 @@
 
 #include "FoilPicsImageRequest.h"
 
+class FoilPicsModelData;
+
 class FoilPicsModel : public QAbstractListModel {
     Q_OBJECT
     Q_ENUMS(FoilState)
@@ -50,18 +52,24 @@ class FoilPicsModel : public QAbstractListModel {
     Q_PROPERTY(bool keyAvailable READ keyAvailable NOTIFY keyAvailableChanged)
     Q_PROPERTY(FoilState foilState READ foilState NOTIFY foilStateChanged)
     Q_PROPERTY(QSize thumbnailSize READ thumbnailSize WRITE setThumbnailSize NOTIFY thumbnailSizeChanged)
+    Q_PROPERTY(QSize coverSize READ coverSize WRITE setCoverSize NOTIFY coverSizeChanged)
     Q_PROPERTY(bool mayHaveEncryptedPictures READ mayHaveEncryptedPictures NOTIFY mayHaveEncryptedPicturesChanged)
     Q_PROPERTY(QAbstractItemModel* groupModel READ groupModel CONSTANT)
 
     class Private;
-    class ModelData;
+    typedef FoilPicsModelData ModelData;
     class SaveInfoTask;
+    class CatalogState;
     class GenerateKeyTask;
     class CheckPicsTask;
+    class CompactThumbsTask;
+    class MigrateVaultTask;
     class BaseTask;
     class DecryptTask;
+    class EncryptFile;
+    class ReadFileTask;
+    class ThumbnailTask;
     class EncryptTask;
-    class SetHeaderTask;
     class ImageRequestTask;
 
 public:
@@ -88,6 +96,8 @@ public:
     bool mayHaveEncryptedPictures() const;
     QSize thumbnailSize() const;
     void setThumbnailSize(QSize aSize);
+    QSize coverSize() const;
+    void setCoverSize(QSize aSize);
 
     static int groupIdRole();
     QAbstractItemModel* groupModel();
@@ -114,6 +124,8 @@ public:
     Q_INVOKABLE void setGroupIdAt(int aIndex, QString aId);
     Q_INVOKABLE void setGroupIdForRows(QList<int> aRows, QString aId);
     Q_INVOKABLE int groupIndexAt(int aIndex) const;
+    Q_INVOKABLE int groupFirstRow(int aGroupIndex) const;
+    Q_INVOKABLE int groupRowCount(int aGroupIndex) const;
     Q_INVOKABLE QVariantMap get(int aIndex) const;
 
     // Keys for metadata passed to encryptFile:
@@ -136,10 +148,12 @@ Q_SIGNALS:
     void foilStateChanged();
     void mayHaveEncryptedPicturesChanged();
     void thumbnailSizeChanged();
+    void coverSizeChanged();
 
     void keyGenerated();
     void passwordChanged();
     void decryptionStarted();
+    void duplicatesSkipped(int aCount, qlonglong aBytes);
 
 private:
     Private* iPrivate;
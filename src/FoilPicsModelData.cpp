@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsModelData.h"
+#include "FoilPicsTask.h"
+#include "FoilPicsThumbnail.h"
+
+#include "HarbourDebug.h"
+
+#include <errno.h>
+
+#define ROLE(X,x) const QString FoilPicsModelData::RoleName##X(#x);
+FOILPICS_ROLES(ROLE)
+#undef ROLE
+
+// ==========================================================================
+// FoilPicsModelData::Strings
+// ==========================================================================
+
+QString FoilPicsModelData::Strings::intern(QString aString)
+{
+    if (aString.isEmpty()) {
+        return QString();
+    } else {
+        QMutexLocker locker(&iMutex);
+        return *iSet.insert(aString);
+    }
+}
+
+// ==========================================================================
+// FoilPicsModelData::Exif
+// ==========================================================================
+
+FoilPicsModelData::Exif* FoilPicsModelData::Exif::create(Strings* aStrings,
+    QString aCameraManufacturer, QString aCameraModel,
+    const char* aLatitude, const char* aLongitude, const char* aAltitude,
+    QDateTime aImageDate)
+{
+    const double latitude = toDouble(aLatitude);
+    const double longitude = toDouble(aLongitude);
+    const double altitude = toDouble(aAltitude);
+    if (aCameraManufacturer.isEmpty() && aCameraModel.isEmpty() &&
+        qIsNaN(latitude) && qIsNaN(longitude) && qIsNaN(altitude) &&
+        !aImageDate.isValid()) {
+        // Nothing to remember
+        return NULL;
+    } else {
+        Exif* exif = new Exif;
+        if (aStrings) {
+            exif->iCameraManufacturer = aStrings->intern(aCameraManufacturer);
+            exif->iCameraModel = aStrings->intern(aCameraModel);
+        } else {
+            exif->iCameraManufacturer = aCameraManufacturer;
+            exif->iCameraModel = aCameraModel;
+        }
+        exif->iImageDate = aImageDate;
+        exif->iLatitude = latitude;
+        exif->iLongitude = longitude;
+        exif->iAltitude = altitude;
+        return exif;
+    }
+}
+
+FoilPicsModelData::Exif* FoilPicsModelData::Exif::fromFoilMsg(
+    Strings* aStrings, const FoilMsg* aMsg)
+{
+    return create(aStrings,
+        headerString(aMsg, HEADER_CAMERA_MANUFACTURER),
+        headerString(aMsg, HEADER_CAMERA_MODEL),
+        foilmsg_get_value(aMsg, HEADER_LATITUDE),
+        foilmsg_get_value(aMsg, HEADER_LONGITUDE),
+        foilmsg_get_value(aMsg, HEADER_ALTITUDE),
+        headerTime(aMsg, HEADER_IMAGE_DATE));
+}
+
+// ==========================================================================
+// FoilPicsModelData
+// ==========================================================================
+
+FoilPicsModelData::FoilPicsModelData(Strings* aStrings,
+    QString aOriginalPath, int aOriginalSize, QSize aFullDimensions,
+    QString aImageId, QString aPath, QString aThumbFile, QImage aThumbImage,
+    QString aTitle, const char* aContentType, QDateTime aSortTime,
+    int aOrientation, Exif* aExif, const char* aGroupId) :
+    iPath(aPath), iThumbFile(aThumbFile), iImageId(aImageId),
+    iFullDimensions(aFullDimensions), iThumbnail(aThumbImage),
+    iSortKey(sortKey(0, aSortTime)), iOriginalSize(aOriginalSize),
+    iOrientation(aOrientation), iExif(aExif), iDecryptTask(NULL)
+{
+    QFileInfo fileInfo(aOriginalPath);
+    iFileName = fileInfo.fileName();
+    iEncryptedSize = QFileInfo(aPath).size();
+    if (aTitle != defaultTitle(fileInfo)) iTitle = aTitle;
+    if (aContentType) {
+        const QString contentType(QLatin1String(aContentType));
+        iContentType = aStrings ? aStrings->intern(contentType) : contentType;
+    }
+    if (aGroupId && aGroupId[0]) iGroupId = QByteArray(aGroupId);
+    HDEBUG(iFileName << qPrintable(iImageId) << iOrientation);
+}
+
+FoilPicsModelData::~FoilPicsModelData()
+{
+    delete iExif;
+    if (iDecryptTask) iDecryptTask->release();
+}
+
+FoilPicsModelData* FoilPicsModelData::fromFoilMsg(Strings* aStrings,
+    FoilMsg* aMsg, QString aOriginalPath, QSize aFullDimensions,
+    QString aPath, QString aThumbFile, QImage aThumbImage,
+    const char* aContentType, int aOrientation)
+{
+    return new FoilPicsModelData(aStrings, aOriginalPath,
+        headerInt(aMsg, HEADER_ORIGINAL_SIZE), aFullDimensions,
+        imageId(aMsg), aPath, aThumbFile, aThumbImage,
+        headerString(aMsg, HEADER_TITLE), aContentType,
+        headerSortTime(aMsg), aOrientation,
+        Exif::fromFoilMsg(aStrings, aMsg),
+        foilmsg_get_value(aMsg, HEADER_GROUP));
+}
+
+QString FoilPicsModelData::imageId(GBytes* aDigest)
+{
+    // General image id from the digest
+    gsize digestSize;
+    const uchar* digest = (uchar*)g_bytes_get_data(aDigest, &digestSize);
+    GString* buf = g_string_sized_new(digestSize*2);
+    for (guint i = 0; i < digestSize; i++) {
+        g_string_append_printf(buf, "%02X", digest[i]);
+    }
+    QString id(QLatin1String(buf->str));
+    g_string_free(buf, TRUE);
+    return id;
+}
+
+QString FoilPicsModelData::digestKey(QString aImageId, qint64 aSize)
+{
+    // Digest and the size of the original file, e.g. "0123...CDEF/123456"
+    return aImageId + QChar(INFO_DIGEST_SIZE_DELIMITER) +
+        QString::number(aSize);
+}
+
+QString FoilPicsModelData::digestKey() const
+{
+    return digestKey(iImageId, iOriginalSize);
+}
+
+quint64 FoilPicsModelData::sortKey(int aGroupIndex, QDateTime aSortTime)
+{
+    // Group index in the upper 16 bits, most recent first within
+    // the group. 48 bits of milliseconds are good for 8900 years,
+    // biased so that the epoch is in the middle and pictures taken
+    // (or scanned with the date set) before 1970 keep their order.
+    // Pictures without a date go last.
+    const quint64 maxTime = Q_UINT64_C(0xffffffffffff);
+    const qint64 bias = Q_INT64_C(0x800000000000);
+    const quint64 group = qBound(0, aGroupIndex, 0xffff);
+    const qint64 msec = aSortTime.isValid() ?
+        qBound(Q_INT64_C(1), aSortTime.toMSecsSinceEpoch() + bias,
+            (qint64)maxTime) : 0;
+    return (group << 48) | (maxTime - msec);
+}
+
+int FoilPicsModelData::groupIndex(quint64 aSortKey)
+{
+    return (int)(aSortKey >> 48);
+}
+
+int FoilPicsModelData::groupIndex() const
+{
+    return groupIndex(iSortKey);
+}
+
+void FoilPicsModelData::setGroupIndex(int aGroupIndex)
+{
+    // The sort time stays where it was
+    const quint64 group = qBound(0, aGroupIndex, 0xffff);
+    iSortKey = (group << 48) | (iSortKey & Q_UINT64_C(0xffffffffffff));
+}
+
+QString FoilPicsModelData::imageId(const FoilMsg* aMsg)
+{
+    // Newer files carry the digest of the plaintext in the header,
+    // older ones need to be hashed
+    QString id(headerString(aMsg, HEADER_IMAGE_ID));
+    if (id.isEmpty()) {
+        GBytes* digest = foil_digest_bytes(DIGEST_TYPE, aMsg->data);
+        id = imageId(digest);
+        g_bytes_unref(digest);
+    }
+    return id;
+}
+
+QString FoilPicsModelData::source(QString aPrefix, QString aImageId)
+{
+    return (aPrefix.isEmpty() || aImageId.isEmpty()) ? QString() :
+        (aPrefix + aImageId);
+}
+
+QString FoilPicsModelData::title() const
+{
+    return iTitle.isEmpty() ? defaultTitle() : iTitle;
+}
+
+QString FoilPicsModelData::defaultTitle() const
+{
+    return defaultTitle(iFileName);
+}
+
+QVariantMap FoilPicsModelData::toVariantMap(QString aThumbPrefix,
+    QString aImagePrefix) const
+{
+    // Built on demand, there's no point in keeping it around
+    QVariantMap map;
+#define ROLE(X,x) map.insert(RoleName##X, \
+    get(X##Role, aThumbPrefix, aImagePrefix));
+    FOILPICS_ROLES(ROLE)
+#undef ROLE
+    return map;
+}
+
+QVariant FoilPicsModelData::get(Role aRole, QString aThumbPrefix,
+    QString aImagePrefix) const
+{
+    switch (aRole) {
+    case UrlRole: return source(aImagePrefix, iImageId);
+    case ImageIdRole: return iImageId;
+    case OriginalFileSizeRole: return iOriginalSize ?
+            QVariant::fromValue(iOriginalSize) : QVariant();
+    case EncryptedFileSizeRole: return iEncryptedSize ?
+            QVariant::fromValue(iEncryptedSize) : QVariant();
+    case ThumbnailRole: return source(aThumbPrefix, iImageId);
+    case OrientationRole: return iOrientation;
+    case CameraManufacturerRole: return iExif ?
+            iExif->iCameraManufacturer : QString();
+    case CameraModelRole: return iExif ? iExif->iCameraModel : QString();
+    case LatitudeRole: return iExif ?
+            optionalDouble(iExif->iLatitude) : QVariant();
+    case LongitudeRole: return iExif ?
+            optionalDouble(iExif->iLongitude) : QVariant();
+    case AltitudeRole: return iExif ?
+            optionalDouble(iExif->iAltitude) : QVariant();
+    case ImageDateRole: return (iExif && iExif->iImageDate.isValid()) ?
+            QVariant::fromValue(iExif->iImageDate) : QVariant();
+    case MimeTypeRole: return iContentType;
+    case TitleRole: return title();
+    case DefaultTitleRole: return defaultTitle();
+    case FileNameRole: return iFileName;
+    case ImageWidthRole: return iFullDimensions.width();
+    case ImageHeightRole: return iFullDimensions.height();
+    case GroupIdRole: return iGroupId.isEmpty() ?
+        QString() : QString::fromLatin1(iGroupId);
+    // No default to make sure that we get "warning: enumeration value
+    // not handled in switch" if we forget to handle a real role.
+    case FirstRole:
+    case LastRole:
+        break;
+    }
+    return QVariant();
+}
+
+double FoilPicsModelData::toDouble(const char* aString)
+{
+    if (aString && aString[0]) {
+        errno = 0;
+        double q = g_ascii_strtod(aString, NULL);
+        if (!errno && !qIsNaN(q)) {
+            return q;
+        }
+    }
+    return qQNaN();
+}
+
+inline QVariant FoilPicsModelData::optionalDouble(double aValue)
+{
+    return qIsNaN(aValue) ? QVariant() : QVariant::fromValue(aValue);
+}
+
+QString FoilPicsModelData::defaultTitle(QString aPath)
+{
+    return defaultTitle(QFileInfo(aPath));
+}
+
+QString FoilPicsModelData::defaultTitle(QFileInfo aFileInfo)
+{
+    return aFileInfo.baseName();
+}
+
+QImage FoilPicsModelData::thumbnail(const QImage aImage, QSize aSize,
+    int aRotate)
+{
+    // Try the single pass first
+    QImage thumb(FoilPicsThumbnail::make(aImage, aSize, aRotate));
+    if (!thumb.isNull()) {
+        return thumb;
+    }
+
+    QImage cropped;
+    const QSize imageSize(aImage.size());
+    const Qt::TransformationMode txMode(Qt::SmoothTransformation);
+    if (imageSize.width()*aSize.height() > aSize.width()*imageSize.height()) {
+        QImage scaled(aImage.scaledToHeight(aSize.height(), txMode));
+        const int x = (scaled.width() - aSize.width())/2;
+        cropped = scaled.copy(x, 0, aSize.width(), aSize.height());
+    } else {
+        QImage scaled(aImage.scaledToWidth(aSize.width(), txMode));
+        const int y = (scaled.height() - aSize.height())/2;
+        cropped = scaled.copy(0, y, aSize.width(), aSize.height());
+    }
+    if (aRotate) {
+        const qreal x = ((qreal)aSize.width())/2;
+        const qreal y = ((qreal)aSize.height())/2;
+        return cropped.transformed(QTransform::fromTranslate(x, y).
+            rotate(-aRotate).translate(-x, -y));
+    } else {
+        return cropped;
+    }
+}
+
+const char* FoilPicsModelData::format(const char* aContentType)
+{
+    static const struct FormatMap {
+        const char* contentType;
+        const char* imageFormat;
+    } formatMap[] = { /* Sorted */
+        { "image/bmp", "BMP" },
+        { "image/gif", "GIF" },
+        { "image/jpeg", "JPEG" },
+        { "image/jpg", "JPEG" },
+        { "image/png", "PNG" },
+        { "image/svg+xml", "SVG" },
+        { "image/tif", "TIFF" },
+        { "image/tiff", "TIFF" },
+        { "image/x-bmp", "BMP" },
+        { "image/x-portable-bitmap", "PBM" },
+        { "image/x-portable-graymap", "PGM" },
+        { "image/x-portable-pixmap", "PPM" }
+    };
+
+    if (aContentType && aContentType[0]) {
+        FormatMap key;
+        key.contentType = aContentType;
+        key.imageFormat = NULL;
+        const FormatMap* res = (const FormatMap*)bsearch(&key, formatMap,
+            G_N_ELEMENTS(formatMap), sizeof(formatMap[0]), compareFormatMap);
+        if (res) {
+            return res->imageFormat;
+        }
+        HDEBUG("Unknown content type" << aContentType);
+    }
+    return NULL;
+}
+
+int FoilPicsModelData::compareFormatMap(const void* aElem1,
+    const void* aElem2)
+{
+    return strcmp(((const FormatMap*)aElem1)->contentType,
+        ((const FormatMap*)aElem2)->contentType);
+}
+
+int FoilPicsModelData::headerInt(const FoilMsg* aMsg,
+    const char* aKey, int aDefaultValue)
+{
+    int result = aDefaultValue;
+    const char* str = foilmsg_get_value(aMsg, aKey);
+    if (str && str[0]) {
+        gboolean ok;
+        char *str2 = g_strstrip(g_strdup(str));
+        char *end = str2;
+        long l;
+        errno = 0;
+        l = strtol(str2, &end, 0);
+        ok = !*end && errno != ERANGE && l >= INT_MIN && l <= INT_MAX;
+        if (ok) {
+            result = (int)l;
+        }
+        g_free(str2);
+    }
+    return result;
+}
+
+QString FoilPicsModelData::headerString(const FoilMsg* aMsg,
+    const char* aKey)
+{
+    const char* value = foilmsg_get_value(aMsg, aKey);
+    return (value && value[0]) ? QString(value) : QString();
+}
+
+QDateTime FoilPicsModelData::headerTime(const FoilMsg* aMsg,
+    const char* aKey)
+{
+    const char* value = foilmsg_get_value(aMsg, aKey);
+    return value ? QDateTime::fromString(value, Qt::ISODate) : QDateTime();
+}
+
+QDateTime FoilPicsModelData::headerSortTime(const FoilMsg* aMsg)
+{
+    QDateTime time = headerTime(aMsg, HEADER_IMAGE_DATE);
+    return time.isValid() ? time : headerTime(aMsg, HEADER_MODIFICATION_TIME);
+}
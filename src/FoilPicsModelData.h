@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_MODEL_DATA_H
+#define FOILPICS_MODEL_DATA_H
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QImage>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVariantMap>
+
+#include "foil_digest.h"
+#include "foilmsg.h"
+
+class FoilPicsTask;
+
+#define DIGEST_TYPE FOIL_DIGEST_SHA256
+
+// Digest key is the image id and the size of the original file
+#define INFO_DIGEST_SIZE_DELIMITER '/'
+
+#define HEADER_ORIGINAL_PATH        "Original-Path"
+#define HEADER_ORIGINAL_SIZE        "Original-Size"
+#define HEADER_MODIFICATION_TIME    "Modification-Time"
+#define HEADER_ACCESS_TIME          "Access-Time"
+#define HEADER_ORIENTATION          "Orientation"
+#define HEADER_CAMERA_MANUFACTURER  "Camera-Manufacturer"
+#define HEADER_CAMERA_MODEL         "Camera-Model"
+#define HEADER_IMAGE_DATE           "Image-Date"
+#define HEADER_LATITUDE             "Latitude"
+#define HEADER_LONGITUDE            "Longitude"
+#define HEADER_ALTITUDE             "Altitude"
+#define HEADER_TITLE                "Title"
+#define HEADER_GROUP                "Group"
+#define HEADER_IMAGE_ID             "Image-Id"
+
+// Role names
+#define FOILPICS_ROLES(role) \
+    role(Url, url) \
+    role(ImageId, imageId) \
+    role(OriginalFileSize, originalFileSize) \
+    role(EncryptedFileSize, encryptedFileSize) \
+    role(Thumbnail, thumbnail) \
+    role(Orientation, orientation) \
+    role(CameraManufacturer, cameraManufacturer) \
+    role(CameraModel, cameraModel) \
+    role(Latitude, latitude) \
+    role(Longitude, longitude) \
+    role(Altitude, altitude) \
+    role(ImageDate, imageDate) \
+    role(MimeType, mimeType) \
+    role(FileName, fileName) \
+    role(Title, title) \
+    role(DefaultTitle, defaultTitle) \
+    role(ImageWidth, imageWidth) \
+    role(ImageHeight, imageHeight) \
+    role(GroupId, groupId)
+
+// One row of FoilPicsModel. There may be tens of thousands of those,
+// so anything that can be derived from the other fields is derived on
+// demand and the metadata which most pictures don't have is allocated
+// separately.
+class FoilPicsModelData {
+public:
+    enum Role {
+        FirstRole = Qt::UserRole,
+#define ROLE(X,x) X##Role,
+        FOILPICS_ROLES(ROLE)
+#undef ROLE
+        LastRole
+    };
+
+#define ROLE(X,x) static const QString RoleName##X;
+    FOILPICS_ROLES(ROLE)
+#undef ROLE
+
+    typedef QList<FoilPicsModelData*> List;
+    typedef List::ConstIterator ConstIterator;
+    struct FormatMap {
+        const char* contentType;
+        const char* imageFormat;
+    };
+
+    // Content types and camera names repeat a lot. The pool is filled
+    // by the worker threads, hence the mutex.
+    class Strings {
+    public:
+        typedef QSharedPointer<Strings> Ptr;
+        QString intern(QString aString);
+
+    private:
+        QMutex iMutex;
+        QSet<QString> iSet;
+    };
+
+    // Camera and location
+    class Exif {
+    public:
+        static Exif* create(Strings* aStrings, QString aCameraManufacturer,
+            QString aCameraModel, const char* aLatitude,
+            const char* aLongitude, const char* aAltitude,
+            QDateTime aImageDate);
+        static Exif* fromFoilMsg(Strings* aStrings, const FoilMsg* aMsg);
+
+    public:
+        QString iCameraManufacturer;    // Interned
+        QString iCameraModel;           // Interned
+        QDateTime iImageDate;
+        double iLatitude;               // NaN if unknown
+        double iLongitude;              // NaN if unknown
+        double iAltitude;               // NaN if unknown
+    };
+
+    FoilPicsModelData(Strings* aStrings, QString aOriginalPath,
+        int aOriginalSize, QSize aFullDimensions, QString aImageId,
+        QString aPath, QString aThumbFile, QImage aThumbImage,
+        QString aTitle, const char* aContentType, QDateTime aSortTime,
+        int aOrientation, Exif* aExif, const char* aGroupId);
+    ~FoilPicsModelData();
+
+    // Image sources are the provider prefix followed by the image id
+    QVariant get(Role aRole, QString aThumbPrefix,
+        QString aImagePrefix) const;
+    QVariantMap toVariantMap(QString aThumbPrefix,
+        QString aImagePrefix) const;
+
+    QString title() const;
+    QString defaultTitle() const;
+    static QString defaultTitle(QString aPath);
+    static QString defaultTitle(QFileInfo aFileInfo);
+    static QString imageId(GBytes* aDigest);
+    static QString imageId(const FoilMsg* aMsg);
+    static QString digestKey(QString aImageId, qint64 aSize);
+    QString digestKey() const;
+    static quint64 sortKey(int aGroupIndex, QDateTime aSortTime);
+    static int groupIndex(quint64 aSortKey);
+    int groupIndex() const;
+    void setGroupIndex(int aGroupIndex);
+    static QImage thumbnail(const QImage aImage, QSize aSize, int aRotate);
+    static const char* format(const char* aContentType);
+    static int compareFormatMap(const void* aElem1, const void* aElem2);
+
+    static double toDouble(const char* aString);
+    static QVariant optionalDouble(double aValue);
+    static QString headerString(const FoilMsg* aMsg, const char* aKey);
+    static QDateTime headerTime(const FoilMsg* aMsg, const char* aKey);
+    static QDateTime headerSortTime(const FoilMsg* aMsg);
+    static int headerInt(const FoilMsg* aMsg, const char* aKey, int aDef = 0);
+
+    static FoilPicsModelData* fromFoilMsg(Strings* aStrings, FoilMsg* aMsg,
+        QString aOriginalPath, QSize aFullDimensions, QString aPath,
+        QString aThumbFile, QImage aThumbImage, const char* aContentType,
+        int aOrientation);
+
+private:
+    Q_DISABLE_COPY(FoilPicsModelData)
+    static QString source(QString aPrefix, QString aImageId);
+
+public:
+    QString iPath;
+    QString iFileName;
+    QString iThumbFile;             // Without path
+    QString iTitle;                 // Empty if it's the default one
+    QString iImageId;
+    QString iContentType;           // Interned
+    QByteArray iGroupId;
+    QByteArray iBytes;
+    QSize iFullDimensions;
+    QSize iCoverLevelSize;          // Invalid if there's no cover level
+    QImage iThumbnail;              // Until it's handed to the provider
+    quint64 iSortKey;               // Group index and sort time
+    int iEncryptedSize;
+    int iOriginalSize;
+    int iOrientation;
+    Exif* iExif;                    // NULL if there's no camera metadata
+    FoilPicsTask* iDecryptTask;
+};
+
+#endif // FOILPICS_MODEL_DATA_H
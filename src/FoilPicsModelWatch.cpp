@@ -32,6 +32,7 @@
  */
 
 #include "FoilPicsModelWatch.h"
+#include "FoilPicsKeyIndex.h"
 #include "FoilPicsRole.h"
 #include "HarbourDebug.h"
 
@@ -51,20 +52,16 @@ public:
     void setKeyRole(QString aRole);
     void setKeyValue(QString aValue);
     void setWatchRole(QString aRole);
-    void updateKeyRole();
+    void updateKeyIndex();
     void updateWatchRole();
     void updateWatchValue();
     void reset();
     void searchModel();
-    void searchModel(int aFirstRow, int aLastRow);
 
 public Q_SLOTS:
     void onModelDestroyed(QObject* aModel);
     void onModelReset();
-    void onModelRowsInserted(const QModelIndex& aParent, int aStart, int aEnd);
-    void onModelRowsRemoved(const QModelIndex& aParent, int aStart, int aEnd);
-    void onModelRowsMoved(const QModelIndex& aSourceParent, int aSourceStart,
-        int aSourceEnd, const QModelIndex& aDestParent, int aDest);
+    void onKeysChanged();
     void onModelDataChanged(const QModelIndex& aTopLeft,
         const QModelIndex& aBottomRight, const QVector<int>& aRoles);
 
@@ -72,7 +69,7 @@ public:
     QAbstractItemModel* iModel;
     QString iKeyRoleName;
     QString iKeyValue;
-    int iKeyRole;
+    FoilPicsKeyIndex::Ptr iKeyIndex;
     int iColumn;
     QString iWatchRoleName;
     int iWatchRole;
@@ -83,7 +80,6 @@ public:
 FoilPicsModelWatch::Private::Private(FoilPicsModelWatch* aParent) :
     QObject(aParent),
     iModel(NULL),
-    iKeyRole(-1),
     iColumn(0),
     iWatchRole(-1),
     iIndex(-1)
@@ -97,7 +93,7 @@ inline FoilPicsModelWatch* FoilPicsModelWatch::Private::watcher() const
 
 bool FoilPicsModelWatch::Private::isUsable() const
 {
-    return iKeyRole >= 0 && !iKeyRoleName.isEmpty() && !iKeyValue.isEmpty() &&
+    return iKeyIndex && iKeyIndex->isValid() && !iKeyValue.isEmpty() &&
         iModel && iModel->rowCount() > 0;
 }
 
@@ -115,37 +111,32 @@ void FoilPicsModelWatch::Private::setModel(QAbstractItemModel* aModel)
             connect(iModel,
                 SIGNAL(modelReset()),
                 SLOT(onModelReset()));
-            connect(iModel,
-                SIGNAL(rowsInserted(QModelIndex,int,int)),
-                SLOT(onModelRowsInserted(QModelIndex,int,int)));
-            connect(iModel,
-                SIGNAL(rowsRemoved(QModelIndex,int,int)),
-                SLOT(onModelRowsRemoved(QModelIndex,int,int)));
-            connect(iModel,
-                SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
-                SLOT(onModelRowsMoved(QModelIndex,int,int,QModelIndex,int)));
             connect(iModel,
                 SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)),
                 SLOT(onModelDataChanged(QModelIndex,QModelIndex,QVector<int>)));
         }
         Q_EMIT watcher()->modelChanged();
-        updateKeyRole();
+        updateKeyIndex();
         updateWatchRole();
     }
 }
 
-void FoilPicsModelWatch::Private::updateKeyRole()
+void FoilPicsModelWatch::Private::updateKeyIndex()
 {
-    const int role = FoilPicsRole::find(iModel, iKeyRoleName);
-    if (role >= 0) {
-        if (iKeyRole != role) {
-            iKeyRole = role;
-            HDEBUG(iKeyRoleName << role);
-            searchModel();
+    // Row shifts are tracked by the index shared by all watchers
+    FoilPicsKeyIndex::Ptr index(FoilPicsKeyIndex::get(iModel, iKeyRoleName));
+    if (iKeyIndex != index) {
+        if (iKeyIndex) {
+            iKeyIndex->disconnect(this);
         }
-    } else {
-        reset();
+        iKeyIndex = index;
+        if (iKeyIndex) {
+            connect(iKeyIndex.data(), SIGNAL(keysChanged()),
+                SLOT(onKeysChanged()));
+        }
+        HDEBUG(iKeyRoleName << (iKeyIndex && iKeyIndex->isValid()));
     }
+    searchModel();
 }
 
 void FoilPicsModelWatch::Private::updateWatchRole()
@@ -184,7 +175,7 @@ void FoilPicsModelWatch::Private::setKeyRole(QString aRole)
     if (iKeyRoleName != aRole) {
         iKeyRoleName = aRole;
         Q_EMIT watcher()->keyRoleChanged();
-        updateKeyRole();
+        updateKeyIndex();
     }
 }
 
@@ -220,70 +211,37 @@ void FoilPicsModelWatch::Private::reset()
 
 void FoilPicsModelWatch::Private::searchModel()
 {
-    if (isUsable()) {
-        searchModel(0, iModel->rowCount() - 1);
+    const int row = isUsable() ? iKeyIndex->rowOf(iKeyValue) : -1;
+    if (row >= 0) {
+        if (iIndex != row) {
+            iIndex = row;
+            HDEBUG(iKeyValue << "at" << row);
+            Q_EMIT watcher()->indexChanged();
+        }
+        updateWatchValue();
     } else {
         reset();
     }
 }
 
-void FoilPicsModelWatch::Private::searchModel(int aFirstRow, int aLastRow)
-{
-    if (isUsable()) {
-        for (int row = aFirstRow; row <= aLastRow; row++) {
-            QModelIndex index = iModel->index(row, iColumn);
-            if (iKeyValue == iModel->data(index, iKeyRole).toString()) {
-                if (iIndex != row) {
-                    iIndex = row;
-                    HDEBUG(iKeyValue << "at" << row);
-                    Q_EMIT watcher()->indexChanged();
-                }
-                updateWatchValue();
-                return;
-            }
-        }
-    }
-    reset();
-}
-
 void FoilPicsModelWatch::Private::onModelDestroyed(QObject* aModel)
 {
     HDEBUG("");
     iModel = NULL;
-    reset();
+    updateKeyIndex();
     Q_EMIT watcher()->modelChanged();
 }
 
 void FoilPicsModelWatch::Private::onModelReset()
 {
     HDEBUG("");
-    updateKeyRole();
     updateWatchRole();
     searchModel();
 }
 
-void FoilPicsModelWatch::Private::onModelRowsInserted(const QModelIndex& aParent,
-    int aStart, int aEnd)
-{
-    HDEBUG(aStart << aEnd);
-    searchModel(aStart, aEnd);
-}
-
-void FoilPicsModelWatch::Private::onModelRowsRemoved(const QModelIndex& aParent,
-    int aStart, int aEnd)
+void FoilPicsModelWatch::Private::onKeysChanged()
 {
-    HDEBUG(aStart << aEnd);
-    if (iIndex >= aStart) {
-        searchModel(aStart, iModel->rowCount() - 1);
-    }
-}
-
-void FoilPicsModelWatch::Private::onModelRowsMoved(const QModelIndex& aSourceParent,
-    int aSourceStart, int aSourceEnd, const QModelIndex& aDestParent, int aDest)
-{
-    HDEBUG(aSourceStart << aSourceEnd << "->" << aDest);
-    searchModel(qMin(aSourceStart, aDest),
-        qMax(aSourceEnd, aDest + aSourceEnd - aSourceStart));
+    searchModel();
 }
 
 void FoilPicsModelWatch::Private::onModelDataChanged(const QModelIndex& aTopLeft,
@@ -292,8 +250,9 @@ void FoilPicsModelWatch::Private::onModelDataChanged(const QModelIndex& aTopLeft
     const int top = aTopLeft.row();
     const int bottom = aBottomRight.row();
     HDEBUG(top << bottom);
-    if (iIndex < 0 || (iIndex >= top && iIndex <= bottom)) {
-        searchModel(top, bottom);
+    // Key changes come from the index, only the value matters here
+    if (iIndex >= top && iIndex <= bottom) {
+        updateWatchValue();
     }
 }
 
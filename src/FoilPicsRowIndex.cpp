@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsRowIndex.h"
+
+#include "HarbourDebug.h"
+
+#include <QHash>
+
+// ==========================================================================
+// FoilPicsRowIndex::Private
+//
+// Implicit treap, i.e. a randomized binary search tree where the position
+// of the node is determined by the sizes of the subtrees rather than by
+// the key. Each node also keeps the number of flagged keys in its subtree,
+// which allows to skip the parts of the tree that have nothing of interest
+// when collecting selected rows. A key with several rows is only counted
+// once, at its primary (first inserted) node.
+// ==========================================================================
+
+class FoilPicsRowIndex::Private {
+public:
+    class Entry;
+    class Node {
+    public:
+        Node(Entry* aEntry, quint32 aPriority);
+
+        Node* iLeft;
+        Node* iRight;
+        Node* iParent;
+        Entry* iEntry;
+        quint32 iPriority;
+        int iSize;
+        int iFlagged[FlagCount];
+    };
+
+    class Entry {
+    public:
+        Entry(QString aKey) : iKey(aKey), iFlags(0) {}
+
+        bool primary(const Node* aNode) const
+            { return iNodes.first() == aNode; }
+
+        QString iKey;
+        QList<Node*> iNodes;  // The first one is the primary node
+        uint iFlags;
+    };
+
+    Private();
+    ~Private();
+
+    static int size(const Node* aNode)
+        { return aNode ? aNode->iSize : 0; }
+    static int flagged(const Node* aNode, int aFlag)
+        { return aNode ? aNode->iFlagged[aFlag] : 0; }
+    static bool counts(const Node* aNode, int aFlag);
+    static void update(Node* aNode);
+    static void updatePath(Node* aNode);
+    static void updateTree(Node* aNode);
+    static Node* merge(Node* aLeft, Node* aRight);
+    static void splitTree(Node* aNode, int aCount, Node** aLeft, Node** aRight);
+    static void split(Node* aNode, int aCount, Node** aLeft, Node** aRight);
+    static void deleteTree(Node* aNode);
+    static int rowOf(const Node* aNode);
+    static void collectNodes(Node* aNode, QList<Node*>* aNodes);
+    static void collectRows(const Node* aNode, int aOffset, int aFlag,
+        QList<int>* aRows);
+    static void collectKeys(const Node* aNode, int aFlag, QStringList* aKeys);
+
+    quint32 nextPriority();
+    Node* nodeAt(int aRow) const;
+    void setRoot(Node* aRoot);
+    void clear();
+
+public:
+    Node* iRoot;
+    QHash<QString,Entry*> iEntries;
+    quint32 iSeed;
+};
+
+FoilPicsRowIndex::Private::Node::Node(Entry* aEntry, quint32 aPriority) :
+    iLeft(NULL),
+    iRight(NULL),
+    iParent(NULL),
+    iEntry(aEntry),
+    iPriority(aPriority),
+    iSize(1)
+{
+    for (int f = 0; f < FlagCount; f++) {
+        iFlagged[f] = 0;
+    }
+}
+
+FoilPicsRowIndex::Private::Private() :
+    iRoot(NULL),
+    iSeed(0x2545f491)
+{
+}
+
+FoilPicsRowIndex::Private::~Private()
+{
+    clear();
+}
+
+void FoilPicsRowIndex::Private::clear()
+{
+    deleteTree(iRoot);
+    iRoot = NULL;
+    qDeleteAll(iEntries);
+    iEntries.clear();
+}
+
+quint32 FoilPicsRowIndex::Private::nextPriority()
+{
+    // xorshift32
+    iSeed ^= iSeed << 13;
+    iSeed ^= iSeed >> 17;
+    iSeed ^= iSeed << 5;
+    return iSeed;
+}
+
+bool FoilPicsRowIndex::Private::counts(const Node* aNode, int aFlag)
+{
+    const Entry* entry = aNode->iEntry;
+    return entry && (entry->iFlags & (1u << aFlag)) && entry->primary(aNode);
+}
+
+void FoilPicsRowIndex::Private::update(Node* aNode)
+{
+    Node* left = aNode->iLeft;
+    Node* right = aNode->iRight;
+    aNode->iSize = 1 + size(left) + size(right);
+    for (int f = 0; f < FlagCount; f++) {
+        aNode->iFlagged[f] = (counts(aNode, f) ? 1 : 0) +
+            flagged(left, f) + flagged(right, f);
+    }
+    if (left) {
+        left->iParent = aNode;
+    }
+    if (right) {
+        right->iParent = aNode;
+    }
+}
+
+void FoilPicsRowIndex::Private::updatePath(Node* aNode)
+{
+    for (Node* node = aNode; node; node = node->iParent) {
+        update(node);
+    }
+}
+
+void FoilPicsRowIndex::Private::updateTree(Node* aNode)
+{
+    if (aNode) {
+        updateTree(aNode->iLeft);
+        updateTree(aNode->iRight);
+        update(aNode);
+    }
+}
+
+FoilPicsRowIndex::Private::Node* FoilPicsRowIndex::Private::merge(Node* aLeft,
+    Node* aRight)
+{
+    if (!aLeft) {
+        return aRight;
+    } else if (!aRight) {
+        return aLeft;
+    } else if (aLeft->iPriority > aRight->iPriority) {
+        aLeft->iRight = merge(aLeft->iRight, aRight);
+        update(aLeft);
+        return aLeft;
+    } else {
+        aRight->iLeft = merge(aLeft, aRight->iLeft);
+        update(aRight);
+        return aRight;
+    }
+}
+
+void FoilPicsRowIndex::Private::splitTree(Node* aNode, int aCount,
+    Node** aLeft, Node** aRight)
+{
+    if (!aNode) {
+        *aLeft = *aRight = NULL;
+    } else if (size(aNode->iLeft) >= aCount) {
+        splitTree(aNode->iLeft, aCount, aLeft, &aNode->iLeft);
+        *aRight = aNode;
+        update(aNode);
+    } else {
+        splitTree(aNode->iRight, aCount - size(aNode->iLeft) - 1,
+            &aNode->iRight, aRight);
+        *aLeft = aNode;
+        update(aNode);
+    }
+}
+
+// Splits the tree into the first aCount rows and the rest
+void FoilPicsRowIndex::Private::split(Node* aNode, int aCount,
+    Node** aLeft, Node** aRight)
+{
+    splitTree(aNode, aCount, aLeft, aRight);
+    if (*aLeft) {
+        (*aLeft)->iParent = NULL;
+    }
+    if (*aRight) {
+        (*aRight)->iParent = NULL;
+    }
+}
+
+void FoilPicsRowIndex::Private::setRoot(Node* aRoot)
+{
+    iRoot = aRoot;
+    if (iRoot) {
+        iRoot->iParent = NULL;
+    }
+}
+
+void FoilPicsRowIndex::Private::deleteTree(Node* aNode)
+{
+    if (aNode) {
+        deleteTree(aNode->iLeft);
+        deleteTree(aNode->iRight);
+        delete aNode;
+    }
+}
+
+int FoilPicsRowIndex::Private::rowOf(const Node* aNode)
+{
+    int row = size(aNode->iLeft);
+    for (const Node* node = aNode; node->iParent; node = node->iParent) {
+        const Node* parent = node->iParent;
+        if (parent->iRight == node) {
+            row += size(parent->iLeft) + 1;
+        }
+    }
+    return row;
+}
+
+FoilPicsRowIndex::Private::Node* FoilPicsRowIndex::Private::nodeAt(int aRow) const
+{
+    Node* node = iRoot;
+    int row = aRow;
+    while (node) {
+        const int leftSize = size(node->iLeft);
+        if (row < leftSize) {
+            node = node->iLeft;
+        } else if (row == leftSize) {
+            return node;
+        } else {
+            row -= leftSize + 1;
+            node = node->iRight;
+        }
+    }
+    return NULL;
+}
+
+void FoilPicsRowIndex::Private::collectNodes(Node* aNode, QList<Node*>* aNodes)
+{
+    if (aNode) {
+        collectNodes(aNode->iLeft, aNodes);
+        aNodes->append(aNode);
+        collectNodes(aNode->iRight, aNodes);
+    }
+}
+
+void FoilPicsRowIndex::Private::collectRows(const Node* aNode, int aOffset,
+    int aFlag, QList<int>* aRows)
+{
+    if (flagged(aNode, aFlag)) {
+        const int row = aOffset + size(aNode->iLeft);
+        collectRows(aNode->iLeft, aOffset, aFlag, aRows);
+        if (counts(aNode, aFlag)) {
+            aRows->append(row);
+        }
+        collectRows(aNode->iRight, row + 1, aFlag, aRows);
+    }
+}
+
+void FoilPicsRowIndex::Private::collectKeys(const Node* aNode, int aFlag,
+    QStringList* aKeys)
+{
+    if (flagged(aNode, aFlag)) {
+        collectKeys(aNode->iLeft, aFlag, aKeys);
+        if (counts(aNode, aFlag)) {
+            aKeys->append(aNode->iEntry->iKey);
+        }
+        collectKeys(aNode->iRight, aFlag, aKeys);
+    }
+}
+
+// ==========================================================================
+// FoilPicsRowIndex
+// ==========================================================================
+
+FoilPicsRowIndex::FoilPicsRowIndex() :
+    iPrivate(new Private)
+{
+}
+
+FoilPicsRowIndex::~FoilPicsRowIndex()
+{
+    delete iPrivate;
+}
+
+int FoilPicsRowIndex::count() const
+{
+    return Private::size(iPrivate->iRoot);
+}
+
+void FoilPicsRowIndex::clear()
+{
+    iPrivate->clear();
+}
+
+void FoilPicsRowIndex::insert(int aRow, QString aKey)
+{
+    Private::Entry* entry = NULL;
+    if (!aKey.isEmpty()) {
+        entry = iPrivate->iEntries.value(aKey);
+        if (!entry) {
+            entry = new Private::Entry(aKey);
+            iPrivate->iEntries.insert(aKey, entry);
+        }
+    }
+    Private::Node* node = new Private::Node(entry, iPrivate->nextPriority());
+    if (entry) {
+        entry->iNodes.append(node);
+        Private::update(node);
+    }
+    Private::Node* left;
+    Private::Node* right;
+    Private::split(iPrivate->iRoot, qBound(0, aRow, count()), &left, &right);
+    iPrivate->setRoot(Private::merge(Private::merge(left, node), right));
+}
+
+// Removes rows [aFirst, aLast] and returns the keys which no longer have
+// any rows, optionally along with the flags those keys had. Unless
+// aKeepDuplicates is true, the keys of the removed rows are dropped even
+// if they still have other rows, which remain in place without a key.
+QStringList FoilPicsRowIndex::remove(int aFirst, int aLast, QList<uint>* aFlags,
+    bool aKeepDuplicates)
+{
+    QStringList gone;
+    const int first = qMax(aFirst, 0);
+    const int last = qMin(aLast, count() - 1);
+    if (first <= last) {
+        Private::Node* left;
+        Private::Node* rest;
+        Private::Node* removed;
+        Private::Node* right;
+        Private::split(iPrivate->iRoot, first, &left, &rest);
+        Private::split(rest, last - first + 1, &removed, &right);
+        iPrivate->setRoot(Private::merge(left, right));
+
+        QList<Private::Node*> nodes;
+        Private::collectNodes(removed, &nodes);
+        const int n = nodes.count();
+        for (int i = 0; i < n; i++) {
+            Private::Node* node = nodes.at(i);
+            Private::Entry* entry = node->iEntry;
+            if (entry) {
+                const bool wasPrimary = entry->primary(node);
+                entry->iNodes.removeOne(node);
+                if (!entry->iNodes.isEmpty() && !aKeepDuplicates) {
+                    // Detach the remaining rows (some of which may be
+                    // among the ones being removed)
+                    const QList<Private::Node*> rest(entry->iNodes);
+                    const int k = rest.count();
+                    for (int j = 0; j < k; j++) {
+                        rest.at(j)->iEntry = NULL;
+                    }
+                    if (!wasPrimary && entry->iFlags) {
+                        Private::updatePath(rest.first());
+                    }
+                    entry->iNodes.clear();
+                }
+                if (entry->iNodes.isEmpty()) {
+                    gone.append(entry->iKey);
+                    if (aFlags) {
+                        aFlags->append(entry->iFlags);
+                    }
+                    iPrivate->iEntries.remove(entry->iKey);
+                    delete entry;
+                } else if (wasPrimary && entry->iFlags) {
+                    // Another row now carries the flags of this key
+                    Private::updatePath(entry->iNodes.first());
+                }
+            }
+        }
+        Private::deleteTree(removed);
+    }
+    return gone;
+}
+
+// Same semantics as QAbstractItemModel::rowsMoved, i.e. aDest is the
+// row in front of which the rows [aFirst, aLast] were inserted, counting
+// from before the move.
+void FoilPicsRowIndex::move(int aFirst, int aLast, int aDest)
+{
+    const int k = aLast - aFirst + 1;
+    if (k > 0 && aFirst >= 0 && aLast < count() &&
+        (aDest < aFirst || aDest > aLast + 1)) {
+        Private::Node* left;
+        Private::Node* rest;
+        Private::Node* moved;
+        Private::Node* right;
+        Private::split(iPrivate->iRoot, aFirst, &left, &rest);
+        Private::split(rest, k, &moved, &right);
+        Private::split(Private::merge(left, right), (aDest > aLast) ? (aDest - k) : aDest,
+            &left, &right);
+        iPrivate->setRoot(Private::merge(Private::merge(left, moved), right));
+    }
+}
+
+// Assigns new keys to the rows (which must be in ascending order) and
+// returns the keys that are gone, same as remove() does. All the new keys
+// are added before dropping the old ones, in case if the keys have been
+// shuffled between the rows.
+QStringList FoilPicsRowIndex::replace(QList<int> aRows, QStringList aKeys,
+    QList<uint>* aFlags)
+{
+    QStringList gone;
+    const int n = aRows.count();
+    HASSERT(aKeys.count() == n);
+    // Going backwards keeps the rows not processed yet in place
+    for (int j = n - 1; j >= 0; j--) {
+        insert(aRows.at(j) + 1, aKeys.at(j));
+    }
+    // The old key of aRows[j] is now at aRows[j] + j
+    for (int j = n - 1; j >= 0; j--) {
+        const int pos = aRows.at(j) + j;
+        gone.append(remove(pos, pos, aFlags));
+    }
+    return gone;
+}
+
+bool FoilPicsRowIndex::contains(QString aKey) const
+{
+    return iPrivate->iEntries.contains(aKey);
+}
+
+QString FoilPicsRowIndex::keyAt(int aRow) const
+{
+    const Private::Node* node = iPrivate->nodeAt(aRow);
+    return (node && node->iEntry) ? node->iEntry->iKey : QString();
+}
+
+// The first row with this key, or -1 if there's none
+int FoilPicsRowIndex::rowOf(QString aKey) const
+{
+    int row = -1;
+    const Private::Entry* entry = iPrivate->iEntries.value(aKey);
+    if (entry) {
+        // The primary node isn't necessarily the first one
+        const int n = entry->iNodes.count();
+        for (int i = 0; i < n; i++) {
+            const int pos = Private::rowOf(entry->iNodes.at(i));
+            if (row < 0 || pos < row) {
+                row = pos;
+            }
+        }
+    }
+    return row;
+}
+
+bool FoilPicsRowIndex::flag(QString aKey, Flag aFlag) const
+{
+    const Private::Entry* entry = iPrivate->iEntries.value(aKey);
+    return entry && (entry->iFlags & (1u << aFlag));
+}
+
+// Returns true if the flag has actually changed
+bool FoilPicsRowIndex::setFlag(QString aKey, Flag aFlag, bool aValue)
+{
+    Private::Entry* entry = iPrivate->iEntries.value(aKey);
+    if (entry) {
+        const uint bit = (1u << aFlag);
+        if (((entry->iFlags & bit) != 0) != aValue) {
+            if (aValue) {
+                entry->iFlags |= bit;
+            } else {
+                entry->iFlags &= ~bit;
+            }
+            Private::updatePath(entry->iNodes.first());
+            return true;
+        }
+    }
+    return false;
+}
+
+int FoilPicsRowIndex::flagCount(Flag aFlag) const
+{
+    return Private::flagged(iPrivate->iRoot, aFlag);
+}
+
+// Primary rows of the flagged keys, in ascending order
+QList<int> FoilPicsRowIndex::flaggedRows(Flag aFlag) const
+{
+    QList<int> rows;
+    rows.reserve(flagCount(aFlag));
+    Private::collectRows(iPrivate->iRoot, 0, aFlag, &rows);
+    return rows;
+}
+
+QStringList FoilPicsRowIndex::flaggedKeys(Flag aFlag) const
+{
+    QStringList keys;
+    keys.reserve(flagCount(aFlag));
+    Private::collectKeys(iPrivate->iRoot, aFlag, &keys);
+    return keys;
+}
+
+// Returns the keys which didn't have the flag set
+QStringList FoilPicsRowIndex::setFlagForAll(Flag aFlag)
+{
+    QStringList changed;
+    const uint bit = (1u << aFlag);
+    QHashIterator<QString,Private::Entry*> it(iPrivate->iEntries);
+    while (it.hasNext()) {
+        Private::Entry* entry = it.next().value();
+        if (!(entry->iFlags & bit)) {
+            entry->iFlags |= bit;
+            changed.append(entry->iKey);
+        }
+    }
+    if (!changed.isEmpty()) {
+        // Cheaper than updating the path for each key
+        Private::updateTree(iPrivate->iRoot);
+    }
+    return changed;
+}
+
+// Returns the keys which had the flag set
+QStringList FoilPicsRowIndex::clearFlag(Flag aFlag)
+{
+    const QStringList keys(flaggedKeys(aFlag));
+    const int n = keys.count();
+    const uint bit = (1u << aFlag);
+    for (int i = 0; i < n; i++) {
+        Private::Entry* entry = iPrivate->iEntries.value(keys.at(i));
+        entry->iFlags &= ~bit;
+        Private::updatePath(entry->iNodes.first());
+    }
+    return keys;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_ROW_INDEX_H
+#define FOILPICS_ROW_INDEX_H
+
+#include <QStringList>
+
+// Keeps track of the keys associated with the rows of a list model,
+// along with per-key flags. Rows are stored in a balanced tree ordered
+// by position, so inserting, removing and moving rows costs O(log n)
+// regardless of the number of rows that follow, and so does finding
+// the row of a key. Several rows may have the same key, the flags
+// belong to the key. Rows with empty keys are kept but not indexed.
+class FoilPicsRowIndex {
+public:
+    enum Flag {
+        Selected,
+        Busy,
+        FlagCount
+    };
+
+    FoilPicsRowIndex();
+    ~FoilPicsRowIndex();
+
+    int count() const;
+    void clear();
+    void insert(int aRow, QString aKey);
+    QStringList remove(int aFirst, int aLast, QList<uint>* aFlags = NULL,
+        bool aKeepDuplicates = true);
+    void move(int aFirst, int aLast, int aDest);
+    QStringList replace(QList<int> aRows, QStringList aKeys,
+        QList<uint>* aFlags = NULL);
+
+    bool contains(QString aKey) const;
+    QString keyAt(int aRow) const;
+    int rowOf(QString aKey) const;
+
+    bool flag(QString aKey, Flag aFlag) const;
+    bool setFlag(QString aKey, Flag aFlag, bool aValue);
+    int flagCount(Flag aFlag) const;
+    QList<int> flaggedRows(Flag aFlag) const;
+    QStringList flaggedKeys(Flag aFlag) const;
+    QStringList setFlagForAll(Flag aFlag);
+    QStringList clearFlag(Flag aFlag);
+
+private:
+    Q_DISABLE_COPY(FoilPicsRowIndex)
+    class Private;
+    Private* iPrivate;
+};
+
+#endif // FOILPICS_ROW_INDEX_H
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsSegmentStore.h"
+
+#include "HarbourDebug.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSet>
+
+#include <string.h>
+#include <unistd.h>
+
+// Segment files are hidden so that they don't show up as pictures
+#define SEGMENT_PREFIX      ".segment-"
+#define SEGMENT_MAGIC       "FoilSeg1"
+#define SEGMENT_MAGIC_SIZE  (8)
+#define SEGMENT_MAX_SIZE    (16*1024*1024)
+#define RECORD_HEADER_SIZE  (4)
+
+// ==========================================================================
+// FoilPicsSegmentStore::Private
+// ==========================================================================
+
+class FoilPicsSegmentStore::Private {
+public:
+    class Ref {
+    public:
+        Ref(QString aRef);
+
+        bool isValid() const { return iLength > 0; }
+
+        QString iSegment;
+        qint64 iOffset;
+        qint64 iLength;
+    };
+
+    static QMutex gMutex;
+    static QHash<QString,int> gActive;   // Dir => active segment number
+    static QSet<QString> gTouched;       // Appended to by this process
+
+    static QString segmentName(int aNumber);
+    static int segmentNumber(QString aName);
+    static QString makeRef(QString aSegment, qint64 aOffset, qint64 aLength);
+    static QStringList segments(QString aDir);
+    static int activeSegment(QString aDir);
+    static QString appendLocked(QString aDir, QByteArray aRecord);
+    static QByteArray readLocked(QString aDir, const Ref& aRef);
+};
+
+QMutex FoilPicsSegmentStore::Private::gMutex;
+QHash<QString,int> FoilPicsSegmentStore::Private::gActive;
+QSet<QString> FoilPicsSegmentStore::Private::gTouched;
+
+FoilPicsSegmentStore::Private::Ref::Ref(QString aRef) :
+    iOffset(0),
+    iLength(0)
+{
+    // segment@offset+length
+    const int at = aRef.lastIndexOf('@');
+    const int plus = aRef.lastIndexOf('+');
+    if (at > 0 && plus > at) {
+        bool ok1 = false, ok2 = false;
+        const qint64 offset = aRef.mid(at + 1, plus - at - 1).toLongLong(&ok1);
+        const qint64 length = aRef.mid(plus + 1).toLongLong(&ok2);
+        if (ok1 && ok2 && offset >= SEGMENT_MAGIC_SIZE && length > 0) {
+            iSegment = aRef.left(at);
+            iOffset = offset;
+            iLength = length;
+        }
+    }
+}
+
+QString FoilPicsSegmentStore::Private::segmentName(int aNumber)
+{
+    return QString().sprintf(SEGMENT_PREFIX "%04d", aNumber);
+}
+
+int FoilPicsSegmentStore::Private::segmentNumber(QString aName)
+{
+    bool ok = false;
+    const int n = aName.mid(strlen(SEGMENT_PREFIX)).toInt(&ok);
+    return ok ? n : -1;
+}
+
+QString FoilPicsSegmentStore::Private::makeRef(QString aSegment,
+    qint64 aOffset, qint64 aLength)
+{
+    return aSegment + QString().sprintf("@%lld+%lld",
+        (long long)aOffset, (long long)aLength);
+}
+
+QStringList FoilPicsSegmentStore::Private::segments(QString aDir)
+{
+    return QDir(aDir).entryList(QStringList(SEGMENT_PREFIX "*"),
+        QDir::Files | QDir::Hidden, QDir::Name);
+}
+
+int FoilPicsSegmentStore::Private::activeSegment(QString aDir)
+{
+    if (!gActive.contains(aDir)) {
+        // The last one is the active one
+        int last = 0;
+        const QStringList names(segments(aDir));
+        for (int i = 0; i < names.count(); i++) {
+            last = qMax(last, segmentNumber(names.at(i)));
+        }
+        gActive.insert(aDir, last);
+    }
+    return gActive.value(aDir);
+}
+
+QString FoilPicsSegmentStore::Private::appendLocked(QString aDir,
+    QByteArray aRecord)
+{
+    const qint64 size = aRecord.size();
+    int number = activeSegment(aDir);
+    QString name(segmentName(number));
+    QString path(QDir(aDir).filePath(name));
+    QFileInfo info(path);
+    if (info.exists() && info.size() + RECORD_HEADER_SIZE + size >
+        SEGMENT_MAX_SIZE && info.size() > SEGMENT_MAGIC_SIZE) {
+        // Start a new segment
+        gActive.insert(aDir, ++number);
+        name = segmentName(number);
+        path = QDir(aDir).filePath(name);
+    }
+
+    QFile file(path);
+    if (file.open(QIODevice::ReadWrite)) {
+        qint64 offset = file.size();
+        bool ok = true;
+        if (offset < SEGMENT_MAGIC_SIZE) {
+            // New (or truncated) segment
+            ok = file.resize(0) && file.write(SEGMENT_MAGIC,
+                SEGMENT_MAGIC_SIZE) == SEGMENT_MAGIC_SIZE;
+            offset = SEGMENT_MAGIC_SIZE;
+        }
+        if (ok && file.seek(offset)) {
+            uchar header[RECORD_HEADER_SIZE];
+            header[0] = (uchar)(size >> 24);
+            header[1] = (uchar)(size >> 16);
+            header[2] = (uchar)(size >> 8);
+            header[3] = (uchar)size;
+            if (file.write((char*)header, RECORD_HEADER_SIZE) ==
+                RECORD_HEADER_SIZE && file.write(aRecord) == size &&
+                file.flush() && fsync(file.handle()) == 0) {
+                gTouched.insert(path);
+                HDEBUG("Appended" << size << "bytes to" << qPrintable(name));
+                return makeRef(name, offset, size);
+            }
+            // Don't leave a partial record behind
+            file.resize(offset);
+        }
+        HWARN("Failed to write" << qPrintable(path));
+    } else {
+        HWARN("Failed to open" << qPrintable(path));
+    }
+    return QString();
+}
+
+QByteArray FoilPicsSegmentStore::Private::readLocked(QString aDir,
+    const Ref& aRef)
+{
+    if (aRef.isValid()) {
+        QFile file(QDir(aDir).filePath(aRef.iSegment));
+        if (file.open(QIODevice::ReadOnly) && file.seek(aRef.iOffset)) {
+            const QByteArray header(file.read(RECORD_HEADER_SIZE));
+            if (header.size() == RECORD_HEADER_SIZE) {
+                const uchar* h = (const uchar*)header.constData();
+                const qint64 size = ((qint64)h[0] << 24) |
+                    ((qint64)h[1] << 16) | ((qint64)h[2] << 8) | h[3];
+                if (size == aRef.iLength) {
+                    const QByteArray data(file.read(size));
+                    if (data.size() == size) {
+                        return data;
+                    }
+                }
+            }
+        }
+        HWARN("Failed to read" << qPrintable(aRef.iSegment) << aRef.iOffset);
+    }
+    return QByteArray();
+}
+
+// ==========================================================================
+// FoilPicsSegmentStore
+// ==========================================================================
+
+bool FoilPicsSegmentStore::isRef(QString aName)
+{
+    return aName.startsWith(QLatin1String(SEGMENT_PREFIX)) &&
+        aName.contains('@');
+}
+
+QString FoilPicsSegmentStore::append(QString aDir, QByteArray aRecord)
+{
+    QMutexLocker lock(&Private::gMutex);
+    return Private::appendLocked(aDir, aRecord);
+}
+
+QByteArray FoilPicsSegmentStore::read(QString aDir, QString aRef)
+{
+    // Records are never modified in place, and segments are only deleted
+    // when nothing refers to them, so reading doesn't need the lock.
+    return Private::readLocked(aDir, Private::Ref(aRef));
+}
+
+// Copies the live records out of the segments which are more than half
+// garbage. The caller is expected to switch to the new refs and save the
+// catalog. aSavedRefs are the refs in the catalog as it's been committed
+// to disk. A segment is only deleted (and only if aDelete is true) when
+// neither of the two lists refers to it, so the segments left without
+// live records by this run are deleted on the next one, once the saved
+// catalog no longer refers to them. The active segment and the segments
+// written to by this process are left alone, since there may be records
+// in there which aren't in aLiveRefs yet.
+FoilPicsSegmentStore::Remap FoilPicsSegmentStore::compact(QString aDir,
+    QStringList aLiveRefs, QStringList aSavedRefs, bool aDelete)
+{
+    Remap remap;
+    QMutexLocker lock(&Private::gMutex);
+    const QString active(Private::segmentName(Private::activeSegment(aDir)));
+
+    // Group the live records by segment
+    QHash<QString,QStringList> live;
+    QHash<QString,qint64> liveBytes;
+    const int n = aLiveRefs.count();
+    for (int i = 0; i < n; i++) {
+        const QString ref(aLiveRefs.at(i));
+        const Private::Ref r(ref);
+        if (r.isValid()) {
+            live[r.iSegment].append(ref);
+            liveBytes[r.iSegment] += RECORD_HEADER_SIZE + r.iLength;
+        }
+    }
+
+    // Segments still referred to by the saved catalog
+    QSet<QString> saved;
+    const int k = aSavedRefs.count();
+    for (int i = 0; i < k; i++) {
+        const Private::Ref r(aSavedRefs.at(i));
+        if (r.isValid()) {
+            saved.insert(r.iSegment);
+        }
+    }
+
+    const QDir dir(aDir);
+    const QStringList names(Private::segments(aDir));
+    for (int i = 0; i < names.count(); i++) {
+        const QString name(names.at(i));
+        const QString path(dir.filePath(name));
+        if (name != active && !Private::gTouched.contains(path)) {
+            const qint64 used = liveBytes.value(name);
+            const qint64 total = QFileInfo(path).size() - SEGMENT_MAGIC_SIZE;
+            if (!used) {
+                if (aDelete && !saved.contains(name)) {
+                    HDEBUG("Deleting" << qPrintable(name));
+                    if (!QFile::remove(path)) {
+                        HWARN("Failed to delete" << qPrintable(path));
+                    }
+                }
+            } else if (used * 2 < total) {
+                HDEBUG("Compacting" << qPrintable(name) << used << "/" <<
+                    total);
+                const QStringList refs(live.value(name));
+                for (int k = 0; k < refs.count(); k++) {
+                    const QString ref(refs.at(k));
+                    const QByteArray data(Private::readLocked(aDir,
+                        Private::Ref(ref)));
+                    if (!data.isEmpty()) {
+                        const QString newRef(Private::appendLocked(aDir, data));
+                        if (!newRef.isEmpty()) {
+                            remap.insert(ref, newRef);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return remap;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_SEGMENT_STORE_H
+#define FOILPICS_SEGMENT_STORE_H
+
+#include <QHash>
+#include <QStringList>
+
+// Append-only storage for small records (encrypted thumbnails), packing
+// many of them into a few large segment files instead of creating a file
+// per record. A record is referred to by "segment@offset+length" string
+// which is stored in the catalog in place of the file name. Records are
+// never modified in place. compact() copies the records still in use out
+// of the mostly unused segments and deletes the segments which are no
+// longer referenced at all, neither by the model nor by the saved catalog.
+class FoilPicsSegmentStore {
+private:
+    FoilPicsSegmentStore();
+    Q_DISABLE_COPY(FoilPicsSegmentStore)
+
+public:
+    typedef QHash<QString,QString> Remap; // Old ref => new ref
+
+    static bool isRef(QString aName);
+    static QString append(QString aDir, QByteArray aRecord);
+    static QByteArray read(QString aDir, QString aRef);
+    static Remap compact(QString aDir, QStringList aLiveRefs,
+        QStringList aSavedRefs, bool aDelete);
+
+private:
+    class Private;
+};
+
+#endif // FOILPICS_SEGMENT_STORE_H
@@ -33,6 +33,7 @@
 
 #include "FoilPicsSelection.h"
 #include "FoilPicsRole.h"
+#include "FoilPicsRowIndex.h"
 #include "HarbourDebug.h"
 
 // ==========================================================================
@@ -45,6 +46,7 @@ class FoilPicsSelection::Private : public QObject {
 public:
     typedef void (FoilPicsSelection::*SignalEmitter)();
     typedef uint SignalMask;
+    typedef QMultiHash<QString,Listener*> Listeners;
 
     // The order of constants must match the array in emitQueuedSignals()
     enum Signal {
@@ -62,10 +64,17 @@ public:
     FoilPicsSelection* parentObject() const;
     void queueSignal(Signal aSignal);
     void emitQueuedSignals();
+    static void notifyAll(const Listeners& aListeners);
+    static void notifyKey(const Listeners& aListeners, QString aKey);
+    static void notifyKeys(const Listeners& aListeners, QStringList aKeys);
+    void emitSelectionChanged(QString aKey);
+    void emitSelectionCleared();
     void emitSelectionChanged(QStringList aChanged);
     void emitBusyChanged(QStringList aChanged);
     QString keyAt(int aIndex);
-    void updateRows(int aFrom);
+    void dropKeys(QStringList aKeys, QList<uint> aFlags,
+        QStringList* aSelectionChanged, QStringList* aBusyChanged);
+    void refreshRows(int aFirst, int aLast);
     void setKeyRole(QString aRole);
     void setModel(QAbstractItemModel* aModel);
     void refreshModelAndEmitSignals();
@@ -86,10 +95,9 @@ public Q_SLOTS:
 public:
     SignalMask iQueuedSignals;
     int iFirstQueuedSignal;
-    QList<QString> iKeyList;
-    QHash<QString,int> iKeys;
-    QSet<QString> iSelected;
-    QSet<QString> iBusy;
+    FoilPicsRowIndex iIndex;
+    Listeners iSelectionListeners;
+    Listeners iBusyListeners;
     QAbstractItemModel* iModel;
     QString iKeyRoleName;
     bool iDuplicatesAllowed;
@@ -153,17 +161,81 @@ void FoilPicsSelection::Private::emitQueuedSignals()
     }
 }
 
+void FoilPicsSelection::Private::notifyAll(const Listeners& aListeners)
+{
+    // Copy the list, listeners may come and go while being notified.
+    // The ones removed in the process (and possibly deleted) must not
+    // be called, hence the check.
+    QList<QPair<QString,Listener*> > listeners;
+    listeners.reserve(aListeners.count());
+    for (Listeners::ConstIterator it = aListeners.constBegin();
+         it != aListeners.constEnd(); ++it) {
+        listeners.append(qMakePair(it.key(), it.value()));
+    }
+    const int n = listeners.count();
+    for (int i = 0; i < n; i++) {
+        const QPair<QString,Listener*>& entry = listeners.at(i);
+        if (aListeners.contains(entry.first, entry.second)) {
+            entry.second->keyStateChanged();
+        }
+    }
+}
+
+void FoilPicsSelection::Private::notifyKey(const Listeners& aListeners,
+    QString aKey)
+{
+    if (aListeners.contains(aKey)) {
+        // Same as above, skip the listeners removed by the previous ones
+        const QList<Listener*> listeners(aListeners.values(aKey));
+        const int n = listeners.count();
+        for (int i = 0; i < n; i++) {
+            Listener* listener = listeners.at(i);
+            if (aListeners.contains(aKey, listener)) {
+                listener->keyStateChanged();
+            }
+        }
+    }
+}
+
+void FoilPicsSelection::Private::notifyKeys(const Listeners& aListeners,
+    QStringList aKeys)
+{
+    const int k = aKeys.count();
+    if (k >= aListeners.count()) {
+        // Everything has changed, e.g. select all. Let every listener
+        // check its own key rather than looking up each changed key.
+        notifyAll(aListeners);
+    } else {
+        for (int j = 0; j < k; j++) {
+            notifyKey(aListeners, aKeys.at(j));
+        }
+    }
+}
+
+void FoilPicsSelection::Private::emitSelectionChanged(QString aKey)
+{
+    Q_EMIT parentObject()->selectionChanged(aKey);
+    notifyKey(iSelectionListeners, aKey);
+}
+
+void FoilPicsSelection::Private::emitSelectionCleared()
+{
+    Q_EMIT parentObject()->selectionCleared();
+    notifyAll(iSelectionListeners);
+}
+
 void FoilPicsSelection::Private::emitSelectionChanged(QStringList aChanged)
 {
     if (!aChanged.isEmpty()) {
-        FoilPicsSelection* obj = parentObject();
-        if (iSelected.isEmpty()) {
-            Q_EMIT obj->selectionCleared();
+        if (!iIndex.flagCount(FoilPicsRowIndex::Selected)) {
+            emitSelectionCleared();
         } else {
+            FoilPicsSelection* obj = parentObject();
             const int k = aChanged.count();
             for (int j = 0; j < k; j++) {
                 Q_EMIT obj->selectionChanged(aChanged.at(j));
             }
+            notifyKeys(iSelectionListeners, aChanged);
         }
     }
 }
@@ -176,6 +248,7 @@ void FoilPicsSelection::Private::emitBusyChanged(QStringList aChanged)
         for (int j = 0; j < k; j++) {
             Q_EMIT obj->busyChanged(aChanged.at(j));
         }
+        notifyKeys(iBusyListeners, aChanged);
     }
 }
 
@@ -190,19 +263,51 @@ QString FoilPicsSelection::Private::keyAt(int aIndex)
     return QString();
 }
 
-void FoilPicsSelection::Private::updateRows(int aFrom)
+void FoilPicsSelection::Private::dropKeys(QStringList aKeys,
+    QList<uint> aFlags, QStringList* aSelectionChanged,
+    QStringList* aBusyChanged)
 {
-    const int n = iModel->rowCount();
-    HASSERT(iKeyList.count() == n);
-    for (int i = aFrom; i < n; i++) {
-        const QString key = iKeyList.at(i);
-        if (!key.isEmpty()) {
-            HDEBUG(key << i);
-            iKeys.insert(key, i);
+    for (int j = aKeys.count() - 1; j >= 0; j--) {
+        const QString key(aKeys.at(j));
+        const uint keyFlags = aFlags.at(j);
+        if (keyFlags & (1u << FoilPicsRowIndex::Selected)) {
+            HDEBUG(key << "was selected");
+            aSelectionChanged->append(key);
+            queueSignal(SignalSelectionCountChanged);
+        }
+        if (keyFlags & (1u << FoilPicsRowIndex::Busy)) {
+            HDEBUG(key << "was busy");
+            aBusyChanged->append(key);
+            queueSignal(SignalBusyCountChanged);
         }
     }
 }
 
+// Re-reads the keys for rows [aFirst, aLast]
+void FoilPicsSelection::Private::refreshRows(int aFirst, int aLast)
+{
+    QList<int> rows;
+    QStringList keys;
+    for (int i = aFirst; i <= aLast; i++) {
+        const QString key(keyAt(i));
+        if (iIndex.keyAt(i) != key) {
+            HDEBUG(i << iIndex.keyAt(i) << "=>" << key);
+            rows.append(i);
+            keys.append(key);
+        }
+    }
+
+    if (!rows.isEmpty()) {
+        QList<uint> flags;
+        const QStringList removed(iIndex.replace(rows, keys, &flags));
+        QStringList selectionChanged, busyChanged;
+        dropKeys(removed, flags, &selectionChanged, &busyChanged);
+        emitSelectionChanged(selectionChanged);
+        emitBusyChanged(busyChanged);
+        emitQueuedSignals();
+    }
+}
+
 void FoilPicsSelection::Private::setKeyRole(QString aRole)
 {
     if (iKeyRoleName != aRole) {
@@ -249,55 +354,46 @@ void FoilPicsSelection::Private::refreshModelAndEmitSignals()
 {
     QStringList selectionChanged;
     QStringList busyChanged;
-    iKeyList.clear();
-    iKeys.clear();
+    const QStringList selected(iIndex.flaggedKeys(FoilPicsRowIndex::Selected));
+    const QStringList busy(iIndex.flaggedKeys(FoilPicsRowIndex::Busy));
+    iIndex.clear();
     iKeyRole = FoilPicsRole::find(iModel, iKeyRoleName);
     if (iKeyRole >= 0) {
         // Collect all available values
         const int n = iModel->rowCount();
         for (int i = 0; i < n; i++) {
-            const QString key(keyAt(i));
-            if (!key.isEmpty()) {
-                iKeyList.append(key);
-                iKeys.insert(key, i);
-            }
+            iIndex.insert(i, keyAt(i));
         }
-        // Remove stale entries
-        const QStringList selected(iSelected.values());
+        // Restore the flags, dropping the stale entries
         const int k = selected.count();
-        for (int j = k - 1; j >= 0; j--) {
+        for (int j = 0; j < k; j++) {
             const QString key(selected.at(j));
-            if (!iKeys.contains(key)) {
+            if (!iIndex.setFlag(key, FoilPicsRowIndex::Selected, true)) {
                 HDEBUG("selected" << key << "is gone");
-                iSelected.remove(key);
                 selectionChanged.append(key);
                 queueSignal(SignalSelectionCountChanged);
             }
         }
-        const QStringList busy(iBusy.values());
         const int m = busy.count();
-        for (int l = m - 1; l >= 0; l--) {
+        for (int l = 0; l < m; l++) {
             const QString key(busy.at(l));
-            if (!iKeys.contains(key)) {
+            if (!iIndex.setFlag(key, FoilPicsRowIndex::Busy, true)) {
                 HDEBUG("busy" << key << "is gone");
-                iBusy.remove(key);
                 busyChanged.append(key);
                 queueSignal(SignalBusyCountChanged);
             }
         }
     } else {
-        if (!iSelected.isEmpty()) {
-            selectionChanged = iSelected.values();
-            iSelected.clear();
+        if (!selected.isEmpty()) {
+            selectionChanged = selected;
             queueSignal(SignalSelectionCountChanged);
         }
-        if (!iBusy.isEmpty()) {
-            busyChanged = iBusy.values();
-            iBusy.clear();
+        if (!busy.isEmpty()) {
+            busyChanged = busy;
             queueSignal(SignalBusyCountChanged);
         }
     }
-    HDEBUG(iKeys);
+    HDEBUG(iIndex.count() << "rows");
     emitSelectionChanged(selectionChanged);
     emitBusyChanged(busyChanged);
     emitQueuedSignals();
@@ -305,52 +401,39 @@ void FoilPicsSelection::Private::refreshModelAndEmitSignals()
 
 void FoilPicsSelection::Private::selectAll()
 {
-    QStringList changed;
-    const int n = iKeyList.count();
-    for (int i = 0; i < n; i++) {
-        const QString key(iKeyList.at(i));
-        if (!iSelected.contains(key)) {
-            iSelected.insert(key);
-            changed.append(key);
-            HDEBUG("+" << key << iSelected.count());
-            queueSignal(SignalSelectionCountChanged);
-        }
+    const QStringList changed(iIndex.setFlagForAll(FoilPicsRowIndex::Selected));
+    if (!changed.isEmpty()) {
+        HDEBUG("+" << changed.count() << iIndex.flagCount(FoilPicsRowIndex::Selected));
+        queueSignal(SignalSelectionCountChanged);
+        emitSelectionChanged(changed);
+        emitQueuedSignals();
     }
-    emitSelectionChanged(changed);
-    emitQueuedSignals();
 }
 
 void FoilPicsSelection::Private::clearSelection()
 {
-    if (!iSelected.isEmpty()) {
-        iSelected.clear();
+    if (!iIndex.clearFlag(FoilPicsRowIndex::Selected).isEmpty()) {
         HDEBUG("");
         queueSignal(SignalSelectionCountChanged);
-        Q_EMIT parentObject()->selectionCleared();
+        emitSelectionCleared();
         emitQueuedSignals();
     }
 }
 
 QList<int> FoilPicsSelection::Private::makeSelectionBusy()
 {
-    QList<int> selection;
-    QStringList changed;
-    const QStringList keys = iSelected.values();
-    const int n = keys.count();
-    if (n > 0) {
-        iBusy.unite(iSelected);
-        iSelected.clear();
-        queueSignal(SignalSelectionCountChanged);
-        queueSignal(SignalBusyCountChanged);
+    const QList<int> selection(iIndex.flaggedRows(FoilPicsRowIndex::Selected));
+    if (!selection.isEmpty()) {
+        const QStringList changed(iIndex.clearFlag(FoilPicsRowIndex::Selected));
+        const int n = changed.count();
         for (int i = 0; i < n; i++) {
-            const QString key(keys.at(i));
-            selection.append(iKeys.value(key));
-            changed.append(key);
+            iIndex.setFlag(changed.at(i), FoilPicsRowIndex::Busy, true);
         }
+        queueSignal(SignalSelectionCountChanged);
+        queueSignal(SignalBusyCountChanged);
         emitSelectionChanged(changed);
         emitBusyChanged(changed);
         emitQueuedSignals();
-        qSort(selection);
         HDEBUG(selection);
     }
     return selection;
@@ -381,24 +464,16 @@ void FoilPicsSelection::Private::onModelRowsInserted(const QModelIndex& aParent,
     } else {
         // Insert the new rows
         for (int i = aStart; i <= aEnd; i++) {
-            const QString key(keyAt(i));
-            iKeyList.insert(i, key);
-            if (!key.isEmpty()) {
-                HDEBUG(key << i);
-                iKeys.insert(key, i);
-            }
+            iIndex.insert(i, keyAt(i));
         }
     }
-
-    // Shift the remaining rows
-    updateRows(aEnd + 1);
 }
 
 void FoilPicsSelection::Private::onModelRowsMoved(const QModelIndex& aSourceParent,
     int aSourceStart, int aSourceEnd, const QModelIndex& aDestParent, int aDest)
 {
     HDEBUG(aSourceStart << aSourceEnd << "->" << aDest);
-    updateRows(qMin(aSourceStart, aDest));
+    iIndex.move(aSourceStart, aSourceEnd, aDest);
     HASSERT(!iQueuedSignals); // No signals are expected
 }
 
@@ -406,57 +481,16 @@ void FoilPicsSelection::Private::onModelRowsRemoved(const QModelIndex& aParent,
     int aStart, int aEnd)
 {
     HDEBUG(aStart << aEnd);
-    HASSERT(aEnd < iKeyList.count());
-
-    // Create the full list of removed keys
-    QStringList removed;
-    for (int i = qMin(aEnd, iKeyList.count() - 1); i >= aStart; i--) {
-        const QString key(iKeyList.takeAt(i));
-        HDEBUG(key << i);
-        if (!removed.contains(key)) {
-            removed.append(key);
-        }
-    }
-
-    if (iDuplicatesAllowed) {
-        // The case of DocumentGalleryModel. It adds duplicates and then
-        // removes it, meaning that if the entry is removed it doesn't
-        // necessarily mean that the key is no longer valid. We have to
-        // check if they are still there or not. That's bad.
-        for (int j = removed.count() - 1; j >= 0; j--) {
-            const QString key(removed.at(j));
-            const int pos = iKeyList.indexOf(key);
-            if (pos >= 0) {
-                // Update the index
-                HDEBUG(key << "is still there at" << pos);
-                HDEBUG(iKeyList);
-                removed.removeAt(j);
-                iKeys.insert(key, pos);
-            }
-        }
-    }
-
-    // Remove the stale rows from the map
+    HASSERT(aEnd < iIndex.count());
+
+    // If duplicates are allowed, only the keys that have no rows left are
+    // actually gone. That matters for DocumentGalleryModel which adds
+    // duplicates and then removes them.
+    QList<uint> flags;
+    const QStringList removed(iIndex.remove(aStart, aEnd, &flags,
+        iDuplicatesAllowed));
     QStringList selectionChanged, busyChanged;
-    for (int j = removed.count() - 1; j >= 0; j--) {
-        const QString key(removed.at(j));
-        iKeys.remove(key);
-        if (iSelected.contains(key)) {
-            HDEBUG(key << "was selected");
-            iSelected.remove(key);
-            selectionChanged.append(key);
-            queueSignal(SignalSelectionCountChanged);
-        }
-        if (iBusy.contains(key)) {
-            HDEBUG(key << "was busy");
-            iBusy.remove(key);
-            busyChanged.append(key);
-            queueSignal(SignalBusyCountChanged);
-        }
-    }
-
-    // Shift the affected rows and emit the events
-    updateRows(aStart);
+    dropKeys(removed, flags, &selectionChanged, &busyChanged);
     emitSelectionChanged(selectionChanged);
     emitBusyChanged(busyChanged);
     emitQueuedSignals();
@@ -465,9 +499,15 @@ void FoilPicsSelection::Private::onModelRowsRemoved(const QModelIndex& aParent,
 void FoilPicsSelection::Private::onModelDataChanged(const QModelIndex& aTopLeft,
     const QModelIndex& aBottomRight, const QVector<int>& aRoles)
 {
-    // This happens very rarely, if ever
     HDEBUG(aTopLeft.row() << aBottomRight.row() << aRoles);
-    refreshModelAndEmitSignals();
+    if (iKeyRole < 0) {
+        // The key role may have shown up
+        refreshModelAndEmitSignals();
+    } else if (aRoles.isEmpty() || aRoles.contains(iKeyRole)) {
+        HASSERT(iIndex.count() == iModel->rowCount());
+        refreshRows(qMax(aTopLeft.row(), 0),
+            qMin(aBottomRight.row(), iIndex.count() - 1));
+    }
 }
 
 // ==========================================================================
@@ -488,12 +528,12 @@ FoilPicsSelection::~FoilPicsSelection()
 
 int FoilPicsSelection::selectionCount() const
 {
-    return iPrivate->iSelected.count();
+    return iPrivate->iIndex.flagCount(FoilPicsRowIndex::Selected);
 }
 
 int FoilPicsSelection::busyCount() const
 {
-    return iPrivate->iBusy.count();
+    return iPrivate->iIndex.flagCount(FoilPicsRowIndex::Busy);
 }
 
 QAbstractItemModel* FoilPicsSelection::model() const
@@ -532,36 +572,36 @@ void FoilPicsSelection::setDuplicatesAllowed(bool aValue)
 
 bool FoilPicsSelection::busy(QString aValue) const
 {
-    return iPrivate->iBusy.contains(aValue);
+    return iPrivate->iIndex.flag(aValue, FoilPicsRowIndex::Busy);
 }
 
 bool FoilPicsSelection::selected(QString aValue) const
 {
-    return iPrivate->iSelected.contains(aValue);
+    return iPrivate->iIndex.flag(aValue, FoilPicsRowIndex::Selected);
 }
 
 void FoilPicsSelection::select(QString aValue)
 {
-    if (iPrivate->iKeys.contains(aValue) &&
-        !iPrivate->iSelected.contains(aValue) &&
-        !iPrivate->iBusy.contains(aValue)) {
-        iPrivate->iSelected.insert(aValue);
+    FoilPicsRowIndex* index = &iPrivate->iIndex;
+    if (index->contains(aValue) &&
+        !index->flag(aValue, FoilPicsRowIndex::Busy) &&
+        index->setFlag(aValue, FoilPicsRowIndex::Selected, true)) {
         HDEBUG("+" << aValue << selectionCount());
-        Q_EMIT selectionChanged(aValue);
+        iPrivate->emitSelectionChanged(aValue);
         Q_EMIT selectionCountChanged();
     } else {
         HDEBUG(aValue << "is not selectable:" <<
-            iPrivate->iKeys.contains(aValue) <<
-            iPrivate->iSelected.contains(aValue) <<
-            iPrivate->iBusy.contains(aValue));
+            index->contains(aValue) <<
+            index->flag(aValue, FoilPicsRowIndex::Selected) <<
+            index->flag(aValue, FoilPicsRowIndex::Busy));
     }
 }
 
 void FoilPicsSelection::unselect(QString aValue)
 {
-    if (iPrivate->iSelected.remove(aValue)) {
+    if (iPrivate->iIndex.setFlag(aValue, FoilPicsRowIndex::Selected, false)) {
         HDEBUG("-" << aValue << selectionCount());
-        Q_EMIT selectionChanged(aValue);
+        iPrivate->emitSelectionChanged(aValue);
         Q_EMIT selectionCountChanged();
     } else {
         HDEBUG(aValue << "is not selected");
@@ -570,15 +610,16 @@ void FoilPicsSelection::unselect(QString aValue)
 
 void FoilPicsSelection::toggleSelection(QString aValue)
 {
-    if (iPrivate->iKeys.contains(aValue)) {
-        if (iPrivate->iSelected.remove(aValue)) {
+    FoilPicsRowIndex* index = &iPrivate->iIndex;
+    if (index->contains(aValue)) {
+        if (index->setFlag(aValue, FoilPicsRowIndex::Selected, false)) {
             HDEBUG("-" << aValue << selectionCount());
-            Q_EMIT selectionChanged(aValue);
+            iPrivate->emitSelectionChanged(aValue);
             Q_EMIT selectionCountChanged();
-        } else if (!iPrivate->iBusy.contains(aValue)) {
-            iPrivate->iSelected.insert(aValue);
+        } else if (!index->flag(aValue, FoilPicsRowIndex::Busy)) {
+            index->setFlag(aValue, FoilPicsRowIndex::Selected, true);
             HDEBUG("+" << aValue << selectionCount());
-            Q_EMIT selectionChanged(aValue);
+            iPrivate->emitSelectionChanged(aValue);
             Q_EMIT selectionCountChanged();
         } else {
             HDEBUG(aValue << "can't be selected because it's busy");
@@ -600,17 +641,7 @@ void FoilPicsSelection::selectAll()
 
 QList<int> FoilPicsSelection::getSelectedRows()
 {
-    QList<int> selection;
-    const QStringList keys = iPrivate->iSelected.values();
-    const int n = keys.count();
-    if (n > 0) {
-        for (int i = 0; i < n; i++) {
-            selection.append(iPrivate->iKeys.value(keys.at(i)));
-        }
-        qSort(selection);
-        HDEBUG(selection);
-    }
-    return selection;
+    return iPrivate->iIndex.flaggedRows(FoilPicsRowIndex::Selected);
 }
 
 QList<int> FoilPicsSelection::makeSelectionBusy()
@@ -618,4 +649,24 @@ QList<int> FoilPicsSelection::makeSelectionBusy()
     return iPrivate->makeSelectionBusy();
 }
 
+void FoilPicsSelection::addSelectionListener(QString aKey, Listener* aListener)
+{
+    iPrivate->iSelectionListeners.insert(aKey, aListener);
+}
+
+void FoilPicsSelection::removeSelectionListener(QString aKey, Listener* aListener)
+{
+    iPrivate->iSelectionListeners.remove(aKey, aListener);
+}
+
+void FoilPicsSelection::addBusyListener(QString aKey, Listener* aListener)
+{
+    iPrivate->iBusyListeners.insert(aKey, aListener);
+}
+
+void FoilPicsSelection::removeBusyListener(QString aKey, Listener* aListener)
+{
+    iPrivate->iBusyListeners.remove(aKey, aListener);
+}
+
 #include "FoilPicsSelection.moc"
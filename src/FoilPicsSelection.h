@@ -77,6 +77,20 @@ public:
     Q_INVOKABLE QList<int> getSelectedRows();
     Q_INVOKABLE QList<int> makeSelectionBusy();
 
+    // Per-key notifications for FoilPicsSelectionState/FoilPicsBusyState,
+    // cheaper than having each of them check every selectionChanged signal
+    class Listener {
+    public:
+        virtual void keyStateChanged() = 0;
+    protected:
+        virtual ~Listener() {}
+    };
+
+    void addSelectionListener(QString aKey, Listener* aListener);
+    void removeSelectionListener(QString aKey, Listener* aListener);
+    void addBusyListener(QString aKey, Listener* aListener);
+    void removeBusyListener(QString aKey, Listener* aListener);
+
 Q_SIGNALS:
     void modelChanged();
     void roleChanged();
@@ -38,19 +38,25 @@
 // FoilPicsSelectionState::Private
 // ==========================================================================
 
-class FoilPicsSelectionState::Private : public QObject {
+class FoilPicsSelectionState::Private :
+    public QObject,
+    public FoilPicsSelection::Listener
+{
     Q_OBJECT
 
 public:
     Private(FoilPicsSelectionState* aParent);
+    ~Private();
 
     FoilPicsSelectionState* parentObject() const;
     void setModel(FoilPicsSelection* aModel);
     void setKey(QString aKey);
     void updateSelected(bool aWasSelected);
 
+    // FoilPicsSelection::Listener
+    void keyStateChanged() Q_DECL_OVERRIDE;
+
 public Q_SLOTS:
-    void onSelectionChanged();
     void onModelDestroyed();
 
 public:
@@ -66,6 +72,13 @@ FoilPicsSelectionState::Private::Private(FoilPicsSelectionState* aParent) :
 {
 }
 
+FoilPicsSelectionState::Private::~Private()
+{
+    if (iModel) {
+        iModel->removeSelectionListener(iKey, this);
+    }
+}
+
 FoilPicsSelectionState* FoilPicsSelectionState::Private::parentObject() const
 {
     return qobject_cast<FoilPicsSelectionState*>(parent());
@@ -77,12 +90,12 @@ void FoilPicsSelectionState::Private::setModel(FoilPicsSelection* aModel)
         const bool wasSelected = iSelected;
         if (iModel) {
             iModel->disconnect(this);
+            iModel->removeSelectionListener(iKey, this);
         }
         iModel = aModel;
         if (iModel) {
             connect(iModel, SIGNAL(destroyed(QObject*)), SLOT(onModelDestroyed()));
-            connect(iModel, SIGNAL(selectionCleared()), SLOT(onSelectionChanged()));
-            connect(iModel, SIGNAL(selectionChanged(QString)), SLOT(onSelectionChanged()));
+            iModel->addSelectionListener(iKey, this);
         }
         updateSelected(wasSelected);
     }
@@ -92,6 +105,10 @@ void FoilPicsSelectionState::Private::setKey(QString aKey)
 {
     if (iKey != aKey) {
         const bool wasSelected = iSelected;
+        if (iModel) {
+            iModel->removeSelectionListener(iKey, this);
+            iModel->addSelectionListener(aKey, this);
+        }
         iKey = aKey;
         Q_EMIT parentObject()->keyChanged();
         updateSelected(wasSelected);
@@ -106,7 +123,7 @@ void FoilPicsSelectionState::Private::updateSelected(bool aWasSelected)
     }
 }
 
-void FoilPicsSelectionState::Private::onSelectionChanged()
+void FoilPicsSelectionState::Private::keyStateChanged()
 {
     updateSelected(iSelected);
 }
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsThumbnail.h"
+
+#include "HarbourDebug.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define THUMBNAIL_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define THUMBNAIL_NEON
+#endif
+
+// Adds a row of source pixels to the per-column channel sums, byte by
+// byte. The vector paths handle 4 pixels (16 bytes) per iteration.
+void FoilPicsThumbnail::addRow(const QRgb* aSrc, int aCount, quint32* aSum)
+{
+    const uchar* src = (const uchar*)aSrc;
+    const int n = aCount * 4;
+    int i = 0;
+#if defined(THUMBNAIL_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        const __m128i px = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i lo = _mm_unpacklo_epi8(px, zero);
+        const __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128i* sum = (__m128i*)(aSum + i);
+        _mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum),
+            _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1),
+            _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(sum + 2, _mm_add_epi32(_mm_loadu_si128(sum + 2),
+            _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(sum + 3, _mm_add_epi32(_mm_loadu_si128(sum + 3),
+            _mm_unpackhi_epi16(hi, zero)));
+    }
+#elif defined(THUMBNAIL_NEON)
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t px = vld1q_u8(src + i);
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+        quint32* sum = aSum + i;
+        vst1q_u32(sum, vaddw_u16(vld1q_u32(sum), vget_low_u16(lo)));
+        vst1q_u32(sum + 4, vaddw_u16(vld1q_u32(sum + 4), vget_high_u16(lo)));
+        vst1q_u32(sum + 8, vaddw_u16(vld1q_u32(sum + 8), vget_low_u16(hi)));
+        vst1q_u32(sum + 12, vaddw_u16(vld1q_u32(sum + 12), vget_high_u16(hi)));
+    }
+#endif
+    for (; i < n; i++) {
+        aSum[i] += src[i];
+    }
+}
+
+// Adds up the column sums [aFrom, aTo) into aOut, 4 channels per column
+void FoilPicsThumbnail::sumColumns(const quint32* aSum, int aFrom, int aTo,
+    quint32* aOut)
+{
+    const quint32* sum = aSum + 4 * aFrom;
+    const quint32* end = aSum + 4 * aTo;
+#if defined(THUMBNAIL_SSE2)
+    __m128i acc = _mm_setzero_si128();
+    for (; sum < end; sum += 4) {
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)sum));
+    }
+    _mm_storeu_si128((__m128i*)aOut, acc);
+#elif defined(THUMBNAIL_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; sum < end; sum += 4) {
+        acc = vaddq_u32(acc, vld1q_u32(sum));
+    }
+    vst1q_u32(aOut, acc);
+#else
+    quint32 c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    for (; sum < end; sum += 4) {
+        c0 += sum[0]; c1 += sum[1]; c2 += sum[2]; c3 += sum[3];
+    }
+    aOut[0] = c0; aOut[1] = c1; aOut[2] = c2; aOut[3] = c3;
+#endif
+}
+
+QImage FoilPicsThumbnail::make(const QImage aImage, QSize aSize, int aRotate)
+{
+    const int w = aSize.width();
+    const int h = aSize.height();
+    const int rotate = ((aRotate % 360) + 360) % 360;
+    const int sw = aImage.width();
+    const int sh = aImage.height();
+    if (w <= 0 || h <= 0 || sw < w || sh < h || (rotate % 90)) {
+        return QImage();
+    }
+
+    // Work with 32-bit pixels, premultiplied if there's alpha, so that
+    // the transparent pixels don't bleed their color into the average
+    QImage src(aImage);
+    QImage::Format format = src.format();
+    if (format != QImage::Format_RGB32 &&
+        format != QImage::Format_ARGB32_Premultiplied) {
+        format = src.hasAlphaChannel() ?
+            QImage::Format_ARGB32_Premultiplied :
+            QImage::Format_RGB32;
+        src = src.convertToFormat(format);
+    }
+
+    // The area of the source image covering the thumbnail
+    int cw, ch;
+    if ((qint64)sw * h > (qint64)w * sh) {
+        ch = sh;
+        cw = (int)(((qint64)sh * w) / h);
+    } else {
+        cw = sw;
+        ch = (int)(((qint64)sw * h) / w);
+    }
+    const int x0 = (sw - cw) / 2;
+    const int y0 = (sh - ch) / 2;
+
+    // Boundaries of the cropped columns and source rows for each
+    // thumbnail pixel
+    QVector<int> columns(w + 1);
+    QVector<int> rows(h + 1);
+    int i;
+    for (i = 0; i <= w; i++) {
+        columns[i] = (int)(((qint64)cw * i) / w);
+    }
+    for (i = 0; i <= h; i++) {
+        rows[i] = y0 + (int)(((qint64)ch * i) / h);
+    }
+
+    const bool transpose = (rotate == 90 || rotate == 270);
+    QImage dest(transpose ? h : w, transpose ? w : h, format);
+    if (dest.isNull()) {
+        return QImage();
+    }
+
+    // Walk the source top to bottom, one band of rows per thumbnail row.
+    // Each source row is added to the per-column sums as a whole, then
+    // the columns are added up once per band.
+    QVector<quint32> sums(4 * cw);
+    uchar* destBits = dest.bits();
+    const int destStride = dest.bytesPerLine();
+    for (int oy = 0; oy < h; oy++) {
+        const int top = rows[oy];
+        const int bottom = rows[oy + 1];
+        quint32* sum = sums.data();
+        memset(sum, 0, sizeof(quint32) * sums.size());
+        for (int sy = top; sy < bottom; sy++) {
+            addRow((const QRgb*)src.constScanLine(sy) + x0, cw, sum);
+        }
+        for (int ox = 0; ox < w; ox++) {
+            quint32 acc[4];
+            sumColumns(sum, columns[ox], columns[ox + 1], acc);
+            const quint32 area = (quint32)(columns[ox + 1] - columns[ox]) *
+                (bottom - top);
+            const quint32 half = area / 2;
+            int dx, dy;
+            switch (rotate) {
+            default:  dx = ox; dy = oy; break;
+            case 90:  dx = oy; dy = w - 1 - ox; break;
+            case 180: dx = w - 1 - ox; dy = h - 1 - oy; break;
+            case 270: dx = h - 1 - oy; dy = ox; break;
+            }
+            // Same byte order as the source
+            uchar* px = destBits + dy * destStride + dx * 4;
+            px[0] = (uchar)((acc[0] + half) / area);
+            px[1] = (uchar)((acc[1] + half) / area);
+            px[2] = (uchar)((acc[2] + half) / area);
+            px[3] = (uchar)((acc[3] + half) / area);
+        }
+    }
+    HDEBUG(aImage.size() << "=>" << dest.size() << rotate);
+    return dest;
+}
@@ -32,6 +32,7 @@
  */
 
 #include "FoilPicsThumbnailProvider.h"
+#include "FoilPicsThumbnail.h"
 #include "HarbourDebug.h"
 
 #include <QQmlContext>
@@ -75,15 +76,17 @@ void FoilPicsThumbnailProvider::release()
     }
 }
 
-QString FoilPicsThumbnailProvider::addThumbnail(QString aId, QImage aImage)
+QString FoilPicsThumbnailProvider::prefix() const
+{
+    return iPrefix;
+}
+
+void FoilPicsThumbnailProvider::addThumbnail(QString aId, QImage aImage)
 {
-    QString thumbSource;
     if (!aId.isEmpty() && !aImage.isNull()) {
         QMutexLocker locker(&iMutex);
         iImageMap.insert(aId, aImage);
-        thumbSource = iPrefix + aId;
     }
-    return thumbSource;
 }
 
 void FoilPicsThumbnailProvider::releaseThumbnail(QString aId)
@@ -95,8 +98,30 @@ void FoilPicsThumbnailProvider::releaseThumbnail(QString aId)
 QImage FoilPicsThumbnailProvider::requestImage(const QString& aId,
     QSize* aSize, const QSize& aRequested)
 {
-    QMutexLocker locker(&iMutex);
-    QImage image = iImageMap.value(aId);
+    iMutex.lock();
+    QImage image(iImageMap.value(aId));
+    iMutex.unlock();
+
+    // Only one size is kept in memory, smaller ones are made on demand
+    const int w = image.width();
+    const int h = image.height();
+    if (!image.isNull() && (aRequested.width() > 0 ||
+        aRequested.height() > 0)) {
+        QSize size(aRequested);
+        if (size.width() <= 0) {
+            size.setWidth(qMax(1, (int)((qint64)w * size.height() / h)));
+        } else if (size.height() <= 0) {
+            size.setHeight(qMax(1, (int)((qint64)h * size.width() / w)));
+        } else {
+            size = image.size().scaled(size, Qt::KeepAspectRatio);
+        }
+        if (size.width() < w && size.height() < h) {
+            const QImage scaled(FoilPicsThumbnail::make(image, size, 0));
+            if (!scaled.isNull()) {
+                image = scaled;
+            }
+        }
+    }
     if (aSize) {
         *aSize = image.size();
     }
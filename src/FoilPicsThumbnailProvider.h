@@ -51,7 +51,8 @@ public:
     static FoilPicsThumbnailProvider* createForObject(QObject* aObject);
     void release();
 
-    QString addThumbnail(QString aId, QImage aImage);
+    QString prefix() const;
+    void addThumbnail(QString aId, QImage aImage);
     void releaseThumbnail(QString aId);
 
     virtual QImage requestImage(const QString& aId, QSize* aSize,
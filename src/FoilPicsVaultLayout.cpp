@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FoilPicsVaultLayout.h"
+
+#include "HarbourDebug.h"
+
+#include <QFile>
+#include <QFileInfo>
+
+#include <glib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ID_LENGTH (16)
+#define SHARD_NAME_LENGTH (2)
+#define SHARD_DIR_MODE (0755)
+
+// ==========================================================================
+// FoilPicsVaultLayout::Private
+// ==========================================================================
+
+class FoilPicsVaultLayout::Private {
+public:
+    static bool isShardName(const char* aName);
+    static void listDir(QString aDir, QString aShard, Files* aFiles);
+};
+
+bool FoilPicsVaultLayout::Private::isShardName(const char* aName)
+{
+    // Two lower case hex digits
+    for (int i = 0; i < SHARD_NAME_LENGTH; i++) {
+        const char c = aName[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return !aName[SHARD_NAME_LENGTH];
+}
+
+void FoilPicsVaultLayout::Private::listDir(QString aDir, QString aShard,
+    Files* aFiles)
+{
+    // Straight from the directory entries without stat'ing each file.
+    // Hidden files (which includes the catalog and the thumbnail
+    // segments) are skipped.
+    const QString dirPath(aShard.isEmpty() ? aDir : (aDir + "/" + aShard));
+    const QByteArray path(dirPath.toUtf8());
+    const int level = aShard.isEmpty() ? 0 : (aShard.count('/') + 1);
+    DIR* dir = opendir(path.constData());
+    if (dir) {
+        const struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char* name = entry->d_name;
+            if (name[0] == '.') {
+                continue;
+            } else if (level < 2 && isShardName(name) &&
+                (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)) {
+                // DT_UNKNOWN may be either, opendir will tell
+                const QString shard(QString::fromLatin1(name));
+                listDir(aDir, level ? (aShard + "/" + shard) : shard, aFiles);
+            } else if (entry->d_type == DT_REG ||
+                entry->d_type == DT_UNKNOWN) {
+                const QString fileName(QString::fromUtf8(name));
+                // Files in the shard directories must belong there
+                if (level == 0 || (level == 2 && shardOf(fileName) == aShard)) {
+                    aFiles->insert(fileName, dirPath + "/" + fileName);
+                }
+            }
+        }
+        closedir(dir);
+    }
+}
+
+// ==========================================================================
+// FoilPicsVaultLayout
+// ==========================================================================
+
+bool FoilPicsVaultLayout::isId(QString aName)
+{
+    if (aName.length() == ID_LENGTH) {
+        const ushort* c = aName.utf16();
+        for (int i = 0; i < ID_LENGTH; i++) {
+            const ushort x = c[i];
+            if (!((x >= '0' && x <= '9') || (x >= 'A' && x <= 'F'))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+QString FoilPicsVaultLayout::shardOf(QString aName)
+{
+    // ABCD... => ab/cd
+    return isId(aName) ? (aName.left(SHARD_NAME_LENGTH).toLower() + "/" +
+        aName.mid(SHARD_NAME_LENGTH, SHARD_NAME_LENGTH).toLower()) :
+        QString();
+}
+
+QString FoilPicsVaultLayout::filePath(QString aDir, QString aName,
+    bool aSharded)
+{
+    const QString shard(aSharded ? shardOf(aName) : QString());
+    return shard.isEmpty() ? (aDir + "/" + aName) :
+        (aDir + "/" + shard + "/" + aName);
+}
+
+// Opens the file for reading where the current layout says it should be
+// and, only if it's not there, in the other layout. Returns the file
+// descriptor (or -1) and the path where the file has been found (or the
+// current layout path if it hasn't been found at all).
+int FoilPicsVaultLayout::open(QString aDir, QString aName, bool aSharded,
+    QString* aPath)
+{
+    const QString path(filePath(aDir, aName, aSharded));
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    *aPath = path;
+    if (fd < 0 && errno == ENOENT && isId(aName)) {
+        const QString other(filePath(aDir, aName, !aSharded));
+        fd = ::open(QFile::encodeName(other).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            *aPath = other;
+        }
+    }
+    return fd;
+}
+
+QString FoilPicsVaultLayout::locate(QString aDir, QString aName,
+    bool aSharded)
+{
+    QString path;
+    const int fd = open(aDir, aName, aSharded, &path);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return path;
+}
+
+QString FoilPicsVaultLayout::vaultDir(QString aPath)
+{
+    const QFileInfo info(aPath);
+    const QString dir(info.path());
+    const QString shard(shardOf(info.fileName()));
+    if (!shard.isEmpty() && dir.endsWith("/" + shard)) {
+        return dir.left(dir.length() - shard.length() - 1);
+    }
+    return dir;
+}
+
+QString FoilPicsVaultLayout::resolve(QString aPath)
+{
+    // The file may have been moved to the other layout since the path
+    // was handed out
+    if (access(QFile::encodeName(aPath).constData(), F_OK)) {
+        const QFileInfo info(aPath);
+        const QString name(info.fileName());
+        if (isId(name)) {
+            const QString dir(vaultDir(aPath));
+            const bool sharded = (dir != info.path());
+            const QString other(filePath(dir, name, !sharded));
+            if (!access(QFile::encodeName(other).constData(), F_OK)) {
+                return other;
+            }
+        }
+    }
+    return aPath;
+}
+
+// Path of another file in the same vault as aPath, preferring the same
+// layout (e.g. the thumbnail of the image)
+QString FoilPicsVaultLayout::siblingPath(QString aPath, QString aName)
+{
+    const QString dir(vaultDir(aPath));
+    return locate(dir, aName, dir != QFileInfo(aPath).path());
+}
+
+FoilPicsVaultLayout::Files FoilPicsVaultLayout::listFiles(QString aDir)
+{
+    Files files;
+    Private::listDir(aDir, QString(), &files);
+    return files;
+}
+
+// Moves the file into its place in the requested layout. Returns the
+// new path, or an empty string if the file didn't have to or couldn't
+// be moved.
+QString FoilPicsVaultLayout::move(QString aDir, QString aPath, bool aSharded)
+{
+    const QString name(QFileInfo(aPath).fileName());
+    const QString dest(filePath(aDir, name, aSharded));
+    if (dest != aPath) {
+        const QByteArray from(QFile::encodeName(aPath));
+        const QByteArray to(QFile::encodeName(dest));
+        if (aSharded) {
+            const QByteArray shardDir(QFile::encodeName(QFileInfo(dest).
+                path()));
+            if (g_mkdir_with_parents(shardDir.constData(), SHARD_DIR_MODE)) {
+                HWARN("Failed to create" << shardDir.constData() <<
+                    strerror(errno));
+                return QString();
+            }
+        }
+        if (rename(from.constData(), to.constData()) == 0) {
+            HDEBUG(from.constData() << "=>" << to.constData());
+            if (!aSharded) {
+                // Drop the shard directories once they are empty
+                const QString shardDir(QFileInfo(aPath).path());
+                if (rmdir(QFile::encodeName(shardDir).constData()) == 0) {
+                    rmdir(QFile::encodeName(QFileInfo(shardDir).path()).
+                        constData());
+                }
+            }
+            return dest;
+        }
+        HWARN("Failed to move" << from.constData() << strerror(errno));
+    }
+    return QString();
+}
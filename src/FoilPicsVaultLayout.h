@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_VAULT_LAYOUT_H
+#define FOILPICS_VAULT_LAYOUT_H
+
+#include <QHash>
+#include <QString>
+
+// Where the encrypted files live inside the vault directory. In the flat
+// layout all of them are right in the vault directory. In the sharded
+// layout a file named ABCDEF0123456789 (random id generated by
+// createFoilFile) goes to ab/cd/ABCDEF0123456789, which keeps individual
+// directories small no matter how many pictures there are. Files with
+// other names (catalog, thumbnail segments) always stay at the top.
+//
+// The two layouts may coexist while the files are being moved from one
+// to the other, lookups fall back to the other location. The fallback
+// only costs an extra system call when the file isn't where the current
+// layout says it should be.
+class FoilPicsVaultLayout {
+private:
+    FoilPicsVaultLayout();
+    Q_DISABLE_COPY(FoilPicsVaultLayout)
+
+public:
+    typedef QHash<QString,QString> Files; // Name => path
+
+    static bool isId(QString aName);
+    static QString shardOf(QString aName);
+    static QString filePath(QString aDir, QString aName, bool aSharded);
+    static int open(QString aDir, QString aName, bool aSharded,
+        QString* aPath);
+    static QString locate(QString aDir, QString aName, bool aSharded);
+    static QString vaultDir(QString aPath);
+    static QString resolve(QString aPath);
+    static QString siblingPath(QString aPath, QString aName);
+    static Files listFiles(QString aDir);
+    static QString move(QString aDir, QString aPath, bool aSharded);
+
+private:
+    class Private;
+};
+
+#endif // FOILPICS_VAULT_LAYOUT_H
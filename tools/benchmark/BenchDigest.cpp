@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmark.h"
+
+#include "foil_digest.h"
+#include "foil_key.h"
+#include "foil_output.h"
+#include "foil_private_key.h"
+#include "foil_util.h"
+#include "foilmsg.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Compares hashing the plaintext after encrypting it (what EncryptTask
+// used to do) with hashing it in chunks in the read stage before the
+// encryptor gets to it (what ReadFileTask does now). The page cache is
+// dropped for the file before each run, so that the first pass has to
+// go to the disk in both cases.
+
+#define CHUNK_SIZE (1024*1024)
+
+// Maps the file with a cold page cache, mapped pages can't be dropped
+static GMappedFile* mapCold(const char* aPath, FoilBytes* aBytes)
+{
+    const int fd = open(aPath, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    GMappedFile* map = g_mapped_file_new(aPath, FALSE, NULL);
+    if (map) {
+        aBytes->val = (guint8*)g_mapped_file_get_contents(map);
+        aBytes->len = g_mapped_file_get_length(map);
+    }
+    return map;
+}
+
+static void encrypt(const FoilBytes* aBytes, FoilPrivateKey* aPrivate,
+    FoilKey* aPublic)
+{
+    FoilMsgEncryptOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.key_type = FOILMSG_KEY_AES_256;
+    FoilOutput* out = foil_output_mem_new(NULL);
+    foilmsg_encrypt(out, aBytes, "image/jpeg", NULL, aPrivate, aPublic,
+        &opt, NULL);
+    foil_output_unref(out);
+}
+
+static void digestChunks(GType aType, const FoilBytes* aBytes)
+{
+    FoilDigest* digest = foil_digest_new(aType);
+    for (gsize off = 0; off < aBytes->len; off += CHUNK_SIZE) {
+        foil_digest_update(digest, aBytes->val + off,
+            MIN(aBytes->len - off, CHUNK_SIZE));
+    }
+    foil_digest_finish(digest);
+    foil_digest_unref(digest);
+}
+
+int benchDigest(int aArgc, char* aArgv[])
+{
+    if (aArgc < 2) {
+        printf("Usage: digest FILE [COUNT]\n");
+        return 1;
+    }
+
+    const char* path = aArgv[1];
+    const int count = (aArgc > 2) ? atoi(aArgv[2]) : 5;
+    FoilBytes bytes;
+    GMappedFile* probe = mapCold(path, &bytes);
+    if (!probe) {
+        printf("Can't open %s\n", path);
+        return 1;
+    }
+    printf("%s: %lu bytes\n", path, (gulong)bytes.len);
+    g_mapped_file_unref(probe);
+
+    FoilKey* key = foil_key_generate_new(FOIL_KEY_RSA_PRIVATE, 2048);
+    FoilPrivateKey* priv = FOIL_PRIVATE_KEY(key);
+    FoilKey* pub = foil_public_key_new_from_private(priv);
+
+    benchRun("md5", count, [&]() {
+        GMappedFile* map = mapCold(path, &bytes);
+        digestChunks(FOIL_DIGEST_MD5, &bytes);
+        g_mapped_file_unref(map);
+    });
+    benchRun("sha256", count, [&]() {
+        GMappedFile* map = mapCold(path, &bytes);
+        digestChunks(FOIL_DIGEST_SHA256, &bytes);
+        g_mapped_file_unref(map);
+    });
+    benchRun("encrypt", count, [&]() {
+        GMappedFile* map = mapCold(path, &bytes);
+        encrypt(&bytes, priv, pub);
+        g_mapped_file_unref(map);
+    });
+    benchRun("encrypt, then md5 (old)", count, [&]() {
+        GMappedFile* map = mapCold(path, &bytes);
+        encrypt(&bytes, priv, pub);
+        g_bytes_unref(foil_digest_data(FOIL_DIGEST_MD5, bytes.val,
+            bytes.len));
+        g_mapped_file_unref(map);
+    });
+    benchRun("chunked sha256, then encrypt (new)", count, [&]() {
+        GMappedFile* map = mapCold(path, &bytes);
+        digestChunks(FOIL_DIGEST_SHA256, &bytes);
+        encrypt(&bytes, priv, pub);
+        g_mapped_file_unref(map);
+    });
+
+    foil_key_unref(pub);
+    foil_key_unref(key);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmark.h"
+#include "FoilPicsModelData.h"
+
+#include "foil_key.h"
+#include "foil_output.h"
+#include "foil_private_key.h"
+#include "foilmsg.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+
+// Loads the same rows the way DecryptPicsTask does and reports the heap
+// taken by each of them, with and without the camera metadata. Paths
+// and titles are typical of the pictures taken by the Jolla camera.
+
+#define PATH_FORMAT "/home/nemo/Pictures/Camera/20180704_%06d.jpg"
+#define VAULT_FORMAT "/home/nemo/Documents/FoilPics/%02X/%02X/%06X"
+
+static FoilMsg* makeMsg(FoilPrivateKey* aPrivate, FoilKey* aPublic,
+    bool aExif)
+{
+    FoilMsgHeader header[] = {
+        { HEADER_ORIGINAL_PATH, "/home/nemo/Pictures/Camera/IMG.jpg" },
+        { HEADER_ORIGINAL_SIZE, "2411829" },
+        { HEADER_TITLE, "IMG" },
+        { HEADER_IMAGE_ID, "5E884898DA28047151D0E56F8DC6292773603D0D"
+            "6AABBDD62A11EF721D1542D8" },
+        { HEADER_MODIFICATION_TIME, "2018-07-04T16:02:33.000000Z" },
+        { HEADER_ACCESS_TIME, "2018-07-04T16:02:33.000000Z" },
+        { HEADER_ORIENTATION, "90" },
+        { HEADER_IMAGE_DATE, "2018-07-04T16:02:31.000000Z" },
+        { HEADER_CAMERA_MANUFACTURER, "Jolla" },
+        { HEADER_CAMERA_MODEL, "Jolla C" },
+        { HEADER_LATITUDE, "60.1699" },
+        { HEADER_LONGITUDE, "24.9384" },
+        { HEADER_ALTITUDE, "12.5" }
+    };
+
+    static const char data[] = "not a picture";
+    FoilBytes bytes;
+    bytes.val = (const guint8*)data;
+    bytes.len = sizeof(data);
+
+    FoilMsgHeaders headers;
+    headers.header = header;
+    headers.count = aExif ? G_N_ELEMENTS(header) : 7;
+
+    FoilMsgEncryptOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.key_type = FOILMSG_KEY_AES_256;
+
+    FoilOutput* out = foil_output_mem_new(NULL);
+    foilmsg_encrypt(out, &bytes, "image/jpeg", &headers, aPrivate, aPublic,
+        &opt, NULL);
+    GBytes* encrypted = foil_output_free_to_bytes(out);
+    FoilMsg* msg = foilmsg_decrypt(aPrivate, encrypted, NULL);
+    g_bytes_unref(encrypted);
+    return msg;
+}
+
+static void benchRows(const char* aName, int aCount, const FoilMsg* aMsg,
+    FoilPicsModelData::Strings* aStrings)
+{
+    FoilPicsModelData::List rows;
+    rows.reserve(aCount);
+    const QImage thumb; // The thumbnail provider holds the thumbnails
+    const int before = mallinfo().uordblks;
+    for (int i = 0; i < aCount; i++) {
+        char path[64], vault[64];
+        snprintf(path, sizeof(path), PATH_FORMAT, i);
+        snprintf(vault, sizeof(vault), VAULT_FORMAT, i & 0xff,
+            (i >> 8) & 0xff, i);
+        rows.append(FoilPicsModelData::fromFoilMsg(aStrings,
+            (FoilMsg*)aMsg, path, QSize(3264, 2448), vault,
+            QString(vault) + "t", thumb, aMsg->content_type, 90));
+    }
+    const int after = mallinfo().uordblks;
+    printf("%-40s %10.1f bytes/row\n", aName,
+        ((double)(after - before)) / aCount);
+    qDeleteAll(rows);
+}
+
+int benchModelData(int aArgc, char* aArgv[])
+{
+    const int count = (aArgc > 1) ? atoi(aArgv[1]) : 10000;
+    if (count <= 0) {
+        printf("Usage: modeldata [COUNT]\n");
+        return 1;
+    }
+
+    FoilKey* key = foil_key_generate_new(FOIL_KEY_RSA_PRIVATE, 2048);
+    FoilPrivateKey* priv = FOIL_PRIVATE_KEY(key);
+    FoilKey* pub = foil_public_key_new_from_private(priv);
+    FoilMsg* plain = makeMsg(priv, pub, false);
+    FoilMsg* exif = makeMsg(priv, pub, true);
+
+    if (plain && exif) {
+        FoilPicsModelData::Strings::Ptr strings(new FoilPicsModelData::Strings);
+        printf("%d rows, sizeof(FoilPicsModelData) = %u, "
+            "sizeof(Exif) = %u\n", count, (uint)sizeof(FoilPicsModelData),
+            (uint)sizeof(FoilPicsModelData::Exif));
+        benchRows("without camera metadata", count, plain, strings.data());
+        benchRows("with camera metadata", count, exif, strings.data());
+    } else {
+        printf("Failed to encrypt/decrypt the headers\n");
+    }
+
+    if (plain) foilmsg_free(plain);
+    if (exif) foilmsg_free(exif);
+    foil_key_unref(pub);
+    foil_key_unref(key);
+    return 0;
+}
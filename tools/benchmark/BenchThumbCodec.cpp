@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmark.h"
+#include "FoilPicsThumbnail.h"
+
+#include <QBuffer>
+#include <QImageWriter>
+
+#include <stdlib.h>
+
+// Encodes a thumbnail in each of the formats offered by the
+// thumbnailFormat option and times decoding it, which is what unlock
+// does for every picture. The raw formats are decoded the way
+// decodeThumbLevel does it, by copying the pixels.
+
+static QByteArray encodeRaw(const QImage aImage, QImage::Format aFormat)
+{
+    const QImage pixels(aImage.convertToFormat(aFormat));
+    const int bpl = pixels.width() * pixels.depth() / 8;
+    QByteArray data;
+    data.reserve(bpl * pixels.height());
+    for (int y = 0; y < pixels.height(); y++) {
+        data.append((const char*)pixels.constScanLine(y), bpl);
+    }
+    return data;
+}
+
+static QByteArray encode(const QImage aImage, const char* aFormat,
+    int aQuality)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    aImage.save(&buffer, aFormat, aQuality);
+    return data;
+}
+
+static void benchCodec(const char* aName, int aCount, const QImage aThumb,
+    const char* aFormat, int aQuality, QImage::Format aRaw)
+{
+    QByteArray data;
+    const bool raw = (aRaw != QImage::Format_Invalid);
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s encode", aName);
+    benchRun(name, aCount, [&]() {
+        data = raw ? encodeRaw(aThumb, aRaw) :
+            encode(aThumb, aFormat, aQuality);
+    });
+    snprintf(name, sizeof(name), "%s decode", aName);
+    const int bpl = aThumb.width() * ((aRaw == QImage::Format_RGB16) ? 2 : 4);
+    benchRun(name, aCount, [&]() {
+        if (raw) {
+            QImage((const uchar*)data.constData(), aThumb.width(),
+                aThumb.height(), bpl, aRaw).copy();
+        } else {
+            QImage::fromData(data, aFormat);
+        }
+    });
+    printf("%-40s %10d bytes\n", aName, data.size());
+}
+
+int benchThumbCodec(int aArgc, char* aArgv[])
+{
+    if (aArgc < 2) {
+        printf("Usage: codec FILE [SIZE] [COUNT]\n");
+        return 1;
+    }
+
+    const QImage image(QString::fromLocal8Bit(aArgv[1]));
+    const int size = (aArgc > 2) ? atoi(aArgv[2]) : 256;
+    const int count = (aArgc > 3) ? atoi(aArgv[3]) : 20;
+    if (image.isNull()) {
+        printf("Can't load %s\n", aArgv[1]);
+        return 1;
+    }
+
+    const QImage thumb(FoilPicsThumbnail::make(image.convertToFormat(
+        QImage::Format_RGB32), QSize(size, size), 0));
+    if (thumb.isNull()) {
+        printf("%s is smaller than %dx%d\n", aArgv[1], size, size);
+        return 1;
+    }
+    printf("%s: %dx%d thumbnail\n", aArgv[1], size, size);
+
+    benchCodec("png", count, thumb, "PNG", -1, QImage::Format_Invalid);
+    benchCodec("jpeg 85", count, thumb, "JPEG", 85, QImage::Format_Invalid);
+    if (QImageWriter::supportedImageFormats().contains("webp")) {
+        benchCodec("webp", count, thumb, "WEBP", -1, QImage::Format_Invalid);
+    }
+    benchCodec("argb32", count, thumb, NULL, -1,
+        QImage::Format_ARGB32_Premultiplied);
+    benchCodec("rgb565", count, thumb, NULL, -1, QImage::Format_RGB16);
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmark.h"
+#include "FoilPicsThumbnail.h"
+
+#include <QTransform>
+
+#include <stdlib.h>
+
+// Compares the QImage path (smooth scale, crop, then rotate, which is
+// what ModelData::thumbnail falls back to) with the single pass kernel,
+// at each of the right angles.
+
+static QImage thumbnailQt(const QImage aImage, QSize aSize, int aRotate)
+{
+    QImage cropped;
+    const QSize imageSize(aImage.size());
+    const Qt::TransformationMode txMode(Qt::SmoothTransformation);
+    if (imageSize.width()*aSize.height() > aSize.width()*imageSize.height()) {
+        QImage scaled(aImage.scaledToHeight(aSize.height(), txMode));
+        const int x = (scaled.width() - aSize.width())/2;
+        cropped = scaled.copy(x, 0, aSize.width(), aSize.height());
+    } else {
+        QImage scaled(aImage.scaledToWidth(aSize.width(), txMode));
+        const int y = (scaled.height() - aSize.height())/2;
+        cropped = scaled.copy(0, y, aSize.width(), aSize.height());
+    }
+    if (aRotate) {
+        const qreal x = ((qreal)aSize.width())/2;
+        const qreal y = ((qreal)aSize.height())/2;
+        return cropped.transformed(QTransform::fromTranslate(x, y).
+            rotate(-aRotate).translate(-x, -y));
+    } else {
+        return cropped;
+    }
+}
+
+int benchThumbnail(int aArgc, char* aArgv[])
+{
+    if (aArgc < 2) {
+        printf("Usage: thumbnail FILE [SIZE] [COUNT]\n");
+        return 1;
+    }
+
+    const QImage image(QString::fromLocal8Bit(aArgv[1]));
+    const int size = (aArgc > 2) ? atoi(aArgv[2]) : 256;
+    const int count = (aArgc > 3) ? atoi(aArgv[3]) : 10;
+    if (image.isNull()) {
+        printf("Can't load %s\n", aArgv[1]);
+        return 1;
+    }
+    printf("%s: %dx%d => %dx%d\n", aArgv[1], image.width(), image.height(),
+        size, size);
+
+    // Both paths get the same 32-bit input
+    const QImage src(image.convertToFormat(image.hasAlphaChannel() ?
+        QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32));
+    const QSize thumbSize(size, size);
+    for (int rotate = 0; rotate < 360; rotate += 90) {
+        char name[64];
+        snprintf(name, sizeof(name), "QImage, %d degrees", rotate);
+        benchRun(name, count, [&]() {
+            thumbnailQt(src, thumbSize, rotate);
+        });
+        snprintf(name, sizeof(name), "single pass, %d degrees", rotate);
+        benchRun(name, count, [&]() {
+            FoilPicsThumbnail::make(src, thumbSize, rotate);
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FOILPICS_BENCHMARK_H
+#define FOILPICS_BENCHMARK_H
+
+#include <QElapsedTimer>
+
+#include <stdio.h>
+
+// Each test returns the process exit status
+int benchDigest(int aArgc, char* aArgv[]);
+int benchThumbnail(int aArgc, char* aArgv[]);
+int benchThumbCodec(int aArgc, char* aArgv[]);
+int benchModelData(int aArgc, char* aArgv[]);
+
+// Runs aRun aCount times, prints and returns the best time in ms
+template <typename F>
+double benchRun(const char* aName, int aCount, F aRun)
+{
+    double best = 0;
+    for (int i = 0; i < aCount; i++) {
+        QElapsedTimer timer;
+        timer.start();
+        aRun();
+        const double ms = timer.nsecsElapsed() / 1000000.0;
+        if (!i || ms < best) best = ms;
+    }
+    printf("%-40s %10.2f ms\n", aName, best);
+    return best;
+}
+
+#endif // FOILPICS_BENCHMARK_H
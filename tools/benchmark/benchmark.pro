@@ -0,0 +1,66 @@
+# Standalone timing tool, not part of the application build:
+#
+#   qmake tools/benchmark/benchmark.pro && make
+#   ./benchmark <test> [args...]
+#
+# Run without arguments to list the tests.
+
+TEMPLATE = app
+TARGET = benchmark
+CONFIG += console link_pkgconfig
+CONFIG -= app_bundle
+PKGCONFIG += glib-2.0 gobject-2.0 libcrypto
+QT += gui
+
+QMAKE_CXXFLAGS += -Wno-unused-parameter -Wno-psabi
+QMAKE_CFLAGS += -Wno-unused-parameter
+
+# Directories
+TOP_DIR = $${_PRO_FILE_PWD_}/../..
+SRC_DIR = $${TOP_DIR}/src
+
+LIBGLIBUTIL_DIR = $${TOP_DIR}/libglibutil
+LIBGLIBUTIL_INCLUDE = $${LIBGLIBUTIL_DIR}/include
+
+FOIL_DIR = $${TOP_DIR}/foil
+LIBFOIL_DIR = $${FOIL_DIR}/libfoil
+LIBFOIL_INCLUDE = $${LIBFOIL_DIR}/include
+LIBFOIL_SRC = $${LIBFOIL_DIR}/src
+
+LIBFOILMSG_DIR = $${FOIL_DIR}/libfoilmsg
+LIBFOILMSG_INCLUDE = $${LIBFOILMSG_DIR}/include
+LIBFOILMSG_SRC = $${LIBFOILMSG_DIR}/src
+
+INCLUDEPATH += \
+    $${SRC_DIR} \
+    $${TOP_DIR}/harbour-lib/include \
+    $${LIBFOIL_SRC} \
+    $${LIBFOIL_INCLUDE} \
+    $${LIBFOILMSG_INCLUDE} \
+    $${LIBGLIBUTIL_INCLUDE}
+
+HEADERS += \
+    Benchmark.h
+
+SOURCES += \
+    BenchDigest.cpp \
+    BenchModelData.cpp \
+    BenchThumbCodec.cpp \
+    BenchThumbnail.cpp \
+    main.cpp
+
+HEADERS += \
+    $${SRC_DIR}/FoilPicsModelData.h \
+    $${SRC_DIR}/FoilPicsTask.h \
+    $${SRC_DIR}/FoilPicsThumbnail.h
+
+SOURCES += \
+    $${SRC_DIR}/FoilPicsModelData.cpp \
+    $${SRC_DIR}/FoilPicsTask.cpp \
+    $${SRC_DIR}/FoilPicsThumbnail.cpp
+
+SOURCES += \
+    $${LIBFOIL_SRC}/*.c \
+    $${LIBFOIL_SRC}/openssl/*.c \
+    $${LIBFOILMSG_SRC}/*.c \
+    $${LIBGLIBUTIL_DIR}/src/*.c
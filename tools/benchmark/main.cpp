@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 Jolla Ltd.
+ * Copyright (C) 2018 Slava Monich <slava@monich.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the name of Jolla Ltd nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmark.h"
+
+#include <string.h>
+
+static const struct BenchmarkTest {
+    const char* name;
+    const char* args;
+    int (*run)(int aArgc, char* aArgv[]);
+} benchmarks[] = {
+    { "digest", "FILE [COUNT]", benchDigest },
+    { "thumbnail", "FILE [SIZE] [COUNT]", benchThumbnail },
+    { "codec", "FILE [SIZE] [COUNT]", benchThumbCodec },
+    { "modeldata", "[COUNT]", benchModelData }
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1) {
+        for (size_t i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); i++) {
+            if (!strcmp(argv[1], benchmarks[i].name)) {
+                return benchmarks[i].run(argc - 1, argv + 1);
+            }
+        }
+    }
+    printf("Usage: %s TEST [ARGS]\n\nTests:\n", argv[0]);
+    for (size_t i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); i++) {
+        printf("  %s %s\n", benchmarks[i].name, benchmarks[i].args);
+    }
+    return 1;
+}
@@ -96,6 +96,14 @@
         <extracomment>Pop-up notification</extracomment>
         <translation>Conraseña cambiada</translation>
     </message>
+    <message id="foilpics-notification-duplicates_skipped" numerus="yes">
+        <source>%0 picture(s) already encrypted, left in place</source>
+        <extracomment>Pop-up notification</extracomment>
+        <translation type="unfinished">
+            <numerusform></numerusform>
+            <numerusform></numerusform>
+        </translation>
+    </message>
     <message id="foilpics-hint-swipe_left_to_gallery">
         <source>Swipe left to access the picture gallery</source>
         <extracomment>Left swipe hint text</extracomment>